@@ -9,6 +9,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <string.h>
 
 #include "ckpool.h"
@@ -134,16 +135,349 @@ out:
 }
 
 static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"]}]}\n";
+static const char *gbtlight_req = "{\"method\": \"getblocktemplatelight\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"]}]}\n";
+
+/* A cursor over the raw json text of a getblocktemplate response. Templates
+ * can be tens of megabytes so the transactions are parsed straight out of the
+ * receive buffer into the gbtbase instead of being decoded into json. */
+struct gbt_parser {
+	const char *p;
+	const char *end;
+	gbtbase_t *gbt;
+
+	/* Every member of the result except transactions */
+	json_t *result;
+
+	/* Transactions parsed so far, data still points into the response */
+	int txns;
+	int maxtxns;
+	const char **data;
+	int *datalen;
+	uchar *txidbin;
+	uchar *wtxidbin;
+	/* Sum of the transaction fees, -1 if any are missing */
+	int64_t fees;
+};
+
+typedef struct gbt_parser gbt_parser_t;
+
+static void gp_space(gbt_parser_t *gp)
+{
+	while (gp->p < gp->end && isspace((uchar)*gp->p))
+		gp->p++;
+}
+
+/* Consume c if it is the next non whitespace character */
+static bool gp_char(gbt_parser_t *gp, const char c)
+{
+	gp_space(gp);
+	if (gp->p >= gp->end || *gp->p != c)
+		return false;
+	gp->p++;
+	return true;
+}
+
+/* Find the span of the contents of a string, escapes left as is */
+static bool gp_string(gbt_parser_t *gp, const char **str, int *len)
+{
+	const char *p;
+
+	if (!gp_char(gp, '"'))
+		return false;
+	for (p = gp->p; p < gp->end && *p != '"'; p++) {
+		if (*p == '\\')
+			p++;
+	}
+	if (p >= gp->end)
+		return false;
+	*str = gp->p;
+	*len = p - gp->p;
+	gp->p = p + 1;
+	return true;
+}
+
+static bool gp_key(const char *key, const int len, const char *name)
+{
+	return len == (int)strlen(name) && !memcmp(key, name, len);
+}
+
+/* Skip over a value of any type */
+static bool gp_skip(gbt_parser_t *gp)
+{
+	const char *str;
+	int depth = 0, len;
+
+	gp_space(gp);
+	if (gp->p >= gp->end)
+		return false;
+	if (*gp->p == '"')
+		return gp_string(gp, &str, &len);
+	if (*gp->p != '{' && *gp->p != '[') {
+		/* Number or literal */
+		while (gp->p < gp->end && !strchr(",}] \t\r\n", *gp->p))
+			gp->p++;
+		return true;
+	}
+	while (gp->p < gp->end) {
+		switch (*gp->p) {
+			case '"':
+				if (!gp_string(gp, &str, &len))
+					return false;
+				continue;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			case '}':
+			case ']':
+				if (!--depth) {
+					gp->p++;
+					return true;
+				}
+				break;
+		}
+		gp->p++;
+	}
+	return false;
+}
+
+/* Parse a non negative integer, leaving anything else such as a fraction for
+ * gp_skip */
+static bool gp_int64(gbt_parser_t *gp, int64_t *val)
+{
+	const char *p;
+
+	gp_space(gp);
+	for (p = gp->p, *val = 0; p < gp->end && isdigit((uchar)*p); p++)
+		*val = *val * 10 + *p - '0';
+	if (p == gp->p || (p < gp->end && strchr(".eE", *p)))
+		return false;
+	gp->p = p;
+	return true;
+}
+
+/* Decode a hex hash from the json text into merkle byte order */
+static bool gp_hash(uchar *bin, const char *hex, const int len)
+{
+	char binswap[32];
+	int i;
+
+	if (unlikely(len != 64))
+		return false;
+	for (i = 0; i < 32; i++) {
+		int nibble1 = hex2bin_tbl[(uchar)hex[i * 2]];
+		int nibble2 = hex2bin_tbl[(uchar)hex[i * 2 + 1]];
+
+		if (unlikely(nibble1 < 0 || nibble2 < 0))
+			return false;
+		binswap[i] = (nibble1 << 4) | nibble2;
+	}
+	bswap_256(bin, binswap);
+	return true;
+}
+
+static bool gp_txn(gbt_parser_t *gp)
+{
+	const char *data = NULL, *txid = NULL, *hash = NULL, *key;
+	int datalen = 0, txidlen = 0, hashlen = 0, keylen;
+	int64_t fee = -1;
+
+	if (!gp_char(gp, '{'))
+		return false;
+	if (!gp_char(gp, '}')) {
+		do {
+			if (!gp_string(gp, &key, &keylen) || !gp_char(gp, ':'))
+				return false;
+			if (gp_key(key, keylen, "data")) {
+				if (!gp_string(gp, &data, &datalen))
+					return false;
+			} else if (gp_key(key, keylen, "txid")) {
+				if (!gp_string(gp, &txid, &txidlen))
+					return false;
+			} else if (gp_key(key, keylen, "hash")) {
+				if (!gp_string(gp, &hash, &hashlen))
+					return false;
+			} else if (gp_key(key, keylen, "fee")) {
+				if (!gp_int64(gp, &fee) && !gp_skip(gp))
+					return false;
+			} else if (!gp_skip(gp))
+				return false;
+		} while (gp_char(gp, ','));
+		if (!gp_char(gp, '}'))
+			return false;
+	}
+	// Post-segwit, txid returns the tx hash without witness data
+	if (!txid) {
+		txid = hash;
+		txidlen = hashlen;
+	} else if (!hash) {
+		hash = txid;
+		hashlen = txidlen;
+	}
+	if (unlikely(!data || !txid)) {
+		LOGERR("Missing data or txid for transaction in getblocktemplate");
+		return false;
+	}
+	if (gp->txns == gp->maxtxns) {
+		gp->maxtxns = gp->maxtxns ? gp->maxtxns * 2 : 1024;
+		gp->data = realloc(gp->data, sizeof(char *) * gp->maxtxns);
+		gp->datalen = realloc(gp->datalen, sizeof(int) * gp->maxtxns);
+		gp->txidbin = realloc(gp->txidbin, 32 * gp->maxtxns);
+		gp->wtxidbin = realloc(gp->wtxidbin, 32 * gp->maxtxns);
+		if (unlikely(!gp->data || !gp->datalen || !gp->txidbin || !gp->wtxidbin))
+			quit(1, "Failed to realloc transactions in gp_txn");
+	}
+	if (unlikely(!gp_hash(gp->txidbin + 32 * gp->txns, txid, txidlen) ||
+		     !gp_hash(gp->wtxidbin + 32 * gp->txns, hash, hashlen))) {
+		LOGERR("Failed to decode txid for transaction in getblocktemplate");
+		return false;
+	}
+	gp->data[gp->txns] = data;
+	gp->datalen[gp->txns] = datalen;
+	gp->txns++;
+	if (fee < 0)
+		gp->fees = -1;
+	else if (gp->fees >= 0)
+		gp->fees += fee;
+	return true;
+}
+
+static bool gp_result(gbt_parser_t *gp)
+{
+	const char *key, *start;
+	json_error_t err_val;
+	char name[64];
+	int keylen;
+	json_t *val;
+
+	/* Leave result unset if it's null */
+	if (!gp_char(gp, '{'))
+		return gp_skip(gp);
+	gp->result = json_object();
+	if (gp_char(gp, '}'))
+		return true;
+	do {
+		if (!gp_string(gp, &key, &keylen) || !gp_char(gp, ':'))
+			return false;
+		if (gp_key(key, keylen, "transactions")) {
+			if (!gp_char(gp, '['))
+				return false;
+			if (gp_char(gp, ']'))
+				continue;
+			do {
+				if (!gp_txn(gp))
+					return false;
+			} while (gp_char(gp, ','));
+			if (!gp_char(gp, ']'))
+				return false;
+			continue;
+		}
+		gp_space(gp);
+		start = gp->p;
+		if (!gp_skip(gp))
+			return false;
+		if (keylen >= (int)sizeof(name))
+			continue;
+		memcpy(name, key, keylen);
+		name[keylen] = '\0';
+		val = json_loadb(start, gp->p - start, JSON_DECODE_ANY, &err_val);
+		if (unlikely(!val)) {
+			LOGWARNING("Failed to decode %s in getblocktemplate: %s", name, err_val.text);
+			return false;
+		}
+		json_object_set_new_nocheck(gp->result, name, val);
+	} while (gp_char(gp, ','));
+	return gp_char(gp, '}');
+}
+
+/* Copy the transaction data out of the response into one allocation */
+static void gp_store_txns(gbt_parser_t *gp)
+{
+	gbtbase_t *gbt = gp->gbt;
+	int i, len = 0;
+
+	for (i = 0; i < gp->txns; i++)
+		len += gp->datalen[i];
+	gbt->txns = gp->txns;
+	gbt->fees = gp->fees;
+	gbt->txn_data = ckalloc(len + 1);
+	gbt->txn_ofs = ckalloc(sizeof(int) * (gp->txns + 1));
+	for (i = 0, len = 0; i < gp->txns; i++) {
+		gbt->txn_ofs[i] = len;
+		memcpy(gbt->txn_data + len, gp->data[i], gp->datalen[i]);
+		len += gp->datalen[i];
+	}
+	gbt->txn_ofs[i] = len;
+	gbt->txn_data[len] = '\0';
+	gbt->txidbin = gp->txidbin;
+	gbt->wtxidbin = gp->wtxidbin;
+	gp->txidbin = gp->wtxidbin = NULL;
+}
+
+/* Parses the response in place while the receive buffer is still valid */
+static bool parse_gbt(const char *buf, const int len, void *data)
+{
+	gbt_parser_t *gp = data;
+	const char *key, *start;
+	bool ret = false;
+	int keylen;
+
+	gp->p = buf;
+	gp->end = buf + len;
+	if (!gp_char(gp, '{'))
+		goto out;
+	do {
+		if (!gp_string(gp, &key, &keylen) || !gp_char(gp, ':'))
+			goto out;
+		if (gp_key(key, keylen, "result")) {
+			if (!gp_result(gp))
+				goto out;
+			continue;
+		}
+		gp_space(gp);
+		start = gp->p;
+		if (!gp_skip(gp))
+			goto out;
+		if (gp_key(key, keylen, "error") && strncmp(start, "null", 4))
+			LOGWARNING("getblocktemplate returned error: %.*s", (int)(gp->p - start), start);
+	} while (gp_char(gp, ','));
+	if (!gp_char(gp, '}') || !gp->result)
+		goto out;
+	gp_store_txns(gp);
+	ret = true;
+out:
+	free(gp->data);
+	free(gp->datalen);
+	free(gp->txidbin);
+	free(gp->wtxidbin);
+	gp->data = NULL;
+	gp->datalen = NULL;
+	gp->txidbin = gp->wtxidbin = NULL;
+	gp->txns = gp->maxtxns = 0;
+	return ret;
+}
+
+static void clear_gbt_txns(gbtbase_t *gbt)
+{
+	dealloc(gbt->txn_data);
+	dealloc(gbt->txn_ofs);
+	dealloc(gbt->txidbin);
+	dealloc(gbt->wtxidbin);
+	gbt->txns = 0;
+}
 
 /* Request getblocktemplate from bitcoind already connected with a connsock_t
  * and then summarise the information to the most efficient set of data
- * required to assemble a mining template, storing it in a gbtbase_t structure */
-bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+ * required to assemble a mining template, storing it in a gbtbase_t structure.
+ * The transactions are stored in binary and as one block of data instead of
+ * in gbt->json. */
+static bool __gen_gbtbase(connsock_t *cs, gbtbase_t *gbt, const char *req, const char *method)
 {
-	json_t *rules_array, *coinbase_aux, *res_val, *val;
+	json_t *rules_array, *coinbase_aux, *res_val;
 	const char *previousblockhash;
 	char hash_swap[32], tmp[32];
 	uint64_t coinbasevalue;
+	gbt_parser_t gp;
 	const char *target;
 	const char *flags;
 	const char *bits;
@@ -154,16 +488,21 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	int i;
 	bool ret = false;
 
-	val = json_rpc_call(cs, gbt_req);
-	if (!val) {
-		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
+	memset(gbt, 0, sizeof(gbtbase_t));
+	memset(&gp, 0, sizeof(gp));
+	gp.gbt = gbt;
+	if (!json_rpc_parse(cs, req, parse_gbt, &gp)) {
+		/* Long polls are expected to time out when nothing changes */
+		if (cs->timeout)
+			LOGINFO("%s:%s No response to %s long poll", cs->url, cs->port, method);
+		else {
+			LOGWARNING("%s:%s Failed to get valid json response to %s", cs->url,
+				   cs->port, method);
+		}
+		json_decref(gp.result);
 		return ret;
 	}
-	res_val = json_object_get(val, "result");
-	if (!res_val) {
-		LOGWARNING("Failed to get result in json response to getblocktemplate");
-		goto out;
-	}
+	res_val = gp.result;
 
 	rules_array = json_object_get(res_val, "rules");
 	if (rules_array) {
@@ -196,9 +535,8 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	}
 
 	/* Store getblocktemplate for remainder of json components as is */
-	json_incref(res_val);
-	json_object_del(val, "result");
 	gbt->json = res_val;
+	gp.result = NULL;
 
 	hex2bin(hash_swap, previousblockhash, 32);
 	swap_256(tmp, hash_swap);
@@ -233,18 +571,107 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 
 	ret = true;
 out:
-	json_decref(val);
+	if (!ret) {
+		json_decref(gp.result);
+		clear_gbt_txns(gbt);
+	}
+	return ret;
+}
+
+bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+{
+	return __gen_gbtbase(cs, gbt, gbt_req, "getblocktemplate");
+}
+
+static bool gbtlight_job(connsock_t *cs, gbtbase_t *gbt)
+{
+	const char *job_id;
+
+	job_id = json_string_value(json_object_get(gbt->json, "job_id"));
+	if (unlikely(!job_id || !json_is_array(json_object_get(gbt->json, "merkle")))) {
+		LOGWARNING("%s:%s Missing job_id or merkle in getblocktemplatelight", cs->url,
+			   cs->port);
+		clear_gbtbase(gbt);
+		return false;
+	}
+	gbt->job_id = strdup(job_id);
+	/* The fees are only known from the transactions */
+	gbt->fees = -1;
+	return true;
+}
+
+/* Request getblocktemplatelight from a BCHN bitcoind which returns the merkle
+ * branches and a job id for submitblocklight instead of the transactions. */
+bool gen_gbtlight(connsock_t *cs, gbtbase_t *gbt)
+{
+	if (!__gen_gbtbase(cs, gbt, gbtlight_req, "getblocktemplatelight"))
+		return false;
+	return gbtlight_job(cs, gbt);
+}
+
+/* Long poll bitcoind for the template after the one with longpollid, which
+ * it only returns once there is a new block or the transactions have changed.
+ * Cs should be a connection dedicated to long polling with its own timeout. */
+bool gen_gbtlongpoll(connsock_t *cs, gbtbase_t *gbt, const char *longpollid, const bool light)
+{
+	const char *method = light ? "getblocktemplatelight" : "getblocktemplate";
+	char *req;
+	bool ret;
+
+	ASPRINTF(&req, "{\"method\": \"%s\", \"params\": [{\"capabilities\": [\"coinbasetxn\", "
+		 "\"workid\", \"coinbase/append\"], \"longpollid\": \"%s\"}]}\n", method, longpollid);
+	ret = __gen_gbtbase(cs, gbt, req, method);
+	if (ret && light)
+		ret = gbtlight_job(cs, gbt);
+	free(req);
 	return ret;
 }
 
 void clear_gbtbase(gbtbase_t *gbt)
 {
 	free(gbt->flags);
+	free(gbt->job_id);
 	if (gbt->json)
 		json_decref(gbt->json);
+	clear_gbt_txns(gbt);
 	memset(gbt, 0, sizeof(gbtbase_t));
 }
 
+static const char *chaininfo_req = "{\"method\": \"getblockchaininfo\"}\n";
+
+/* A cheap health check of bitcoind without fetching a block template. Stores
+ * the height of its best block and whether it is still syncing, which is
+ * taken from initialblockdownload when reported and from headers otherwise.
+ * Failures are only logged at info level since servers are polled with it. */
+bool get_chaininfo(connsock_t *cs, int *height, bool *syncing)
+{
+	json_t *val, *res_val, *tmp_val;
+	bool ret = false;
+
+	val = json_rpc_response(cs, chaininfo_req);
+	if (!val) {
+		LOGINFO("%s:%s Failed to get valid json response to getblockchaininfo", cs->url, cs->port);
+		return ret;
+	}
+	res_val = json_object_get(val, "result");
+	if (!res_val || !json_is_integer(json_object_get(res_val, "blocks"))) {
+		LOGINFO("Failed to get blocks in json response to getblockchaininfo");
+		goto out;
+	}
+	*height = json_integer_value(json_object_get(res_val, "blocks"));
+	tmp_val = json_object_get(res_val, "initialblockdownload");
+	if (json_is_boolean(tmp_val))
+		*syncing = json_is_true(tmp_val);
+	else {
+		tmp_val = json_object_get(res_val, "headers");
+		*syncing = json_is_integer(tmp_val) && json_integer_value(tmp_val) > *height + 1;
+	}
+	ret = true;
+out:
+	json_decref(val);
+	return ret;
+}
+
 static const char *blockcount_req = "{\"method\": \"getblockcount\"}\n";
 
 /* Request getblockcount from bitcoind, returning the count or -1 if the call
@@ -333,25 +760,43 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, const char *params)
+/* Submits with submitblocklight when a job_id from getblocktemplatelight is
+ * passed, in which case params only contains the header and coinbase.
+ * Otherwise the hex transactions, if any, follow params and are sent from
+ * where they are without being copied into the request. */
+bool submit_block(connsock_t *cs, const char *params, const char *txns, const char *job_id)
 {
+	struct iovec req[4];
 	json_t *val, *res_val;
-	int len, retries = 0;
+	int reqcnt = 0, retries = 0;
 	const char *res_ret;
+	char *suffix = NULL;
 	bool ret = false;
-	char *rpc_req;
 
-	len = strlen(params) + 64;
+	if (job_id) {
+		req[reqcnt].iov_base = "{\"method\": \"submitblocklight\", \"params\": [\"";
+		ASPRINTF(&suffix, "\", \"%s\"]}\n", job_id);
+	} else {
+		req[reqcnt].iov_base = "{\"method\": \"submitblock\", \"params\": [\"";
+		suffix = strdup("\"]}\n");
+	}
+	req[reqcnt].iov_len = strlen(req[reqcnt].iov_base);
+	reqcnt++;
+	req[reqcnt].iov_base = (void *)params;
+	req[reqcnt++].iov_len = strlen(params);
+	if (txns && !job_id) {
+		req[reqcnt].iov_base = (void *)txns;
+		req[reqcnt++].iov_len = strlen(txns);
+	}
+	req[reqcnt].iov_base = suffix;
+	req[reqcnt++].iov_len = strlen(suffix);
 retry:
-	rpc_req = ckalloc(len);
-	sprintf(rpc_req, "{\"method\": \"submitblock\", \"params\": [\"%s\"]}\n", params);
-	val = json_rpc_call(cs, rpc_req);
-	dealloc(rpc_req);
+	val = json_rpc_callv(cs, req, reqcnt);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to submitblock", cs->url, cs->port);
 		if (++retries < 5)
 			goto retry;
-		return ret;
+		goto out;
 	}
 	res_val = json_object_get(val, "result");
 	if (!res_val) {
@@ -378,6 +823,7 @@ retry:
 	ret = true;
 out:
 	json_decref(val);
+	free(suffix);
 	return ret;
 }
 
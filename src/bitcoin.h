@@ -15,11 +15,14 @@ typedef struct genwork gbtbase_t;
 bool validate_address(connsock_t *cs, const char *address, bool *script, bool *segwit);
 json_t *validate_txn(connsock_t *cs, const char *txn);
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt);
+bool gen_gbtlight(connsock_t *cs, gbtbase_t *gbt);
+bool gen_gbtlongpoll(connsock_t *cs, gbtbase_t *gbt, const char *longpollid, const bool light);
 void clear_gbtbase(gbtbase_t *gbt);
+bool get_chaininfo(connsock_t *cs, int *height, bool *syncing);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
 bool get_bestblockhash(connsock_t *cs, char *hash);
-bool submit_block(connsock_t *cs, const char *params);
+bool submit_block(connsock_t *cs, const char *params, const char *txns, const char *job_id);
 void precious_block(connsock_t *cs, const char *params);
 void submit_txn(connsock_t *cs, const char *params);
 char *get_txn(connsock_t *cs, const char *hash);
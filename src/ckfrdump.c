@@ -0,0 +1,147 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Decode a ckpool flight recorder dump into a timeline of events from all
+ * threads in time order. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flightrec.h"
+
+struct timeline {
+	fr_event_t event;
+	char thread[16];
+};
+
+static const char *levels[] = {
+	"EMERG", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG"
+};
+
+static int timeline_cmp(const void *a, const void *b)
+{
+	const struct timeline *ta = a, *tb = b;
+
+	if (ta->event.ns == tb->event.ns)
+		return 0;
+	return ta->event.ns < tb->event.ns ? -1 : 1;
+}
+
+static void print_event(const struct timeline *tl)
+{
+	const fr_event_t *ev = &tl->event;
+	time_t secs = ev->ns / 1000000000ll;
+	char stamp[32], name[9];
+	struct tm tm;
+
+	localtime_r(&secs, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("[%s.%06lld] %-15s %-7s ", stamp, (long long)(ev->ns % 1000000000ll) / 1000,
+	       tl->thread, ev->level < 8 ? levels[ev->level] : "?");
+	if (ev->type >= FR_TYPES) {
+		printf("unknown type %d\n", ev->type);
+		return;
+	}
+	printf("%-12s ", fr_types[ev->type]);
+	switch (ev->type) {
+		case FR_SHARE_ACCEPT:
+		case FR_SHARE_REJECT:
+			printf("client %lld diff %lld latency %lldus\n", (long long)ev->a,
+			       (long long)ev->c, (long long)ev->b);
+			break;
+		case FR_NOTIFY:
+			printf("workbase %llx clean %lld\n", (long long)ev->a, (long long)ev->b);
+			break;
+		case FR_DIFF:
+			printf("client %lld diff %lld -> %lld\n", (long long)ev->a, (long long)ev->b,
+			       (long long)ev->c);
+			break;
+		case FR_RPC_START:
+			fr_unpack(ev->a, name);
+			printf("%s\n", name);
+			break;
+		case FR_RPC_END:
+			fr_unpack(ev->a, name);
+			printf("%s latency %lldus %s\n", name, (long long)ev->b,
+			       ev->c ? "ok" : "failed");
+			break;
+		case FR_QUEUE:
+			fr_unpack(ev->a, name);
+			printf("%s depth %lld messages %lld\n", name, (long long)ev->b,
+			       (long long)ev->c);
+			break;
+		default:
+			printf("\n");
+			break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct timeline *timeline = NULL;
+	size_t events = 0, i;
+	fr_header_t hdr;
+	uint32_t ring;
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s flightrec-file\n", argv[0]);
+		return 1;
+	}
+	fp = fopen(argv[1], "rb");
+	if (!fp) {
+		fprintf(stderr, "Failed to open %s\n", argv[1]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != FR_MAGIC) {
+		fprintf(stderr, "%s is not a flight recorder dump\n", argv[1]);
+		return 1;
+	}
+	if (hdr.version != FR_VERSION) {
+		fprintf(stderr, "Unsupported flight recorder version %u\n", hdr.version);
+		return 1;
+	}
+	for (ring = 0; ring < hdr.rings; ring++) {
+		fr_ringhdr_t rhdr;
+
+		if (fread(&rhdr, sizeof(rhdr), 1, fp) != 1 || rhdr.events > FR_EVENTS) {
+			fprintf(stderr, "Truncated flight recorder dump at ring %u\n", ring);
+			break;
+		}
+		rhdr.name[15] = '\0';
+		timeline = realloc(timeline, sizeof(struct timeline) * (events + rhdr.events));
+		if (!timeline) {
+			fprintf(stderr, "Failed to allocate timeline\n");
+			return 1;
+		}
+		for (i = 0; i < rhdr.events; i++) {
+			struct timeline *tl = &timeline[events];
+
+			if (fread(&tl->event, sizeof(fr_event_t), 1, fp) != 1)
+				break;
+			memcpy(tl->thread, rhdr.name, sizeof(tl->thread));
+			events++;
+		}
+		if (i < rhdr.events) {
+			fprintf(stderr, "Truncated flight recorder dump in ring %s\n", rhdr.name);
+			break;
+		}
+	}
+	fclose(fp);
+
+	qsort(timeline, events, sizeof(struct timeline), timeline_cmp);
+	for (i = 0; i < events; i++)
+		print_event(&timeline[i]);
+	free(timeline);
+	return 0;
+}
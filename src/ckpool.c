@@ -110,6 +110,9 @@ void logmsg(int loglevel, const char *fmt, ...)
 	char stamp[128];
 	va_list ap;
 
+	/* Preserve the flight recorder before fatal errors exit */
+	if (unlikely(loglevel == LOG_EMERG))
+		flightrec_dump();
 	if (global_ckp->loglevel < loglevel || !fmt)
 		return;
 
@@ -156,8 +159,8 @@ static void *ckmsg_queue(void *arg)
 	ckmsgq->active = true;
 
 	while (42) {
+		tv_t now, abs_tv;
 		ckmsg_t *msg;
-		tv_t now;
 		ts_t abs;
 
 		mutex_lock(ckmsgq->lock);
@@ -173,12 +176,26 @@ static void *ckmsg_queue(void *arg)
 
 		if (!msg)
 			continue;
+		tv_time(&now);
+		add_latency(&ckmsgq->wait, &msg->stamp, &now);
 		ckmsgq->func(ckp, msg->data);
+		tv_time(&abs_tv);
+		add_latency(&ckmsgq->process, &now, &abs_tv);
+		ckmsgq->processed++;
 		free(msg);
 	}
 	return NULL;
 }
 
+/* Add this ckmsgq to the list of all ckmsgqs reported in metrics */
+static void register_ckmsgq(ckpool_t *ckp, ckmsgq_t *ckmsgq)
+{
+	mutex_lock(&ckp->ckmsgq_lock);
+	ckmsgq->next = ckp->ckmsgqs;
+	ckp->ckmsgqs = ckmsgq;
+	mutex_unlock(&ckp->ckmsgq_lock);
+}
+
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
@@ -190,6 +207,7 @@ ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
 	mutex_init(ckmsgq->lock);
 	cond_init(ckmsgq->cond);
+	register_ckmsgq(ckp, ckmsgq);
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
 
 	return ckmsgq;
@@ -213,6 +231,7 @@ ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, cons
 		ckmsgq[i].ckp = ckp;
 		ckmsgq[i].lock = lock;
 		ckmsgq[i].cond = cond;
+		register_ckmsgq(ckp, &ckmsgq[i]);
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
 	}
 
@@ -237,6 +256,7 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 
 	msg = ckalloc(sizeof(ckmsg_t));
 	msg->data = data;
+	tv_time(&msg->stamp);
 
 	mutex_lock(ckmsgq->lock);
 	ckmsgq->messages++;
@@ -263,6 +283,143 @@ out:
 	return ret;
 }
 
+/* Add the time between start and end to a latency histogram. Each bucket
+ * counts latencies less than 2^bucket microseconds. */
+void add_latency(latency_hist_t *hist, const tv_t *start, const tv_t *end)
+{
+	int64_t us = (end->tv_sec - start->tv_sec) * 1000000ll + end->tv_usec - start->tv_usec;
+	int bucket = 0;
+
+	if (unlikely(us < 0))
+		us = 0;
+	if (us)
+		bucket = 64 - __builtin_clzll(us);
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	hist->buckets[bucket]++;
+	hist->sum += us;
+	hist->count++;
+}
+
+/* Append a latency histogram in prometheus text format to buf */
+void latency_metrics(char **buf, const char *name, const char *labels, const latency_hist_t *hist)
+{
+	int64_t cumulative = 0;
+	char *line;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		cumulative += hist->buckets[i];
+		ASPRINTF(&line, "%s_bucket{%s%sle=\"%g\"} %"PRId64"\n", name, labels,
+			 *labels ? "," : "", (double)(1ll << i) / 1000000, cumulative);
+		realloc_strcat(buf, line);
+		free(line);
+	}
+	cumulative += hist->buckets[i];
+	ASPRINTF(&line, "%s_bucket{%s%sle=\"+Inf\"} %"PRId64"\n%s_sum{%s} %f\n%s_count{%s} %"PRId64"\n",
+		 name, labels, *labels ? "," : "", cumulative, name, labels,
+		 (double)hist->sum / 1000000, name, labels, hist->count);
+	realloc_strcat(buf, line);
+	free(line);
+}
+
+/* Queue depths and latencies of every ckmsgq */
+static void ckmsgq_metrics(ckpool_t *ckp, char **buf)
+{
+	ckmsgq_t *ckmsgq;
+	char labels[32];
+	char *line;
+
+	realloc_strcat(buf, "# TYPE ckpool_queue_depth gauge\n"
+		       "# TYPE ckpool_queue_messages_total counter\n"
+		       "# TYPE ckpool_queue_wait_seconds histogram\n"
+		       "# TYPE ckpool_queue_process_seconds histogram\n");
+	mutex_lock(&ckp->ckmsgq_lock);
+	for (ckmsgq = ckp->ckmsgqs; ckmsgq; ckmsgq = ckmsgq->next) {
+		int64_t generated;
+		ckmsg_t *msg;
+		int objects;
+
+		mutex_lock(ckmsgq->lock);
+		DL_COUNT(ckmsgq->msgs, msg, objects);
+		generated = ckmsgq->messages;
+		mutex_unlock(ckmsgq->lock);
+
+		snprintf(labels, 31, "queue=\"%s\"", ckmsgq->name);
+		ASPRINTF(&line, "ckpool_queue_depth{%s} %d\nckpool_queue_messages_total{%s} %"PRId64"\n",
+			 labels, objects, labels, generated);
+		realloc_strcat(buf, line);
+		free(line);
+		latency_metrics(buf, "ckpool_queue_wait_seconds", labels, &ckmsgq->wait);
+		latency_metrics(buf, "ckpool_queue_process_seconds", labels, &ckmsgq->process);
+	}
+	mutex_unlock(&ckp->ckmsgq_lock);
+}
+
+/* Round trip latency of RPC calls to each bitcoind and their probed state */
+static void rpc_metrics(ckpool_t *ckp, char **buf)
+{
+	char labels[128];
+	int i;
+
+	if (ckp->proxy || !ckp->generator_ready || !ckp->servers)
+		return;
+	realloc_strcat(buf, "# TYPE ckpool_rpc_seconds histogram\n");
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+
+		snprintf(labels, 127, "server=\"%s\",conn=\"rpc\"", si->url);
+		latency_metrics(buf, "ckpool_rpc_seconds", labels, &si->cs.rpc_latency);
+		snprintf(labels, 127, "server=\"%s\",conn=\"submit\"", si->url);
+		latency_metrics(buf, "ckpool_rpc_seconds", labels, &si->submitcs.rpc_latency);
+		snprintf(labels, 127, "server=\"%s\",conn=\"probe\"", si->url);
+		latency_metrics(buf, "ckpool_rpc_seconds", labels, &si->probecs.rpc_latency);
+	}
+	/* State of each bitcoind from the watchdog's health probes */
+	realloc_strcat(buf, "# TYPE ckpool_server_height gauge\n# TYPE ckpool_server_healthy gauge\n");
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		char *line;
+
+		ASPRINTF(&line, "ckpool_server_height{server=\"%s\"} %d\n"
+			 "ckpool_server_healthy{server=\"%s\"} %d\n",
+			 si->url, si->height, si->url, si->healthy && !si->lagging);
+		realloc_strcat(buf, line);
+		free(line);
+	}
+}
+
+/* Record the depth of every ckmsgq in the flight recorder */
+void flightrec_ckmsgqs(ckpool_t *ckp)
+{
+	ckmsgq_t *ckmsgq;
+
+	if (LOG_INFO > flightrec_level)
+		return;
+	mutex_lock(&ckp->ckmsgq_lock);
+	for (ckmsgq = ckp->ckmsgqs; ckmsgq; ckmsgq = ckmsgq->next) {
+		int64_t messages = ckmsgq->messages;
+
+		flightrec(FR_QUEUE, LOG_INFO, fr_pack(ckmsgq->name), messages - ckmsgq->processed,
+			  messages);
+	}
+	mutex_unlock(&ckp->ckmsgq_lock);
+}
+
+/* Return a heap allocated string of all metrics in prometheus text format */
+static char *ckpool_metrics(ckpool_t *ckp)
+{
+	char *buf = NULL;
+
+	ckmsgq_metrics(ckp, &buf);
+	rpc_metrics(ckp, &buf);
+	if (ckp->stratifier_ready)
+		stratifier_metrics(ckp, &buf);
+	if (ckp->connector_ready)
+		connector_metrics(ckp, &buf);
+	return buf;
+}
+
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -457,6 +614,43 @@ retry:
 		msg = connector_stats(ckp->cdata, 0);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
+	} else if (cmdmatch(buf, "metrics")) {
+		LOGDEBUG("Listener received metrics request");
+		msg = ckpool_metrics(ckp);
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
+	} else if (cmdmatch(buf, "flightrec")) {
+		const char *path;
+		int level;
+
+		if (sscanf(buf, "flightrec=%d", &level) == 1) {
+			LOGWARNING("Flight recorder level set to %d", level);
+			flightrec_level = level;
+			send_unix_msg(sockd, "success");
+		} else if ((path = flightrec_dump())) {
+			LOGWARNING("Flight recorder dumped to %s", path);
+			send_unix_msg(sockd, path);
+		} else
+			send_unix_msg(sockd, "Failed");
+	} else if (cmdmatch(buf, "lockprofile")) {
+		int enable;
+
+		if (sscanf(buf, "lockprofile=%d", &enable) != 1) {
+			LOGWARNING("Failed to parse lockprofile message %s", buf);
+			send_unix_msg(sockd, "Failed");
+		} else {
+			LOGWARNING("Lock profiling %s", enable ? "enabled" : "disabled");
+			lock_profile_enable(enable);
+			send_unix_msg(sockd, "success");
+		}
+	} else if (cmdmatch(buf, "lockstats")) {
+		int top = 20;
+
+		LOGDEBUG("Listener received lockstats request");
+		sscanf(buf, "lockstats=%d", &top);
+		msg = lock_profile_stats(top);
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
 	} else if (cmdmatch(buf, "resetshares")) {
 		LOGWARNING("Resetting best shares");
 		send_proc(ckp->stratifier, buf);
@@ -682,6 +876,77 @@ out:
 	return ret;
 }
 
+/* Returns the length of a complete frame buffered in cs->buf, zero if it is
+ * still incomplete and -1 if the header is invalid. */
+static int buffered_frame(connsock_t *cs)
+{
+	pass_frame_t frame;
+	uint32_t len;
+
+	if (cs->bufofs < (int)sizeof(frame))
+		return 0;
+	memcpy(&frame, cs->buf, sizeof(frame));
+	len = le32toh(frame.len);
+	if (unlikely(len > PASS_MAXPAYLOAD))
+		return -1;
+	if (cs->bufofs < (int)(sizeof(frame) + len))
+		return 0;
+	return sizeof(frame) + len;
+}
+
+/* As read_socket_line but for framed passthrough messages, leaving a whole
+ * pass_frame_t and its payload at the start of cs->buf. Returns the length of
+ * the frame, zero if none is complete by the timeout and -1 on error. */
+int read_socket_frame(connsock_t *cs, float *timeout)
+{
+	ckpool_t *ckp = cs->ckp;
+	tv_t start, now;
+	int ret;
+
+	clear_bufline(cs);
+	recv_available(ckp, cs);
+	tv_time(&start);
+
+	while (!(ret = buffered_frame(cs))) {
+		if (unlikely(cs->fd < 0)) {
+			ret = -1;
+			goto out;
+		}
+		if (*timeout < 0) {
+			LOGINFO("Timed out in read_socket_frame");
+			goto out;
+		}
+		ret = wait_read_select(cs->fd, *timeout);
+		if (ret < 1) {
+			LOGINFO("Select %s in read_socket_frame", !ret ? "timed out" : "failed");
+			goto out;
+		}
+		if (recv_available(ckp, cs) < 1) {
+			LOGINFO("Failed to recv in read_socket_frame");
+			ret = -1;
+			goto out;
+		}
+		tv_time(&now);
+		*timeout -= tvdiff(&now, &start);
+		copy_tv(&start, &now);
+	}
+	if (unlikely(ret < 0)) {
+		LOGWARNING("Invalid frame header in read_socket_frame");
+		goto out;
+	}
+	cs->buflen = cs->bufofs - ret;
+	if (cs->buflen)
+		cs->bufofs = ret;
+	else
+		cs->bufofs = 0;
+out:
+	if (ret < 0) {
+		empty_buffer(cs);
+		dealloc(cs->buf);
+	}
+	return ret;
+}
+
 /* We used to send messages between each proc_instance via unix sockets when
  * ckpool was a multi-process model but that is no longer required so we can
  * place the messages directly on the other proc_instance's queue until we
@@ -744,26 +1009,265 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
+/* Pack the start of the method name for flight recorder events */
+static int64_t rpc_method_id(const char *rpc_req)
+{
+	const char *method;
+	char name[9] = {};
+	int i;
+
+	if (unlikely(!rpc_req))
+		return 0;
+	method = rpc_method(rpc_req);
+	while (*method == ' ' || *method == '"')
+		method++;
+	for (i = 0; i < 8 && method[i] && method[i] != '"'; i++)
+		name[i] = method[i];
+	return fr_pack(name);
+}
+
+/* Largest HTTP header block we will accept from bitcoind */
+#define HTTP_MAXHEADER 65536
+
+/* Make sure cs->buf can hold len bytes plus a terminating NULL, growing it to
+ * the final size in one step when the length is known up front. */
+static bool http_reserve(connsock_t *cs, const int len)
+{
+	ckpool_t *ckp = cs->ckp;
+	int bufsize;
+	char *newbuf;
+
+	if (likely(cs->bufsize > len))
+		return true;
+	bufsize = round_up_page(len + 1);
+	newbuf = realloc(cs->buf, bufsize);
+	if (unlikely(!newbuf)) {
+		LOGWARNING("Failed to realloc %d in http_reserve", bufsize);
+		return false;
+	}
+	cs->buf = newbuf;
+	cs->bufsize = bufsize;
+	/* Increase the receive buffer to match if possible */
+	if (!ckp->rmem_warn && bufsize > cs->rcvbufsiz)
+		cs->rcvbufsiz = set_recvbufsize(ckp, cs->fd, bufsize);
+	return true;
+}
+
+/* Receive directly into cs->buf at cs->bufofs until at least len bytes are
+ * buffered. Returns 1 on success, 0 on timeout and -1 on error or the socket
+ * closing. */
+static int http_recv(connsock_t *cs, const int len, float *timeout)
+{
+	tv_t start, now;
+	int ret;
+
+	if (!http_reserve(cs, len))
+		return -1;
+	tv_time(&start);
+	while (cs->bufofs < len) {
+		if (*timeout < 0)
+			return 0;
+		ret = wait_read_select(cs->fd, *timeout);
+		if (ret < 1)
+			return ret;
+		ret = recv(cs->fd, cs->buf + cs->bufofs, cs->bufsize - 1 - cs->bufofs, MSG_DONTWAIT);
+		if (ret < 1)
+			return -1;
+		cs->bufofs += ret;
+		tv_time(&now);
+		*timeout -= tvdiff(&now, &start);
+		copy_tv(&start, &now);
+	}
+	cs->buf[cs->bufofs] = '\0';
+	return 1;
+}
+
+/* Return the offset of the first line ending in buf at or after ofs, or -1 */
+static int http_eol(const char *buf, int ofs, const int len)
+{
+	const char *eol = memchr(buf + ofs, '\n', len - ofs);
+
+	return eol ? eol - buf : -1;
+}
+
+/* Decode a chunked body in place. The undecoded data starts at ofs and the
+ * decoded body is compacted to the start of cs->buf, leaving its length in
+ * cs->bufofs. */
+static bool http_dechunk(connsock_t *cs, int ofs, float *timeout)
+{
+	int body = 0;
+
+	while (42) {
+		int eol, chunk;
+
+		while ((eol = http_eol(cs->buf, ofs, cs->bufofs)) < 0) {
+			if (cs->bufofs - ofs > HTTP_MAXHEADER)
+				return false;
+			if (http_recv(cs, cs->bufofs + 1, timeout) < 1)
+				return false;
+		}
+		chunk = strtol(cs->buf + ofs, NULL, 16);
+		if (unlikely(chunk < 0))
+			return false;
+		ofs = eol + 1;
+		if (!chunk)
+			break;
+		/* Chunk data is followed by CRLF */
+		if (http_recv(cs, ofs + chunk + 2, timeout) < 1)
+			return false;
+		memmove(cs->buf + body, cs->buf + ofs, chunk);
+		body += chunk;
+		ofs += chunk + 2;
+		/* Keep undecoded data directly after the body */
+		memmove(cs->buf + body, cs->buf + ofs, cs->bufofs - ofs);
+		cs->bufofs -= ofs - body;
+		ofs = body;
+	}
+	/* Skip any trailers up to the final empty line */
+	while (42) {
+		int eol;
+
+		while ((eol = http_eol(cs->buf, ofs, cs->bufofs)) < 0) {
+			if (http_recv(cs, cs->bufofs + 1, timeout) < 1)
+				return false;
+		}
+		if (eol - ofs < 2)
+			break;
+		ofs = eol + 1;
+	}
+	cs->bufofs = body;
+	cs->buf[body] = '\0';
+	return true;
+}
+
+/* Read a complete HTTP response from cs->fd, leaving the NULL terminated body
+ * at the start of cs->buf with its length in cs->bufofs. The body is received
+ * straight into a buffer sized once from Content-Length, with chunked encoding
+ * and read until close supported as fallbacks. Sets keepalive false if the
+ * connection can't be reused. Returns the HTTP status, 0 on timeout or
+ * failure, or -1 if the socket closed before any response arrived. */
+static int read_http_response(connsock_t *cs, float *timeout, bool *keepalive)
+{
+	int status, hdrlen = 0, clen = -1, ofs = 0, eol, ret;
+	bool chunked = false, http10;
+	char *line, *next;
+
+	empty_buffer(cs);
+	/* Read until we have the whole header block */
+	while (42) {
+		ret = http_recv(cs, cs->bufofs + 1, timeout);
+		if (ret < 1)
+			return ret < 0 && !cs->bufofs ? -1 : 0;
+		while ((eol = http_eol(cs->buf, ofs, cs->bufofs)) >= 0) {
+			if (eol - ofs < 2 && (eol == ofs || cs->buf[ofs] == '\r')) {
+				hdrlen = eol + 1;
+				break;
+			}
+			ofs = eol + 1;
+		}
+		if (hdrlen)
+			break;
+		if (cs->bufofs > HTTP_MAXHEADER) {
+			LOGWARNING("HTTP header too large in read_http_response");
+			return 0;
+		}
+		if (cs->bufsize - 1 - cs->bufofs < PAGESIZE && !http_reserve(cs, cs->bufsize + PAGESIZE))
+			return 0;
+	}
+
+	if (sscanf(cs->buf, "HTTP/1.%*d %d", &status) != 1) {
+		LOGWARNING("Invalid HTTP status line in read_http_response");
+		return 0;
+	}
+	http10 = !strncmp(cs->buf, "HTTP/1.0", 8);
+	if (http10)
+		*keepalive = false;
+	for (line = cs->buf; line < cs->buf + hdrlen; line = next + 1) {
+		next = strchr(line, '\n');
+		*next = '\0';
+		if (!strncasecmp(line, "Content-Length:", 15))
+			clen = atoi(line + 15);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+			chunked = !!strcasestr(line, "chunked");
+		else if (!strncasecmp(line, "Connection:", 11)) {
+			if (strcasestr(line, "close"))
+				*keepalive = false;
+			else if (http10 && strcasestr(line, "keep-alive"))
+				*keepalive = true;
+		}
+	}
+
+	/* Move whatever body arrived with the headers to the start */
+	cs->bufofs -= hdrlen;
+	memmove(cs->buf, cs->buf + hdrlen, cs->bufofs);
+	cs->buf[cs->bufofs] = '\0';
+
+	if (chunked) {
+		if (!http_dechunk(cs, 0, timeout))
+			return 0;
+	} else if (clen >= 0) {
+		if (http_recv(cs, clen, timeout) < 1)
+			return 0;
+		if (cs->bufofs > clen) {
+			/* Unexpected trailing data, don't reuse */
+			*keepalive = false;
+			cs->bufofs = clen;
+		}
+		cs->buf[clen] = '\0';
+	} else {
+		/* No length so the body ends when the socket closes */
+		*keepalive = false;
+		while (http_reserve(cs, cs->bufofs + PAGESIZE) && http_recv(cs, cs->bufofs + 1, timeout) > 0);
+	}
+	return status;
+}
+
+/* Open a new persistent connection for RPC calls, reusing the address of the
+ * last successful connect and any receive buffer from the previous one. */
+static int rpc_connect(connsock_t *cs)
 {
-	float timeout = RPC_TIMEOUT;
+	socklen_t optlen = sizeof(cs->rcvbufsiz);
+
+	cs->fd = connect_socket_cached(cs->url, cs->port, &cs->addrcache);
+	if (unlikely(cs->fd < 0))
+		return cs->fd;
+	/* Long polls wait on bitcoind for as long as it takes so a dead
+	 * connection has to be noticed some other way */
+	if (cs->timeout > RPC_TIMEOUT)
+		keep_sockalive(cs->fd);
+	empty_buffer(cs);
+	getsockopt(cs->fd, SOL_SOCKET, SO_RCVBUF, &cs->rcvbufsiz, &optlen);
+	cs->rcvbufsiz /= 2;
+	return cs->fd;
+}
+
+/* Most requests are sent as a header and the request in two parts */
+#define RPC_MAXIOV 8
+
+/* All of these calls are made to bitcoind over a keep-alive HTTP/1.1
+ * connection held open in cs->fd between calls. If bitcoind has since closed
+ * an idle connection we reconnect once and resend the request. The request is
+ * made of reqcnt parts written straight from where they are, the first of
+ * which must be a null terminated string starting with the method. */
+static json_t *_json_rpc_callv(connsock_t *cs, const struct iovec *req, const int reqcnt,
+			       const bool info_only, rpc_parser_t parser, void *data)
+{
+	float timeout = cs->timeout ? cs->timeout : RPC_TIMEOUT;
+	bool reused, keepalive = true, quiet = info_only;
+	const char *rpc_req = reqcnt ? req[0].iov_base : NULL;
+	struct iovec iov[RPC_MAXIOV];
 	char *http_req = NULL;
 	json_error_t err_val;
 	char *warning = NULL;
 	json_t *val = NULL;
-	tv_t stt_tv, fin_tv;
+	tv_t stt_tv, fin_tv, rpc_tv;
 	double elapsed;
-	int len, ret;
+	int i, len, ret;
 
 	/* Serialise all calls in case we use cs from multiple threads */
 	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
-	if (unlikely(cs->fd < 0)) {
-		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
-		goto out;
-	}
+	flightrec(FR_RPC_START, LOG_INFO, rpc_method_id(rpc_req), 0, 0);
+	tv_time(&rpc_tv);
 	if (unlikely(!cs->url)) {
 		ASPRINTF(&warning, "No URL in %s", __func__);
 		goto out;
@@ -776,116 +1280,173 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 		ASPRINTF(&warning, "No auth in %s", __func__);
 		goto out;
 	}
-	if (unlikely(!rpc_req)) {
-		ASPRINTF(&warning, "Null rpc_req passed to %s", __func__);
+	if (unlikely(!rpc_req || reqcnt >= RPC_MAXIOV)) {
+		ASPRINTF(&warning, "Invalid rpc_req passed to %s", __func__);
 		goto out;
 	}
-	len = strlen(rpc_req);
+	for (i = 0, len = 0; i < reqcnt; i++)
+		len += req[i].iov_len;
 	if (unlikely(!len)) {
 		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
 		goto out;
 	}
-	http_req = ckalloc(len + 256); // Leave room for headers
-	sprintf(http_req,
+	ASPRINTF(&http_req,
 		 "POST / HTTP/1.1\n"
 		 "Authorization: Basic %s\n"
 		 "Host: %s:%s\n"
 		 "Content-type: application/json\n"
-		 "Content-Length: %d\n\n%s",
-		 cs->auth, cs->url, cs->port, len, rpc_req);
+		 "Content-Length: %d\n\n",
+		 cs->auth, cs->url, cs->port, len);
+	len += strlen(http_req);
+retry:
+	reused = cs->fd >= 0;
+	if (!reused && unlikely(rpc_connect(cs) < 0)) {
+		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
+		goto out;
+	}
 
-	len = strlen(http_req);
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
+	/* Written from a copy since it is advanced by partial writes */
+	iov[0].iov_base = http_req;
+	iov[0].iov_len = strlen(http_req);
+	memcpy(&iov[1], req, sizeof(struct iovec) * reqcnt);
+	ret = write_socketv(cs->fd, iov, reqcnt + 1);
 	if (ret != len) {
+		if (reused)
+			goto stale;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		ASPRINTF(&warning, "Failed to write to socket in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
 		goto out_empty;
 	}
-	ret = read_socket_line(cs, &timeout);
+	ret = read_http_response(cs, &timeout, &keepalive);
 	if (ret < 1) {
+		if (reused && ret < 0)
+			goto stale;
+		/* Long polls time out when there is nothing new */
+		if (!ret && cs->timeout)
+			quiet = true;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "Failed to read socket line in %s (%.10s...) %.3fs",
+		ASPRINTF(&warning, "Failed to read http response in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
 		goto out_empty;
 	}
-	if (strncasecmp(cs->buf, "HTTP/1.1 200 OK", 15)) {
+	if (ret != 200) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
-			 rpc_method(rpc_req), elapsed, cs->buf);
-		timeout = 0;
-		/* Look for a json response if there is one */
-		while (read_socket_line(cs, &timeout) > 0) {
-			timeout = 0;
-			if (*cs->buf != '{')
-				continue;
-			free(warning);
-			/* Replace the warning with the json response */
+		/* Show the json response if there is one */
+		if (*cs->buf == '{') {
 			ASPRINTF(&warning, "JSON response to (%.10s...) %.3fs not ok: %s",
 				 rpc_method(rpc_req), elapsed, cs->buf);
-			break;
+		} else {
+			ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %d",
+				 rpc_method(rpc_req), elapsed, ret);
 		}
 		goto out_empty;
 	}
-	do {
-		ret = read_socket_line(cs, &timeout);
-		if (ret < 1) {
-			tv_time(&fin_tv);
-			elapsed = tvdiff(&fin_tv, &stt_tv);
-			ASPRINTF(&warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
-				 __func__, rpc_method(rpc_req), elapsed);
-			goto out_empty;
-		}
-	} while (strncmp(cs->buf, "{", 1));
 	tv_time(&fin_tv);
+	add_latency(&cs->rpc_latency, &stt_tv, &fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
-	if (elapsed > 5.0) {
+	if (elapsed > 5.0 && !cs->timeout) {
 		ASPRINTF(&warning, "HTTP socket read+write took %.3fs in %s (%.10s...)",
 			 elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
-	if (!val) {
-		ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
-			 rpc_method(rpc_req), err_val.line, err_val.text);
+	if (parser) {
+		/* Parse straight out of the receive buffer */
+		if (parser(cs->buf, cs->bufofs, data))
+			val = json_true();
+		else {
+			ASPRINTF(&warning, "Failed to parse response to (%.10s...)",
+				 rpc_method(rpc_req));
+		}
+	} else {
+		val = json_loadb(cs->buf, cs->bufofs, 0, &err_val);
+		if (!val) {
+			ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
+				 rpc_method(rpc_req), err_val.line, err_val.text);
+		}
+	}
+	/* The whole response has been consumed so the connection can be
+	 * reused as is */
+	if (keepalive) {
+		empty_buffer(cs);
+		goto out;
 	}
+	goto out_empty;
+stale:
+	LOGDEBUG("Persistent connection to %s:%s closed, reconnecting", cs->url, cs->port);
+	Close(cs->fd);
+	empty_buffer(cs);
+	timeout = cs->timeout ? cs->timeout : RPC_TIMEOUT;
+	goto retry;
 out_empty:
 	empty_socket(cs->fd);
 	empty_buffer(cs);
+	Close(cs->fd);
 out:
 	if (warning) {
-		if (info_only)
+		if (quiet)
 			LOGINFO("%s", warning);
 		else
 			LOGWARNING("%s", warning);
 		free(warning);
 	}
-	Close(cs->fd);
 	free(http_req);
-	dealloc(cs->buf);
+	if (LOG_INFO <= flightrec_level) {
+		tv_time(&fin_tv);
+		flightrec(FR_RPC_END, LOG_INFO, rpc_method_id(rpc_req), us_tvdiff(&fin_tv, &rpc_tv),
+			  val != NULL);
+	}
 	cksem_post(&cs->sem);
 	return val;
 }
 
+static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only,
+			      rpc_parser_t parser, void *data)
+{
+	struct iovec req;
+
+	req.iov_base = (void *)rpc_req;
+	req.iov_len = rpc_req ? strlen(rpc_req) : 0;
+	return _json_rpc_callv(cs, &req, 1, info_only, parser, data);
+}
+
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, false);
+	return _json_rpc_call(cs, rpc_req, false, NULL, NULL);
+}
+
+/* For large requests assembled from several buffers without copying them */
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *req, const int reqcnt)
+{
+	return _json_rpc_callv(cs, req, reqcnt, false, NULL, NULL);
 }
 
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, true);
+	return _json_rpc_call(cs, rpc_req, true, NULL, NULL);
+}
+
+/* For large responses that are parsed directly from the raw json text by
+ * parser instead of being decoded into json first. */
+bool json_rpc_parse(connsock_t *cs, const char *rpc_req, rpc_parser_t parser, void *data)
+{
+	json_t *val = _json_rpc_call(cs, rpc_req, false, parser, data);
+
+	if (!val)
+		return false;
+	json_decref(val);
+	return true;
 }
 
 /* For when we are submitting information that is not important and don't care
  * about the response. */
 void json_rpc_msg(connsock_t *cs, const char *rpc_req)
 {
-	json_t *val = _json_rpc_call(cs, rpc_req, true);
+	json_t *val = _json_rpc_call(cs, rpc_req, true, NULL, NULL);
 
 	/* We don't care about the result */
 	json_decref(val);
@@ -1094,6 +1655,16 @@ static void sighandler(const int sig)
 	exit(0);
 }
 
+static void flightrec_handler(const int sig)
+{
+	flightrec_dump();
+	/* Fatal signals are re-raised with the default action after dumping */
+	if (sig != SIGUSR2) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+}
+
 static bool _json_get_string(char **store, const json_t *entry, const char *res)
 {
 	bool ret = false;
@@ -1456,6 +2027,9 @@ static void parse_config(ckpool_t *ckp)
 		ckp->btcsig[38] = '\0';
 	}
 	json_get_int(&ckp->blockpoll, json_conf, "blockpoll");
+	json_get_bool(&ckp->gbtlight, json_conf, "gbtlight");
+	ckp->longpoll = true;
+	json_get_bool(&ckp->longpoll, json_conf, "longpoll");
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
@@ -1478,6 +2052,7 @@ static void parse_config(ckpool_t *ckp)
 	arr_val = json_object_get(json_conf, "trusted");
 	parse_trusted(ckp, arr_val);
 	json_get_string(&ckp->upstream, json_conf, "upstream");
+	json_get_int(&ckp->aggregateshares, json_conf, "aggregateshares");
 	json_get_int64(&ckp->mindiff, json_conf, "mindiff");
 	json_get_int64(&ckp->startdiff, json_conf, "startdiff");
 	json_get_int64(&ckp->highdiff, json_conf, "highdiff");
@@ -1504,6 +2079,7 @@ static void parse_config(ckpool_t *ckp)
 		if (arr_size)
 			parse_proxies(ckp, arr_val, arr_size);
 	}
+	json_get_int(&ckp->proxystandby, json_conf, "proxystandby");
 	arr_val = json_object_get(json_conf, "redirecturl");
 	if (arr_val)
 		parse_redirecturls(ckp, arr_val);
@@ -1830,6 +2406,9 @@ int main(int argc, char **argv)
 	ASPRINTF(&ckp.logfilename, "%s%s.log", ckp.logdir, ckp.name);
 	if (!open_logfile(&ckp))
 		quit(1, "Failed to make open log file %s", buf);
+	sprintf(buf, "%s%s.flightrec", ckp.logdir, ckp.name);
+	flightrec_init(buf);
+	mutex_init(&ckp.ckmsgq_lock);
 	launch_logger(&ckp);
 
 	ckp.main.ckp = &ckp;
@@ -1909,6 +2488,14 @@ int main(int argc, char **argv)
 	sigaction(SIGTERM, &handler, NULL);
 	sigaction(SIGINT, &handler, NULL);
 
+	handler.sa_handler = &flightrec_handler;
+	sigaction(SIGUSR2, &handler, NULL);
+	handler.sa_flags = SA_RESETHAND;
+	sigaction(SIGSEGV, &handler, NULL);
+	sigaction(SIGBUS, &handler, NULL);
+	sigaction(SIGFPE, &handler, NULL);
+	sigaction(SIGABRT, &handler, NULL);
+
 	/* Launch separate processes from here */
 	prepare_child(&ckp, &ckp.generator, generator, "generator");
 	prepare_child(&ckp, &ckp.stratifier, stratifier, "stratifier");
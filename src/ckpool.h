@@ -17,6 +17,7 @@
 #include <sys/types.h>
 
 #include "libckpool.h"
+#include "flightrec.h"
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
@@ -28,10 +29,25 @@ struct ckmsg {
 	struct ckmsg *next;
 	struct ckmsg *prev;
 	void *data;
+	tv_t stamp; /* When it was queued */
 };
 
 typedef struct ckmsg ckmsg_t;
 
+/* Number of log2 microsecond buckets in a latency histogram, the last one
+ * counting everything over ~4 seconds */
+#define LATENCY_BUCKETS 24
+
+/* Latency histogram that is only ever updated by one thread at a time so it
+ * needs no locking, and is read unlocked when reporting metrics */
+struct latency_hist {
+	int64_t count;
+	int64_t sum; /* Microseconds */
+	int64_t buckets[LATENCY_BUCKETS];
+};
+
+typedef struct latency_hist latency_hist_t;
+
 typedef struct unix_msg unix_msg_t;
 
 struct unix_msg {
@@ -50,7 +66,16 @@ struct ckmsgq {
 	ckmsg_t *msgs;
 	void (*func)(ckpool_t *, void *);
 	int64_t messages;
+	int64_t processed; /* Only updated by this queue's thread */
 	bool active;
+
+	/* Time messages spent queued and being processed, updated only by
+	 * this queue's thread */
+	latency_hist_t wait;
+	latency_hist_t process;
+
+	/* List of all ckmsgqs for reporting metrics */
+	struct ckmsgq *next;
 };
 
 typedef struct ckmsgq ckmsgq_t;
@@ -85,15 +110,46 @@ struct connsock {
 	int rcvbufsiz;
 	int sendbufsiz;
 
+	/* Address of the last successful connect for persistent RPC */
+	sockaddr_cache_t addrcache;
+	/* RPC timeout in seconds if not RPC_TIMEOUT, for long polling and
+	 * health probes */
+	int timeout;
+
 	ckpool_t *ckp;
 	/* Semaphore used to serialise request/responses */
 	sem_t sem;
 
 	bool alive;
+
+	/* Round trip time of successful RPC calls, protected by sem */
+	latency_hist_t rpc_latency;
 };
 
 typedef struct connsock connsock_t;
 
+/* Framed passthrough messages, negotiated at mining.passthrough, are a
+ * pass_frame_t header followed by len bytes of payload. PASS_LINE carries
+ * addrlen bytes of the client address upstream, then the client's stratum
+ * line unmodified. PASS_DROP has no payload and drops the client. */
+enum pass_type {
+	PASS_LINE = 0,
+	PASS_DROP
+};
+
+struct pass_frame {
+	uint32_t len; /* Payload length, little endian */
+	uint32_t client_id; /* Passthrough's own client id, little endian */
+	uint8_t type;
+	uint8_t addrlen;
+	uint16_t pad;
+};
+
+typedef struct pass_frame pass_frame_t;
+
+/* Largest frame payload a passthrough will accept from its upstream pool */
+#define PASS_MAXPAYLOAD 0x100000
+
 typedef struct char_entry char_entry_t;
 
 struct char_entry {
@@ -121,7 +177,20 @@ struct server_instance {
 	char *pass;
 	bool notify;
 	bool alive;
+	bool gbtlight; /* Server supports getblocktemplatelight */
+	bool lighthead; /* Can get the next header from getblocktemplatelight */
 	connsock_t cs;
+	/* Separate persistent connection for block submission so it never
+	 * waits behind a slow getblocktemplate on cs */
+	connsock_t submitcs;
+	/* Dedicated connection held open in getblocktemplate long polls */
+	connsock_t lpcs;
+	/* Persistent connection for the watchdog's cheap health probes */
+	connsock_t probecs;
+	bool healthy; /* Answered the last probe and is not syncing */
+	bool syncing; /* Answered the last probe but is still syncing */
+	bool lagging; /* Syncing or behind the best height of the others */
+	int height; /* Best block height at the last answered probe */
 };
 
 typedef struct server_instance server_instance_t;
@@ -171,6 +240,10 @@ struct ckpool_instance {
 	ckmsgq_t *logger;
 	ckmsgq_t *console_logger;
 
+	/* List of every ckmsgq created for reporting metrics */
+	ckmsgq_t *ckmsgqs;
+	mutex_t ckmsgq_lock;
+
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -229,6 +302,8 @@ struct ckpool_instance {
 	char **btcdzmq;      // ZMQ endpoints for each btcd server
 	int btcdzmq_count;   // Number of configured ZMQ endpoints
 	int blockpoll; // How frequently in ms to poll bitcoind for block updates
+	bool gbtlight; // Use getblocktemplatelight/submitblocklight where supported
+	bool longpoll; // Long poll for templates instead of polling, default true
 	int nonce1length; // Extranonce1 length
 	int nonce2length; // Extranonce2 length
 
@@ -271,6 +346,7 @@ struct ckpool_instance {
 	int nodeservers; // If this server has remote node servers
 	bool *trusted; // If this server URL accepts trusted remote nodes
 	char *upstream; // Upstream pool in trusted remote mode
+	int aggregateshares; // Ms to total remote shares per worker before upstreaming
 
 	int update_interval; // Seconds between stratum updates
 
@@ -281,6 +357,7 @@ struct ckpool_instance {
 	char **proxyurl;
 	char **proxyauth;
 	char **proxypass;
+	int proxystandby; // Spare subproxies kept ready on the next priority proxy
 
 	/* Passthrough redirect options */
 	int redirecturls;
@@ -356,6 +433,9 @@ ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, cons
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+void add_latency(latency_hist_t *hist, const tv_t *start, const tv_t *end);
+void latency_metrics(char **buf, const char *name, const char *labels, const latency_hist_t *hist);
+void flightrec_ckmsgqs(ckpool_t *ckp);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
 bool ping_main(ckpool_t *ckp);
@@ -363,6 +443,7 @@ void empty_buffer(connsock_t *cs);
 int set_sendbufsize(ckpool_t *ckp, const int fd, const int len);
 int set_recvbufsize(ckpool_t *ckp, const int fd, const int len);
 int read_socket_line(connsock_t *cs, float *timeout);
+int read_socket_frame(connsock_t *cs, float *timeout);
 void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line);
 #define send_proc(pi, msg) _queue_proc(&(pi), msg, __FILE__, __func__, __LINE__)
 char *_send_recv_proc(const proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
@@ -375,7 +456,10 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *req, const int reqcnt);
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req);
+typedef bool (*rpc_parser_t)(const char *buf, const int len, void *data);
+bool json_rpc_parse(connsock_t *cs, const char *rpc_req, rpc_parser_t parser, void *data);
 void json_rpc_msg(connsock_t *cs, const char *rpc_req);
 bool _send_json_msg(connsock_t *cs, const json_t *json_msg, const char *file, const char *func, const int line);
 #define send_json_msg(CS, JSON_MSG) _send_json_msg(CS, JSON_MSG, __FILE__, __func__, __LINE__)
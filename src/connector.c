@@ -24,11 +24,14 @@
 #include "generator.h"
 
 #define MAX_MSGSIZE 1024
+/* Largest framed payload accepted from a passthrough, an address and a line */
+#define MAX_FRAMESIZE (INET6_ADDRSTRLEN + MAX_MSGSIZE)
 
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
+typedef struct share_total share_total_t;
 
 struct client_instance {
 	/* For clients hashtable */
@@ -68,9 +71,13 @@ struct client_instance {
 
 	/* Is this a trusted remote server */
 	bool remote;
+	/* Binary frame version negotiated with a trusted remote, 0 for json */
+	int binary;
 
 	/* Is this the parent passthrough client */
 	bool passthrough;
+	/* Does the passthrough send and receive framed messages */
+	bool framed;
 
 	/* Linked list of shares in redirector mode.*/
 	share_t *shares;
@@ -95,6 +102,7 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+	tv_t stamp; /* When it was queued */
 };
 
 struct share {
@@ -112,6 +120,15 @@ struct redirect {
 	int redirect_no;
 };
 
+/* Shares of one worker totalled on a trusted remote until the next flush */
+struct share_total {
+	UT_hash_handle hh;
+	char workername[256];
+	uint32_t shares;
+	double diff;
+	double sdiff;
+};
+
 /* Private data for the connector */
 struct connector_data {
 	ckpool_t *ckp;
@@ -157,6 +174,10 @@ struct connector_data {
 	int64_t sends_queued;
 	int64_t sends_size;
 
+	/* Time from queueing sends to them being completely written, only
+	 * updated by the sender thread */
+	latency_hist_t send_latency;
+
 	/* For protecting the pending sends list */
 	mutex_t sender_lock;
 	pthread_cond_t sender_cond;
@@ -169,6 +190,19 @@ struct connector_data {
 	/* Pending sends to the upstream server */
 	ckmsgq_t *upstream_sends;
 	connsock_t upstream_cs;
+	/* Binary frame version negotiated with the upstream server, 0 for json */
+	int upstream_binary;
+
+	/* Share records batched for the upstream server's next binary frames */
+	mutex_t share_lock;
+	char *share_batch;
+	int share_len;
+	int share_size;
+	int share_count;
+	/* Per worker totals when aggregating shares */
+	share_total_t *share_totals;
+	/* Is a flush of the batch queued on the usender */
+	bool share_queued;
 
 	/* Have we given the warning about inability to raise sendbuf size */
 	bool wmem_warn;
@@ -412,15 +446,13 @@ static int drop_client(cdata_t *cdata, client_instance_t *client)
 	return fd;
 }
 
+static const char mining_term[] = "{\"id\":42,\"method\":\"mining.term\",\"params\":[]}\n";
+
 /* For sending the drop command to the upstream pool in passthrough mode */
 static void generator_drop_client(ckpool_t *ckp, const client_instance_t *client)
 {
-	json_t *val;
-
-	JSON_CPACK(val, "{si,sI:ss:si:ss:s[]}", "id", 42, "client_id", client->id, "address",
-		   client->address_name, "server", client->server, "method", "mining.term",
-		   "params");
-	generator_add_send(ckp, val);
+	generator_add_line(ckp, client->id, client->server, client->address_name,
+			   mining_term, sizeof(mining_term) - 1);
 }
 
 static void stratifier_drop_client(ckpool_t *ckp, const client_instance_t *client)
@@ -510,6 +542,99 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	ck_wunlock(&cdata->lock);
 }
 
+static void invalid_client_json(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	char *buf = strdup("Invalid JSON, disconnecting\n");
+
+	LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
+	send_client(ckp, cdata, client->id, buf);
+}
+
+static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id);
+
+/* Parse the framed messages from a passthrough, decoding each of its clients'
+ * lines and tagging them with our client id for the passthrough. Returns false
+ * if the passthrough should be disconnected. */
+static bool parse_client_frames(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	char address[INET6_ADDRSTRLEN];
+	int64_t passthrough_id;
+	pass_frame_t frame;
+	char *payload;
+	uint32_t len;
+	int ofs = 0;
+	json_t *val;
+
+	while (client->bufofs - ofs >= (int)sizeof(frame)) {
+		memcpy(&frame, client->buf + ofs, sizeof(frame));
+		len = le32toh(frame.len);
+		if (unlikely(len > MAX_FRAMESIZE || frame.addrlen >= INET6_ADDRSTRLEN ||
+			     frame.addrlen > len)) {
+			LOGNOTICE("Passthrough %"PRId64" fd %d sent invalid frame, disconnecting",
+				  client->id, client->fd);
+			return false;
+		}
+		if (client->bufofs - ofs < (int)(sizeof(frame) + len))
+			break;
+		payload = client->buf + ofs + sizeof(frame);
+		ofs += sizeof(frame) + len;
+
+		passthrough_id = (client->id << 32) | le32toh(frame.client_id);
+		if (unlikely(frame.type != PASS_LINE)) {
+			LOGINFO("Passthrough %"PRId64" sent unknown frame type %d", client->id,
+				frame.type);
+			continue;
+		}
+		/* Do not send messages of clients we've already dropped */
+		if (unlikely(client->invalid))
+			continue;
+		val = json_loadb(payload + frame.addrlen, len - frame.addrlen,
+				 JSON_DISABLE_EOF_CHECK, NULL);
+		if (unlikely(!val)) {
+			LOGINFO("Passthrough client id %"PRId64" sent invalid json message",
+				passthrough_id);
+			send_client(ckp, cdata, passthrough_id, strdup("Invalid JSON, disconnecting\n"));
+			drop_passthrough_client(ckp, cdata, passthrough_id);
+			continue;
+		}
+		memcpy(address, payload, frame.addrlen);
+		address[frame.addrlen] = '\0';
+		json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
+		json_object_set_new_nocheck(val, "address", json_string(address));
+		json_object_set_new_nocheck(val, "server", json_integer(client->server));
+		stratifier_add_recv(ckp, val);
+	}
+	client->bufofs -= ofs;
+	if (client->bufofs)
+		memmove(client->buf, client->buf + ofs, client->bufofs);
+	return true;
+}
+
+/* Hand a complete binary frame at the start of a trusted remote's buffer to
+ * the stratifier. Returns the length of the frame, zero if it is incomplete
+ * and -1 if it is invalid. */
+static int parse_remote_frame(ckpool_t *ckp, client_instance_t *client)
+{
+	remote_frame_t frame;
+	int ret;
+
+	ret = remote_frame_check(client->buf, client->bufofs, client->binary, &frame);
+	if (unlikely(ret < 0)) {
+		LOGWARNING("Remote trusted server %"PRId64" %s sent invalid frame version %d length %u",
+			   client->id, client->address_name, frame.version, le32toh(frame.len));
+		return -1;
+	}
+	if (!ret)
+		return 0;
+	if (likely(frame.type == RF_SHARES || frame.type == RF_TOTALS))
+		stratifier_add_remote_shares(ckp, client->buf + sizeof(frame), ret - sizeof(frame),
+					     le32toh(frame.count), frame.type == RF_TOTALS);
+	else
+		LOGWARNING("Remote trusted server %"PRId64" sent unknown frame type %d",
+			   client->id, frame.type);
+	return ret;
+}
+
 /* Client is holding a reference count from being on the epoll list. Returns
  * true if we will still be receiving messages from this client. */
 static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
@@ -520,7 +645,7 @@ static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 
 retry:
 	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
-		if (!client->remote) {
+		if (!client->remote && !client->framed) {
 			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
 				client->id, client->fd);
 			return false;
@@ -537,7 +662,21 @@ retry:
 		return false;
 	}
 	client->bufofs += ret;
+	if (client->framed) {
+		if (!parse_client_frames(ckp, cdata, client))
+			return false;
+		goto retry;
+	}
 reparse:
+	/* Trusted remotes interleave binary frames with their json lines */
+	if (client->binary && client->buf[0] != '{') {
+		buflen = parse_remote_frame(ckp, client);
+		if (unlikely(buflen < 0))
+			return false;
+		if (!buflen)
+			goto retry;
+		goto consume;
+	}
 	eol = memchr(client->buf, '\n', client->bufofs);
 	if (!eol)
 		goto retry;
@@ -549,11 +688,18 @@ reparse:
 		return false;
 	}
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
-		char *buf = strdup("Invalid JSON, disconnecting\n");
-
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
-		send_client(ckp, cdata, client->id, buf);
+	if (ckp->passthrough && !ckp->node && !ckp->redirector) {
+		/* Forward the line as is, leaving it to the upstream pool to
+		 * parse if it accepts framed messages. Do not send messages of
+		 * clients we've already dropped. Redirectors need to see their
+		 * clients' shares so they keep to json. */
+		if (likely(!client->invalid) && unlikely(!generator_add_line(ckp, client->id,
+				client->server, client->address_name, client->buf, buflen))) {
+			invalid_client_json(ckp, cdata, client);
+			return false;
+		}
+	} else if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
+		invalid_client_json(ckp, cdata, client);
 		return false;
 	} else {
 		if (client->passthrough) {
@@ -583,6 +729,7 @@ reparse:
 		} else
 			json_decref(val);
 	}
+consume:
 	client->bufofs -= buflen;
 	if (client->bufofs)
 		memmove(client->buf, client->buf + buflen, client->bufofs);
@@ -825,6 +972,10 @@ static void *sender(void *arg)
 		/* Check all sends to see if they can be written out */
 		DL_FOREACH_SAFE(sends, sending, tmp) {
 			if (send_sender_send(ckp, cdata, sending)) {
+				tv_t now;
+
+				tv_time(&now);
+				add_latency(&cdata->send_latency, &sending->stamp, &now);
 				DL_DELETE(sends, sending);
 				clear_sender_send(sending, cdata);
 			} else {
@@ -901,6 +1052,7 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
+	tv_time(&sender_send->stamp);
 	inc_instance_ref(cdata, client);
 
 	mutex_lock(&cdata->sender_lock);
@@ -972,9 +1124,33 @@ out:
 	return ret;
 }
 
+/* Wrap a message for a subclient of a framed passthrough in a pass_frame_t
+ * header, freeing the original message. */
+static char *frame_message(char *buf, int *len, const int64_t client_id, const int type)
+{
+	pass_frame_t frame;
+	char *msg;
+
+	if (type != PASS_LINE)
+		*len = 0;
+	frame.len = htole32(*len);
+	frame.client_id = htole32(client_id);
+	frame.type = type;
+	frame.addrlen = 0;
+	frame.pad = 0;
+	msg = ckalloc(sizeof(frame) + *len);
+	memcpy(msg, &frame, sizeof(frame));
+	memcpy(msg + sizeof(frame), buf, *len);
+	free(buf);
+	*len += sizeof(frame);
+	return msg;
+}
+
 /* Send a client by id a heap allocated buffer, allowing this function to
- * free the ram. */
-static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+ * free the ram. Type is the pass_type used for subclients of a passthrough
+ * that takes framed messages. */
+static void send_client_type(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			     const int type)
 {
 	sender_send_t *sender_send;
 	client_instance_t *client;
@@ -1020,6 +1196,8 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 			free(buf);
 			return;
 		}
+		if (client->framed)
+			buf = frame_message(buf, &len, client_id, type);
 	} else {
 		client = ref_client_by_id(cdata, id);
 		if (unlikely(!client)) {
@@ -1043,6 +1221,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
+	tv_time(&sender_send->stamp);
 
 	mutex_lock(&cdata->sender_lock);
 	cdata->sends_generated++;
@@ -1055,6 +1234,11 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		redirect_client(ckp, client);
 }
 
+static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+{
+	send_client_type(ckp, cdata, id, buf, PASS_LINE);
+}
+
 static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg)
 {
 	client_instance_t *client;
@@ -1094,13 +1278,20 @@ static bool client_exists(cdata_t *cdata, int64_t id)
 	return !!client;
 }
 
-static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			       const bool framed)
 {
 	json_t *val;
 
-	LOGINFO("Connector adding passthrough client %"PRId64, client->id);
+	LOGINFO("Connector adding %spassthrough client %"PRId64, framed ? "framed " : "",
+		client->id);
 	client->passthrough = true;
-	JSON_CPACK(val, "{sb}", "result", true);
+	/* Set before replying as the passthrough only sends frames after */
+	client->framed = framed;
+	if (framed)
+		JSON_CPACK(val, "{sb,sb}", "result", true, "framed", true);
+	else
+		JSON_CPACK(val, "{sb}", "result", true);
 	send_client_json(ckp, cdata, client->id, val);
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
@@ -1108,11 +1299,63 @@ static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t
 		client->sendbufsize = set_sendbufsize(ckp, client->fd, 1048576);
 }
 
+static void remote_server(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			  const int binary)
+{
+	json_t *val;
+
+	if (client->remote) {
+		LOGWARNING("Connector trying to add client %"PRId64" %s as remote trusted server twice",
+			   client->id, client->address_name);
+		return;
+	}
+	LOGWARNING("Connector adding client %"PRId64" %s as remote trusted server%s",
+		   client->id, client->address_name, binary ? " with binary frames" : "");
+	client->remote = true;
+	/* Set before replying as the remote only sends frames after */
+	client->binary = binary;
+	if (binary)
+		JSON_CPACK(val, "{sb,si}", "result", true, "binary", binary);
+	else
+		JSON_CPACK(val, "{sb}", "result", true);
+	send_client_json(ckp, cdata, client->id, val);
+	if (!ckp->rmem_warn)
+		set_recvbufsize(ckp, client->fd, 2097152);
+	if (!ckp->wmem_warn)
+		client->sendbufsize = set_sendbufsize(ckp, client->fd, 2097152);
+}
+
+static void parse_upstream_msg(ckpool_t *ckp, json_t *val, const char *buf)
+{
+	const char *method = json_string_value(json_object_get(val, "method"));
+
+	if (unlikely(!method)) {
+		LOGWARNING("Failed to find method from upstream pool json %s", buf);
+		return;
+	}
+	if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
+		parse_upstream_txns(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
+		parse_upstream_auth(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_WORKINFO]))
+		parse_upstream_workinfo(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_BLOCK]))
+		parse_upstream_block(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_REQTXNS]))
+		parse_upstream_reqtxns(ckp, val);
+	else if (!safecmp(method, "pong"))
+		LOGDEBUG("Received upstream pong");
+	else
+		LOGWARNING("Unrecognised upstream method %s", method);
+}
+
 static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 {
 	json_t *req, *val = NULL, *res_val, *err_val;
+	cdata_t *cdata = ckp->cdata;
 	bool res, ret = false;
 	float timeout = 10;
+	int binary = 0;
 
 	cksem_wait(&cs->sem);
 	cs->fd = connect_socket(cs->url, cs->port);
@@ -1128,63 +1371,218 @@ static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 	if (!ckp->wmem_warn)
 		cs->sendbufsiz = set_sendbufsize(ckp, cs->fd, 2097152);
 
-	JSON_CPACK(req, "{ss,s[s]}",
+	/* Older upstream pools ignore the binary version we ask for and we
+	 * stay with json messages, and send full txids in workinfos */
+	JSON_CPACK(req, "{ss,s[sis]}",
 			"method", "mining.remote",
-			"params", PACKAGE"/"VERSION);
+			"params", PACKAGE"/"VERSION, REMOTE_BINARY_VERSION, "compact");
 	res = send_json_msg(cs, req);
 	json_decref(req);
 	if (!res) {
 		LOGWARNING("Failed to send message in connect_upstream");
 		goto out;
 	}
-	if (read_socket_line(cs, &timeout) < 1) {
-		LOGWARNING("Failed to receive line in connect_upstream");
-		goto out;
-	}
-	val = json_msg_result(cs->buf, &res_val, &err_val);
-	if (!val || !res_val) {
-		LOGWARNING("Failed to get a json result in connect_upstream, got: %s",
-			 cs->buf);
-		goto out;
+	while (42) {
+		if (read_socket_line(cs, &timeout) < 1) {
+			LOGWARNING("Failed to receive line in connect_upstream");
+			goto out;
+		}
+		val = json_msg_result(cs->buf, &res_val, &err_val);
+		if (!val) {
+			LOGWARNING("Failed to get a json result in connect_upstream, got: %s",
+				   cs->buf);
+			goto out;
+		}
+		if (res_val)
+			break;
+		/* The upstream pool may send us transactions before the
+		 * result so process anything else as usual */
+		parse_upstream_msg(ckp, val, cs->buf);
+		json_decref(val);
+		val = NULL;
 	}
 	ret = json_is_true(res_val);
 	if (!ret) {
 		LOGWARNING("Denied upstream trusted connection");
 		goto out;
 	}
-	LOGWARNING("Connected to upstream server %s:%s as trusted remote",
-		   cs->url, cs->port);
+	json_get_int(&binary, val, "binary");
+	cdata->upstream_binary = MIN(binary, REMOTE_BINARY_VERSION);
+	LOGWARNING("Connected to upstream server %s:%s as trusted remote using %s messages",
+		   cs->url, cs->port, cdata->upstream_binary ? "binary" : "json");
 	ret = true;
 out:
+	if (val)
+		json_decref(val);
 	cksem_post(&cs->sem);
 
 	return ret;
 }
 
+/* Write a whole message to the upstream pool, returning false if it failed
+ * and we had to reconnect */
+static bool upstream_write(ckpool_t *ckp, connsock_t *cs, const char *buf, const int len)
+{
+	if (write_socket(cs->fd, buf, len) == len)
+		return true;
+	if (cs->fd > 0) {
+		LOGWARNING("Upstream pool failed, attempting reconnect while caching messages");
+		Close(cs->fd);
+	}
+	do
+		sleep(5);
+	while (!connect_upstream(ckp, cs));
+	return false;
+}
+
+/* Queued on the usender to flush the share batch, never freed */
+static char upstream_shares[] = "shares";
+
+static void send_share_batch(ckpool_t *ckp, cdata_t *cdata)
+{
+	int len, count, msglen, tlen = 0, tcount = 0;
+	connsock_t *cs = &cdata->upstream_cs;
+	share_total_t *totals, *total, *tmp;
+	char *batch, *msg, *tbatch = NULL;
+
+	mutex_lock(&cdata->share_lock);
+	batch = cdata->share_batch;
+	len = cdata->share_len;
+	count = cdata->share_count;
+	totals = cdata->share_totals;
+	cdata->share_batch = NULL;
+	cdata->share_len = cdata->share_size = cdata->share_count = 0;
+	cdata->share_totals = NULL;
+	cdata->share_queued = false;
+	mutex_unlock(&cdata->share_lock);
+
+	if (totals) {
+		tbatch = ckalloc(HASH_COUNT(totals) * REMOTE_TOTAL_MAX);
+		HASH_ITER(hh, totals, total, tmp) {
+			tlen += remote_total_encode(tbatch + tlen, total->workername,
+						    strlen(total->workername), total->shares,
+						    total->diff, total->sdiff);
+			tcount += total->shares;
+			HASH_DEL(totals, total);
+			free(total);
+		}
+	}
+	if (unlikely(!count && !tcount))
+		goto out;
+	LOGDEBUG("Sending upstream batch of %d shares in %d bytes and %d in %d bytes of totals",
+		 count, len, tcount, tlen);
+	/* We may reconnect to an upstream pool without binary frames or
+	 * share totals */
+	do {
+		if (tlen && cdata->upstream_binary < 2) {
+			remote_totals_as_shares(&batch, &len, tbatch, tlen);
+			tlen = 0;
+		}
+		if (cdata->upstream_binary) {
+			msg = remote_share_frames(batch, len, tbatch, tlen, cdata->upstream_binary,
+						  &msglen);
+		} else
+			msg = remote_shares_json(batch, len, stratum_msgs[SM_SHARE], &msglen);
+		if (upstream_write(ckp, cs, msg, msglen)) {
+			free(msg);
+			break;
+		}
+		free(msg);
+	} while (42);
+out:
+	free(tbatch);
+	free(batch);
+}
+
+/* Batch a share record for the upstream pool if it takes binary frames, or
+ * return false if it should be sent as a json message instead. When
+ * aggregating, the share is added to its worker's totals which are flushed on
+ * an interval unless it is a possible block. */
+bool connector_upstream_share(ckpool_t *ckp, const char *workername, const double diff,
+			      const double sdiff, const bool block)
+{
+	cdata_t *cdata = ckp->cdata;
+	int namelen = strlen(workername);
+	bool flush = false;
+
+	if (!cdata->upstream_binary || namelen > 255)
+		return false;
+
+	mutex_lock(&cdata->share_lock);
+	if (ckp->aggregateshares && cdata->upstream_binary > 1) {
+		share_total_t *total;
+
+		HASH_FIND_STR(cdata->share_totals, workername, total);
+		if (!total) {
+			total = ckzalloc(sizeof(share_total_t));
+			strcpy(total->workername, workername);
+			HASH_ADD_STR(cdata->share_totals, workername, total);
+		}
+		total->shares++;
+		total->diff += diff;
+		if (sdiff > total->sdiff)
+			total->sdiff = sdiff;
+	} else {
+		if (cdata->share_len + REMOTE_SHARE_MAX > cdata->share_size) {
+			cdata->share_size = round_up_page(cdata->share_size * 2 + REMOTE_SHARE_MAX);
+			cdata->share_batch = realloc(cdata->share_batch, cdata->share_size);
+		}
+		cdata->share_len += remote_share_encode(cdata->share_batch + cdata->share_len,
+							workername, namelen, diff, sdiff);
+		cdata->share_count++;
+		flush = true;
+	}
+	/* Shares batch up while the usender is busy, only the first needs to
+	 * wake it */
+	flush = (flush || block) && !cdata->share_queued;
+	if (flush)
+		cdata->share_queued = true;
+	mutex_unlock(&cdata->share_lock);
+
+	if (flush)
+		ckmsgq_add(cdata->upstream_sends, upstream_shares);
+	return true;
+}
+
+/* Queue the share totals for the usender every aggregateshares ms */
+static void *ushare_flush(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	cdata_t *cdata = ckp->cdata;
+	bool flush;
+
+	rename_proc("ushareflush");
+	while (42) {
+		cksleep_ms(ckp->aggregateshares);
+		mutex_lock(&cdata->share_lock);
+		flush = cdata->share_totals && !cdata->share_queued;
+		if (flush)
+			cdata->share_queued = true;
+		mutex_unlock(&cdata->share_lock);
+		if (flush)
+			ckmsgq_add(cdata->upstream_sends, upstream_shares);
+	}
+	return NULL;
+}
+
 static void usend_process(ckpool_t *ckp, char *buf)
 {
 	cdata_t *cdata = ckp->cdata;
 	connsock_t *cs = &cdata->upstream_cs;
-	int len, sent;
+	int len;
 
+	if (buf == upstream_shares) {
+		send_share_batch(ckp, cdata);
+		return;
+	}
 	if (unlikely(!buf || !strlen(buf))) {
 		LOGERR("Send empty message to usend_process");
 		goto out;
 	}
 	LOGDEBUG("Sending upstream msg: %s", buf);
 	len = strlen(buf);
-	while (42) {
-		sent = write_socket(cs->fd, buf, len);
-		if (sent == len)
-			break;
-		if (cs->fd > 0) {
-			LOGWARNING("Upstream pool failed, attempting reconnect while caching messages");
-			Close(cs->fd);
-		}
-		do
-			sleep(5);
-		while (!connect_upstream(ckp, cs));
-	}
+	while (!upstream_write(ckp, cs, buf, len))
+		;
 out:
 	free(buf);
 }
@@ -1209,7 +1607,6 @@ static void *urecv_process(void *arg)
 	pthread_detach(pthread_self());
 
 	while (42) {
-		const char *method;
 		float timeout = 5;
 		json_t *val;
 		int ret;
@@ -1233,28 +1630,7 @@ static void *urecv_process(void *arg)
 				   cs->buf);
 			goto nomsg;
 		}
-		method = json_string_value(json_object_get(val, "method"));
-		if (unlikely(!method)) {
-			LOGWARNING("Failed to find method from upstream pool json %s",
-				   cs->buf);
-			json_decref(val);
-			goto decref;
-		}
-		if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
-			parse_upstream_txns(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
-			parse_upstream_auth(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_WORKINFO]))
-			parse_upstream_workinfo(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_BLOCK]))
-			parse_upstream_block(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_REQTXNS]))
-			parse_upstream_reqtxns(ckp, val);
-		else if (!safecmp(method, "pong"))
-			LOGDEBUG("Received upstream pong");
-		else
-			LOGWARNING("Unrecognised upstream method %s", method);
-decref:
+		parse_upstream_msg(ckp, val, cs->buf);
 		json_decref(val);
 nomsg:
 		cksem_post(&cs->sem);
@@ -1283,17 +1659,36 @@ static bool setup_upstream(ckpool_t *ckp, cdata_t *cdata)
 
 	cksem_init(&cs->sem);
 	cksem_post(&cs->sem);
+	mutex_init(&cdata->share_lock);
 
 	while (!connect_upstream(ckp, cs))
 		cksleep_ms(5000);
 
 	create_pthread(&pth, urecv_process, ckp);
 	cdata->upstream_sends = create_ckmsgq(ckp, "usender", &usend_process);
+	if (ckp->aggregateshares)
+		create_pthread(&pth, ushare_flush, ckp);
 	ret = true;
 out:
 	return ret;
 }
 
+/* Does the passthrough parent of this subclient take framed messages */
+static bool framed_subclient(cdata_t *cdata, int64_t id)
+{
+	client_instance_t *client;
+	bool ret = false;
+
+	id = subclient(id);
+	ck_rlock(&cdata->lock);
+	HASH_FIND_I64(cdata->clients, &id, client);
+	if (client)
+		ret = client->framed;
+	ck_runlock(&cdata->lock);
+
+	return ret;
+}
+
 static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -1304,9 +1699,15 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
 	json_object_del(json_msg, "client_id");
 	/* Put client_id back in for a passthrough subclient, passing its
-	 * upstream client_id instead of the passthrough's. */
-	if (subclient(client_id))
-		json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
+	 * upstream client_id instead of the passthrough's. Framed passthroughs
+	 * get it in the frame header and forward the message as is, so strip
+	 * what the passthrough would have. */
+	if (subclient(client_id)) {
+		if (framed_subclient(cdata, client_id))
+			json_object_del(json_msg, "node.method");
+		else
+			json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
+	}
 
 	/* Flag redirector clients once they've been authorised */
 	if (ckp->redirector && (client = ref_client_by_id(cdata, client_id))) {
@@ -1329,6 +1730,40 @@ void connector_add_message(ckpool_t *ckp, json_t *val)
 	ckmsgq_add(cdata->cmpq, val);
 }
 
+/* Deliver a frame from a framed upstream pool in passthrough mode straight to
+ * our client without decoding it */
+void connector_pass_frame(ckpool_t *ckp, const char *buf, const int len)
+{
+	cdata_t *cdata = ckp->cdata;
+	client_instance_t *client;
+	pass_frame_t frame;
+	int64_t client_id;
+	char *msg;
+
+	memcpy(&frame, buf, sizeof(frame));
+	client_id = le32toh(frame.client_id);
+	if (frame.type == PASS_DROP) {
+		LOGDEBUG("Connector asked to drop passthrough client id %"PRId64, client_id);
+		client = ref_client_by_id(cdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to drop", client_id);
+			return;
+		}
+		if (invalidate_client(ckp, cdata, client) >= 0)
+			LOGINFO("Connector dropped client id: %"PRId64, client_id);
+		dec_instance_ref(cdata, client);
+		return;
+	}
+	if (unlikely(frame.type != PASS_LINE || len <= (int)sizeof(frame))) {
+		LOGINFO("Connector received unknown frame type %d from upstream", frame.type);
+		return;
+	}
+	msg = ckalloc(len - sizeof(frame) + 1);
+	memcpy(msg, buf + sizeof(frame), len - sizeof(frame));
+	msg[len - sizeof(frame)] = '\0';
+	send_client(ckp, cdata, client_id, msg);
+}
+
 /* Send the passthrough the terminate node.method */
 static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id)
 {
@@ -1340,7 +1775,7 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 	/* We have a direct connection to the passthrough's connector so we
 	 * can send it any regular commands. */
 	ASPRINTF(&msg, "dropclient=%"PRId64"\n", client_id);
-	send_client(ckp, cdata, id, msg);
+	send_client_type(ckp, cdata, id, msg, PASS_DROP);
 }
 
 char *connector_stats(void *data, const int runtime)
@@ -1400,6 +1835,28 @@ char *connector_stats(void *data, const int runtime)
 	return buf;
 }
 
+/* Append the sender backlog and write latency in prometheus text format */
+void connector_metrics(ckpool_t *ckp, char **buf)
+{
+	cdata_t *cdata = ckp->cdata;
+	int64_t queued, size, generated;
+	char *line;
+
+	mutex_lock(&cdata->sender_lock);
+	queued = cdata->sends_queued;
+	size = cdata->sends_size;
+	generated = cdata->sends_generated;
+	mutex_unlock(&cdata->sender_lock);
+
+	ASPRINTF(&line, "# TYPE ckpool_sends_queued gauge\nckpool_sends_queued %"PRId64"\n"
+		 "# TYPE ckpool_sends_bytes gauge\nckpool_sends_bytes %"PRId64"\n"
+		 "# TYPE ckpool_sends_total counter\nckpool_sends_total %"PRId64"\n"
+		 "# TYPE ckpool_send_seconds histogram\n", queued, size, generated);
+	realloc_strcat(buf, line);
+	free(line);
+	latency_metrics(buf, "ckpool_send_seconds", "", &cdata->send_latency);
+}
+
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -1502,6 +1959,22 @@ retry:
 		send_unix_msg(umsg->sockd, msg);
 	} else if (cmdmatch(buf, "loglevel")) {
 		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+	} else if (cmdmatch(buf, "remote")) {
+		client_instance_t *client;
+		int binary = 0;
+
+		ret = sscanf(buf, "remote=%"PRId64",%d", &client_id, &binary);
+		if (ret < 1) {
+			LOGDEBUG("Connector failed to parse remote command: %s", buf);
+			goto retry;
+		}
+		client = ref_client_by_id(cdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to add as remote", client_id);
+			goto retry;
+		}
+		remote_server(ckp, cdata, client, binary);
+		dec_instance_ref(cdata, client);
 	} else if (cmdmatch(buf, "passthrough")) {
 		client_instance_t *client;
 
@@ -1515,7 +1988,7 @@ retry:
 			LOGINFO("Connector failed to find client id %"PRId64" to pass through", client_id);
 			goto retry;
 		}
-		passthrough_client(ckp, cdata, client);
+		passthrough_client(ckp, cdata, client, !!strstr(buf, ",framed"));
 		dec_instance_ref(cdata, client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
@@ -12,8 +12,12 @@
 
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
+bool connector_upstream_share(ckpool_t *ckp, const char *workername, const double diff,
+			      const double sdiff, const bool block);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_pass_frame(ckpool_t *ckp, const char *buf, const int len);
 char *connector_stats(void *data, const int runtime);
+void connector_metrics(ckpool_t *ckp, char **buf);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 void *connector(void *arg);
 
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flightrec.h"
+
+typedef struct fr_ring fr_ring_t;
+
+/* Only ever written by the thread that owns it. Rings of exited threads are
+ * kept for dumps until a new thread reuses them. */
+struct fr_ring {
+	fr_ring_t *next;
+	char name[16];
+	bool idle; /* Owning thread has exited, protected by fr_lock */
+	uint64_t written;
+	fr_event_t events[FR_EVENTS];
+};
+
+/* Record events up to and including this LOG_* level, -1 disables */
+int flightrec_level = LOG_INFO;
+
+static __thread fr_ring_t *thread_ring;
+static fr_ring_t *fr_rings;
+static pthread_mutex_t fr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fr_key;
+static char fr_path[512];
+
+void flightrec_init(const char *path)
+{
+	strncpy(fr_path, path, sizeof(fr_path) - 1);
+}
+
+/* Called at thread exit to hand the ring on to the next new thread */
+static void release_ring(void *arg)
+{
+	fr_ring_t *ring = arg;
+
+	pthread_mutex_lock(&fr_lock);
+	ring->idle = true;
+	pthread_mutex_unlock(&fr_lock);
+}
+
+static void create_key(void)
+{
+	pthread_key_create(&fr_key, release_ring);
+}
+
+/* Reuse the ring of an exited thread if there is one so short lived threads
+ * don't leave a ring behind each */
+static fr_ring_t *new_ring(void)
+{
+	fr_ring_t *ring;
+
+	pthread_once(&fr_once, create_key);
+	pthread_mutex_lock(&fr_lock);
+	for (ring = fr_rings; ring; ring = ring->next) {
+		if (ring->idle)
+			break;
+	}
+	if (ring) {
+		ring->idle = false;
+		ring->written = 0;
+	} else {
+		ring = calloc(1, sizeof(fr_ring_t));
+		if (ring) {
+			ring->next = fr_rings;
+			fr_rings = ring;
+		}
+	}
+	pthread_mutex_unlock(&fr_lock);
+	if (!ring)
+		return NULL;
+	prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+	pthread_setspecific(fr_key, ring);
+	return ring;
+}
+
+void _flightrec(const int type, const int level, const int64_t a, const int64_t b, const int64_t c)
+{
+	fr_ring_t *ring = thread_ring;
+	fr_event_t *event;
+	struct timespec ts;
+
+	if (__builtin_expect(!ring, 0)) {
+		ring = thread_ring = new_ring();
+		if (!ring)
+			return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	event = &ring->events[ring->written % FR_EVENTS];
+	event->ns = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+	event->type = type;
+	event->level = level;
+	event->a = a;
+	event->b = b;
+	event->c = c;
+	ring->written++;
+}
+
+static void write_all(const int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, ptr, len);
+
+		if (ret < 1)
+			return;
+		ptr += ret;
+		len -= ret;
+	}
+}
+
+/* Only uses async signal safe calls so it can be called from signal handlers.
+ * Rings are not locked so events being written during the dump may be torn.
+ * Returns the path of the dump or NULL on failure. */
+const char *flightrec_dump(void)
+{
+	fr_header_t hdr = {FR_MAGIC, FR_VERSION, 0, 0};
+	fr_ring_t *ring;
+	int fd;
+
+	if (!fr_path[0])
+		return NULL;
+	fd = open(fr_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0)
+		return NULL;
+	for (ring = fr_rings; ring; ring = ring->next)
+		hdr.rings++;
+	write_all(fd, &hdr, sizeof(hdr));
+	for (ring = fr_rings; ring && hdr.rings; ring = ring->next, hdr.rings--) {
+		uint64_t written = ring->written;
+		fr_ringhdr_t rhdr;
+		int start;
+
+		memset(&rhdr, 0, sizeof(rhdr));
+		memcpy(rhdr.name, ring->name, sizeof(rhdr.name));
+		if (written > FR_EVENTS) {
+			rhdr.events = FR_EVENTS;
+			start = written % FR_EVENTS;
+		} else {
+			rhdr.events = written;
+			start = 0;
+		}
+		write_all(fd, &rhdr, sizeof(rhdr));
+		write_all(fd, &ring->events[start], sizeof(fr_event_t) * (rhdr.events - start));
+		write_all(fd, ring->events, sizeof(fr_event_t) * start);
+	}
+	close(fd);
+	return fr_path;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef FLIGHTREC_H
+#define FLIGHTREC_H
+
+#include <stdint.h>
+
+/* Binary flight recorder of recent events kept in a ring per thread and
+ * dumped to a file on SIGUSR2, on fatal errors, or by API request. */
+
+#define FR_MAGIC 0x52464b43 /* "CKFR" */
+#define FR_VERSION 1
+
+/* Events kept per thread */
+#define FR_EVENTS 4096
+
+enum fr_type {
+	FR_SHARE_ACCEPT = 0,	/* a: client id, b: latency us, c: diff */
+	FR_SHARE_REJECT,	/* a: client id, b: latency us, c: diff */
+	FR_NOTIFY,		/* a: workbase id, b: clean */
+	FR_DIFF,		/* a: client id, b: old diff, c: new diff */
+	FR_RPC_START,		/* a: packed method */
+	FR_RPC_END,		/* a: packed method, b: latency us, c: success */
+	FR_QUEUE,		/* a: packed queue name, b: depth, c: messages */
+	FR_TYPES
+};
+
+static const char __attribute__((unused)) *fr_types[] = {
+	"share.accept",
+	"share.reject",
+	"notify",
+	"diff",
+	"rpc.start",
+	"rpc.end",
+	"queue"
+};
+
+struct fr_event {
+	int64_t ns; /* Realtime nanoseconds */
+	uint16_t type;
+	uint8_t level; /* LOG_* level of the event */
+	uint8_t pad[5];
+	int64_t a;
+	int64_t b;
+	int64_t c;
+};
+
+typedef struct fr_event fr_event_t;
+
+/* The dump file is a fr_header_t followed by each thread's fr_ringhdr_t and
+ * its events oldest first. */
+struct fr_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rings;
+	uint32_t pad;
+};
+
+typedef struct fr_header fr_header_t;
+
+struct fr_ringhdr {
+	char name[16];
+	uint32_t events;
+	uint32_t pad;
+};
+
+typedef struct fr_ringhdr fr_ringhdr_t;
+
+/* Pack up to the first 8 characters of a string into an int64 for events */
+static inline int64_t fr_pack(const char *s)
+{
+	int64_t ret = 0;
+	int i;
+
+	for (i = 0; i < 8 && s && s[i]; i++)
+		ret |= (int64_t)(uint8_t)s[i] << (i * 8);
+	return ret;
+}
+
+static inline void fr_unpack(int64_t val, char *s)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		s[i] = (val >> (i * 8)) & 0xff;
+	s[8] = '\0';
+}
+
+extern int flightrec_level;
+
+void flightrec_init(const char *path);
+void _flightrec(const int type, const int level, const int64_t a, const int64_t b, const int64_t c);
+#define flightrec(type, level, a, b, c) do { \
+	if (level <= flightrec_level) \
+		_flightrec(type, level, a, b, c); \
+} while (0)
+const char *flightrec_dump(void);
+
+#endif /* FLIGHTREC_H */
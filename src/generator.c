@@ -18,6 +18,7 @@
 #include "ckpool.h"
 #include "libckpool.h"
 #include "generator.h"
+#include "connector.h"
 #include "stratifier.h"
 #include "bitcoin.h"
 #include "uthash.h"
@@ -30,6 +31,7 @@ struct notify_instance {
 
 	char prevhash[68];
 	json_t *jobid;
+	char *jobidjson; /* jobid preformatted for mining.submit */
 	char *coinbase1;
 	char *coinbase2;
 	int coinb1len;
@@ -72,6 +74,8 @@ struct pass_msg {
 	proxy_instance_t *proxy;
 	connsock_t *cs;
 	char *msg;
+	int len;
+	bool framed;
 };
 
 typedef struct pass_msg pass_msg_t;
@@ -100,6 +104,7 @@ struct proxy_instance {
 	ckpool_t *ckp;
 	connsock_t cs;
 	bool passthrough;
+	bool framed; /* Passthrough upstream accepts framed messages */
 	bool node;
 	int id; /* Proxy server id*/
 	int subid; /* Subproxy id */
@@ -158,9 +163,6 @@ struct proxy_instance {
 	/* Back off from retrying if we fail one of the above */
 	int backoff;
 
-	 /* Are we in the middle of a blocked write of this message? */
-	cs_msg_t *sending;
-
 	pthread_t pth_precv;
 
 	ckmsgq_t *passsends;	// passthrough sends
@@ -201,29 +203,70 @@ struct generator_data {
 	mutex_t share_lock;
 	share_msg_t *shares;
 	int64_t share_id;
+	time_t last_share_time;
 
 	server_instance_t *current_si; // Current server instance
 
+	/* Long polling state. The longpollid and its prevhash are from the
+	 * newest template from lpsi */
+	mutex_t lp_lock;
+	pthread_t pth_longpoll;
+	server_instance_t *lpsi;
+	char *longpollid;
+	char lpprevhash[68];
+	gbtbase_t *lpgbt; // Newest long polled template not yet used
+	server_instance_t *longpolling; // Server a long poll is held open on
+
 	proxy_instance_t *current_proxy;
+	proxy_instance_t *standby_proxy; // Proxy we last kept spares on
 };
 
 typedef struct generator_data gdata_t;
 
-/* Use a temporary fd when testing server_alive to avoid races on cs->fd */
-static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
+/* getblocktemplatelight can only be used when nothing downstream of us needs
+ * the transactions in our templates */
+static bool gbtlight_usable(const ckpool_t *ckp)
+{
+	int i;
+
+	if (!ckp->gbtlight || ckp->nodeservers || ckp->remote || ckp->node)
+		return false;
+	for (i = 0; i < ckp->serverurls; i++) {
+		if (ckp->trusted && ckp->trusted[i])
+			return false;
+	}
+	return true;
+}
+
+/* Give a secondary connection to the server the same details as cs */
+static void clone_connsock(server_instance_t *si, connsock_t *scs)
+{
+	connsock_t *cs = &si->cs;
+
+	cksem_wait(&scs->sem);
+	dealloc(scs->url);
+	dealloc(scs->port);
+	dealloc(scs->auth);
+	scs->url = strdup(cs->url);
+	scs->port = strdup(cs->port);
+	scs->auth = strdup(cs->auth);
+	scs->addrcache.addrlen = 0;
+	Close(scs->fd);
+	cksem_post(&scs->sem);
+}
+
+/* Set up cs with the address and auth of the server, dropping any previous
+ * address and keep-alive connection. Enter holding cs->sem. */
+static bool server_connsock(server_instance_t *si, connsock_t *cs)
 {
 	char *userpass = NULL;
-	bool ret = false;
-	connsock_t *cs;
-	gbtbase_t gbt;
-	int fd;
 
-	if (si->alive)
-		return true;
-	cs = &si->cs;
+	dealloc(cs->url);
+	dealloc(cs->port);
+	Close(cs->fd);
 	if (!extract_sockaddr(si->url, &cs->url, &cs->port)) {
 		LOGWARNING("Failed to extract address from %s", si->url);
-		return ret;
+		return false;
 	}
 	userpass = strdup(si->auth);
 	realloc_strcat(&userpass, ":");
@@ -233,26 +276,62 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 	if (!cs->auth) {
 		LOGWARNING("Failed to create base64 auth from %s", userpass);
 		dealloc(userpass);
-		return ret;
+		return false;
 	}
 	dealloc(userpass);
+	/* The url may resolve differently by now */
+	cs->addrcache.addrlen = 0;
+	return true;
+}
 
-	fd = connect_socket(cs->url, cs->port);
-	if (fd < 0) {
-		if (!pinging)
-			LOGWARNING("Failed to connect socket to %s:%s !", cs->url, cs->port);
+/* Full check of a server before it is promoted to current, fetching a block
+ * template and validating the address. The watchdog only probes servers with
+ * probe_server in between. */
+static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
+{
+	bool ret = false;
+	connsock_t *cs;
+	gbtbase_t gbt;
+
+	if (si->alive)
+		return true;
+	cs = &si->cs;
+	cksem_wait(&cs->sem);
+	ret = server_connsock(si, cs);
+	cksem_post(&cs->sem);
+	if (!ret)
 		return ret;
-	}
+	ret = false;
+	clone_connsock(si, &si->submitcs);
 
 	/* Test we can connect, authorise and get a block template */
 	if (!gen_gbtbase(cs, &gbt)) {
 		if (!pinging) {
-			LOGINFO("Failed to get test block template from %s:%s!",
-				cs->url, cs->port);
+			LOGWARNING("Failed to get test block template from %s:%s !",
+				   cs->url, cs->port);
 		}
 		goto out;
 	}
 	clear_gbtbase(&gbt);
+	if (gbtlight_usable(ckp)) {
+		si->gbtlight = gen_gbtlight(cs, &gbt);
+		if (si->gbtlight)
+			clear_gbtbase(&gbt);
+		else if (!pinging)
+			LOGNOTICE("No getblocktemplatelight support from %s:%s, using getblocktemplate",
+				  cs->url, cs->port);
+	}
+	/* Empty work needs the bits of the next block which only a light
+	 * template gives us cheaply */
+	si->lighthead = si->gbtlight;
+	if (!si->lighthead) {
+		si->lighthead = gen_gbtlight(cs, &gbt);
+		if (si->lighthead)
+			clear_gbtbase(&gbt);
+		else if (!pinging)
+			LOGNOTICE("No empty work on new blocks from %s:%s without getblocktemplatelight",
+				  cs->url, cs->port);
+	}
 	if (unlikely(ckp->btcsolo && !ckp->btcaddress)) {
 		/* If no btcaddress is specified in solobtc mode, choose one of
 		 * the donation addresses from mainnet, testnet, or regtest for
@@ -273,12 +352,11 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 	si->alive = cs->alive = ret = true;
 	LOGNOTICE("Server alive: %s:%s", cs->url, cs->port);
 out:
-	/* Close the file handle */
-	close(fd);
 	return ret;
 }
 
-/* Find the highest priority server alive and return it */
+/* Find the highest priority server alive and return it, avoiding any the
+ * watchdog has found lagging unless there is nothing else */
 static server_instance_t *live_server(ckpool_t *ckp, gdata_t *gdata)
 {
 	server_instance_t *alive = NULL;
@@ -293,7 +371,7 @@ retry:
 		server_instance_t *si = ckp->servers[i];
 		cs = &si->cs;
 
-		if (si->alive) {
+		if (si->alive && !si->lagging) {
 			alive = si;
 			goto living;
 		}
@@ -303,7 +381,17 @@ retry:
 	for (i = 0; i < ckp->btcds; i++) {
 		server_instance_t *si = ckp->servers[i];
 
-		if (server_alive(ckp, si, false)) {
+		if (!si->lagging && server_alive(ckp, si, false)) {
+			alive = si;
+			goto living;
+		}
+	}
+
+	/* A lagging server is still better than none */
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+
+		if (si->lagging && server_alive(ckp, si, false)) {
 			alive = si;
 			goto living;
 		}
@@ -319,22 +407,28 @@ living:
 	return alive;
 }
 
-static void kill_server(server_instance_t *si)
+static void clear_connsock(connsock_t *cs)
 {
-	connsock_t *cs;
-
-	if (!si) // This shouldn't happen
-		return;
-
-	LOGNOTICE("Killing server");
-	cs = &si->cs;
 	Close(cs->fd);
 	empty_buffer(cs);
+	dealloc(cs->buf);
 	dealloc(cs->url);
 	dealloc(cs->port);
 	dealloc(cs->auth);
 }
 
+static void kill_server(server_instance_t *si)
+{
+	if (!si) // This shouldn't happen
+		return;
+
+	LOGNOTICE("Killing server");
+	clear_connsock(&si->cs);
+	clear_connsock(&si->submitcs);
+	clear_connsock(&si->lpcs);
+	clear_connsock(&si->probecs);
+}
+
 static void clear_unix_msg(unix_msg_t **umsg)
 {
 	if (*umsg) {
@@ -345,22 +439,146 @@ static void clear_unix_msg(unix_msg_t **umsg)
 	}
 }
 
-bool generator_submitblock(ckpool_t *ckp, const char *buf)
+/* A copy of the block for the submissions to backup servers, which carry on
+ * detached once the current server has answered */
+struct block_copy {
+	mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int pending; /* Backup submissions still running */
+	int accepted;
+	char *buf;
+	char *txns;
+};
+
+struct block_submission {
+	server_instance_t *si;
+	struct block_copy *bc;
+};
+
+static void put_block_copy(struct block_copy *bc)
+{
+	bool last;
+
+	mutex_lock(&bc->lock);
+	last = !--bc->refs;
+	mutex_unlock(&bc->lock);
+	if (!last)
+		return;
+	mutex_destroy(&bc->lock);
+	pthread_cond_destroy(&bc->cond);
+	free(bc->buf);
+	free(bc->txns);
+	free(bc);
+}
+
+static void *submit_backup_block(void *arg)
+{
+	struct block_submission *bs = arg;
+	struct block_copy *bc = bs->bc;
+	connsock_t *cs = &bs->si->submitcs;
+	tv_t start_tv, end_tv;
+	bool ret;
+
+	pthread_detach(pthread_self());
+	rename_proc("submitblock");
+
+	tv_time(&start_tv);
+	ret = submit_block(cs, bc->buf, bc->txns, NULL);
+	tv_time(&end_tv);
+	LOGWARNING("Block submission to backup %s:%s %s in %.3fms", cs->url, cs->port,
+		   ret ? "accepted" : "rejected", tvdiff(&end_tv, &start_tv) * 1000);
+
+	mutex_lock(&bc->lock);
+	if (ret)
+		bc->accepted++;
+	bc->pending--;
+	pthread_cond_broadcast(&bc->cond);
+	mutex_unlock(&bc->lock);
+	put_block_copy(bc);
+	free(bs);
+	return NULL;
+}
+
+/* Submit the block to every live or healthy server at once over their submit
+ * connections. We only wait for the current server, or for a light block the
+ * server its template came from, since only it knows the job_id even if we
+ * have failed over from it since. The backups finish on their own threads
+ * unless the current server rejects the block, when we wait to see if any of
+ * them accepted it instead. */
+bool generator_submitblock(ckpool_t *ckp, const char *buf, const char *txns, const char *job_id,
+			   const int job_server)
 {
 	gdata_t *gdata = ckp->gdata;
+	struct block_copy *bc = NULL;
+	tv_t start_tv, end_tv;
 	server_instance_t *si;
-	bool warn = false;
+	bool ret, warn = false;
 	connsock_t *cs;
+	int i;
 
-	while (unlikely(!(si = gdata->current_si))) {
-		if (!warn)
-			LOGWARNING("No live current server in generator_blocksubmit! Resubmitting indefinitely!");
-		warn = true;
-		cksleep_ms(10);
+	if (job_id) {
+		if (unlikely(job_server < 0 || job_server >= ckp->btcds)) {
+			LOGERR("Invalid server %d for light block job %s", job_server, job_id);
+			return false;
+		}
+		si = ckp->servers[job_server];
+		if (si != gdata->current_si) {
+			LOGWARNING("Submitting light block to %s:%s its template came from",
+				   si->submitcs.url, si->submitcs.port);
+		}
+	} else {
+		while (unlikely(!(si = gdata->current_si))) {
+			if (!warn)
+				LOGWARNING("No live current server in generator_blocksubmit! Resubmitting indefinitely!");
+			warn = true;
+			cksleep_ms(10);
+		}
 	}
-	cs = &si->cs;
 	LOGNOTICE("Submitting block data!");
-	return submit_block(cs, buf);
+	for (i = 0; i < ckp->btcds && !job_id; i++) {
+		server_instance_t *server = ckp->servers[i];
+		struct block_submission *bs;
+		pthread_t pth;
+
+		if (server == si || (!server->alive && !server->healthy))
+			continue;
+		if (!bc) {
+			bc = ckzalloc(sizeof(struct block_copy));
+			mutex_init(&bc->lock);
+			cond_init(&bc->cond);
+			bc->refs = 1;
+			bc->buf = strdup(buf);
+			if (txns)
+				bc->txns = strdup(txns);
+		}
+		bs = ckalloc(sizeof(struct block_submission));
+		bs->si = server;
+		bs->bc = bc;
+		mutex_lock(&bc->lock);
+		bc->refs++;
+		bc->pending++;
+		mutex_unlock(&bc->lock);
+		create_pthread(&pth, submit_backup_block, bs);
+	}
+
+	cs = &si->submitcs;
+	tv_time(&start_tv);
+	ret = submit_block(cs, buf, txns, job_id);
+	tv_time(&end_tv);
+	LOGWARNING("Block submission to %s:%s %s in %.3fms", cs->url, cs->port,
+		   ret ? "accepted" : "rejected", tvdiff(&end_tv, &start_tv) * 1000);
+	if (!bc)
+		return ret;
+	if (!ret) {
+		mutex_lock(&bc->lock);
+		while (bc->pending)
+			cond_wait(&bc->cond, &bc->lock);
+		ret = bc->accepted > 0;
+		mutex_unlock(&bc->lock);
+	}
+	put_block_copy(bc);
+	return ret;
 }
 
 void generator_preciousblock(ckpool_t *ckp, const char *hash)
@@ -373,12 +591,49 @@ void generator_preciousblock(ckpool_t *ckp, const char *hash)
 		LOGWARNING("No live current server in generator_get_blockhash");
 		return;
 	}
-	cs = &si->cs;
+	cs = &si->submitcs;
 	precious_block(cs, hash);
 }
 
 static void reconnect_generator(ckpool_t *ckp);
 
+/* Fill in the header fields of the block after hash from a light template,
+ * which is cheap since it has no transactions. Fails if the server can't give
+ * us one or its tip has already moved away from hash. */
+bool generator_get_nexthead(ckpool_t *ckp, const char *hash, struct genwork *wb)
+{
+	gdata_t *gdata = ckp->gdata;
+	server_instance_t *si;
+	const char *prevhash;
+	bool ret = false;
+	gbtbase_t gbt;
+
+	si = gdata->current_si;
+	if (unlikely(!si) || !si->lighthead)
+		return ret;
+	if (!gen_gbtlight(&si->cs, &gbt)) {
+		LOGINFO("Failed to get next header from %s:%s", si->cs.url, si->cs.port);
+		return ret;
+	}
+	prevhash = json_string_value(json_object_get(gbt.json, "previousblockhash"));
+	if (safecmp(prevhash, hash)) {
+		LOGINFO("Next header from %s:%s is not on top of %s", si->cs.url, si->cs.port, hash);
+		goto out;
+	}
+	strcpy(wb->target, gbt.target);
+	wb->diff = gbt.diff;
+	wb->version = gbt.version;
+	strcpy(wb->bbversion, gbt.bbversion);
+	strcpy(wb->nbit, gbt.nbit);
+	wb->height = gbt.height;
+	wb->curtime = gbt.curtime;
+	wb->coinbasevalue = gbt.coinbasevalue;
+	ret = true;
+out:
+	clear_gbtbase(&gbt);
+	return ret;
+}
+
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -498,7 +753,7 @@ retry:
 		bool ret;
 
 		LOGNOTICE("Submitting block data!");
-		ret = submit_block(cs, buf + 12 + 64 + 1);
+		ret = submit_block(&si->submitcs, buf + 12 + 64 + 1, NULL, NULL);
 		memset(buf + 12 + 64, 0, 1);
 		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
 		send_proc(ckp->stratifier, blockmsg);
@@ -628,7 +883,7 @@ static inline bool parent_proxy(const proxy_instance_t *proxy)
 	return (proxy->parent == proxy);
 }
 
-static void recruit_subproxies(proxy_instance_t *proxi, const int recruits);
+static void recruit_subproxies(proxy_instance_t *proxi, const int64_t recruits);
 
 static bool parse_subscribe(connsock_t *cs, proxy_instance_t *proxi)
 {
@@ -792,9 +1047,18 @@ static bool passthrough_stratum(connsock_t *cs, proxy_instance_t *proxi)
 	bool res, ret = false;
 	float timeout = 10;
 
-	JSON_CPACK(req, "{ss,s[s]}",
-			"method", "mining.passthrough",
-			"params", PACKAGE"/"VERSION);
+	/* Older upstream pools ignore the framed request and we fall back to
+	 * json messages. Redirectors always use json since they track their
+	 * clients' authorisation and shares from the upstream replies. */
+	if (proxi->ckp->redirector) {
+		JSON_CPACK(req, "{ss,s[s]}",
+				"method", "mining.passthrough",
+				"params", PACKAGE"/"VERSION);
+	} else {
+		JSON_CPACK(req, "{ss,s[ss]}",
+				"method", "mining.passthrough",
+				"params", PACKAGE"/"VERSION, "framed");
+	}
 	res = send_json_msg(cs, req);
 	json_decref(req);
 	if (!res) {
@@ -819,6 +1083,9 @@ static bool passthrough_stratum(connsock_t *cs, proxy_instance_t *proxi)
 		goto out;
 	}
 	proxi->passthrough = true;
+	proxi->framed = json_is_true(json_object_get(val, "framed"));
+	LOGNOTICE("Passthrough to %s:%s using %s messages", cs->url, cs->port,
+		  proxi->framed ? "framed" : "json");
 out:
 	if (val)
 		json_decref(val);
@@ -877,6 +1144,163 @@ static void reconnect_generator(ckpool_t *ckp)
 	send_proc(ckp->generator, "reconnect");
 }
 
+/* Remember the longpollid of the newest template from si to long poll with */
+static void store_longpollid(gdata_t *gdata, server_instance_t *si, const gbtbase_t *gbt)
+{
+	const char *lpid = json_string_value(json_object_get(gbt->json, "longpollid"));
+
+	/* It is sent back verbatim in a json string */
+	if (!gdata->ckp->longpoll || !lpid || strpbrk(lpid, "\"\\"))
+		return;
+	mutex_lock(&gdata->lp_lock);
+	gdata->lpsi = si;
+	free(gdata->longpollid);
+	gdata->longpollid = strdup(lpid);
+	strcpy(gdata->lpprevhash, gbt->prevhash);
+	mutex_unlock(&gdata->lp_lock);
+}
+
+/* Stop long polling until a fresh longpollid arrives with a polled template */
+static void drop_longpoll(gdata_t *gdata)
+{
+	mutex_lock(&gdata->lp_lock);
+	dealloc(gdata->longpollid);
+	gdata->longpolling = NULL;
+	mutex_unlock(&gdata->lp_lock);
+}
+
+/* Bitcoind holds a long poll until the tip or, after a minute, the mempool
+ * changes, keeping one of its RPC threads busy even if we give up on it. With
+ * a quiet mempool that can be the whole gap between blocks, so abandoned long
+ * polls would pile up and starve its other RPCs. Wait as long as it takes
+ * instead, relying on TCP keepalive to notice a dead connection. */
+#define LONGPOLL_TIMEOUT (24 * 60 * 60)
+
+/* Hold a getblocktemplate long poll open on the current server so bitcoind
+ * hands us a new template as soon as there's a new block or the transactions
+ * change. The template is kept for the stratifier which is told whether the
+ * block changed, saving it from fetching the template itself. */
+static void *longpoller(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	server_instance_t *cloned = NULL;
+	gdata_t *gdata = ckp->gdata;
+	char prevhash[68], hash[68];
+	gbtbase_t *gbt = NULL;
+	char *lpid = NULL;
+
+	pthread_detach(pthread_self());
+	rename_proc("longpoll");
+
+	while (42) {
+		server_instance_t *si = gdata->current_si;
+		const char *newid;
+		tv_t start, end;
+		char bin[32], swap[32];
+		char *msg;
+
+		dealloc(lpid);
+		mutex_lock(&gdata->lp_lock);
+		if (si && si->alive && gdata->lpsi == si && gdata->longpollid) {
+			lpid = strdup(gdata->longpollid);
+			strcpy(prevhash, gdata->lpprevhash);
+		}
+		gdata->longpolling = lpid ? si : NULL;
+		mutex_unlock(&gdata->lp_lock);
+		if (!lpid) {
+			/* Wait for a template with a longpollid from si */
+			cksleep_ms(ckp->blockpoll);
+			continue;
+		}
+
+		/* Only we use lpcs so its details are set up here rather than in
+		 * server_alive which would have to wait for a long poll */
+		if (si != cloned) {
+			clone_connsock(si, &si->lpcs);
+			cloned = si;
+		}
+		if (!gbt)
+			gbt = ckalloc(sizeof(gbtbase_t));
+		tv_time(&start);
+		if (!gen_gbtlongpoll(&si->lpcs, gbt, lpid, si->gbtlight)) {
+			tv_time(&end);
+			/* Timing out with nothing new is normal, anything else
+			 * means polling for changes until there's a new id */
+			if (tvdiff(&end, &start) < LONGPOLL_TIMEOUT - 1) {
+				LOGWARNING("Long poll to %s:%s failed, polling for changes instead",
+					   si->lpcs.url, si->lpcs.port);
+				drop_longpoll(gdata);
+				sleep(5);
+			}
+			continue;
+		}
+		newid = json_string_value(json_object_get(gbt->json, "longpollid"));
+		if (unlikely(!newid || !strcmp(newid, lpid))) {
+			LOGWARNING("No long poll support from %s:%s, polling for changes instead",
+				   si->lpcs.url, si->lpcs.port);
+			clear_gbtbase(gbt);
+			drop_longpoll(gdata);
+			sleep(ckp->update_interval);
+			continue;
+		}
+		if (gbt->job_id)
+			gbt->job_server = si->id;
+		store_longpollid(gdata, si, gbt);
+
+		mutex_lock(&gdata->lp_lock);
+		if (gdata->lpgbt) {
+			clear_gbtbase(gdata->lpgbt);
+			free(gdata->lpgbt);
+		}
+		gdata->lpgbt = gbt;
+		mutex_unlock(&gdata->lp_lock);
+
+		if (strcmp(gbt->prevhash, prevhash)) {
+			hex2bin(bin, gbt->prevhash, 32);
+			swap_256(swap, bin);
+			__bin2hex(hash, swap, 32);
+			LOGINFO("Long poll returned new block %s", hash);
+			ASPRINTF(&msg, "longpoll=%s", hash);
+			send_proc(ckp->stratifier, msg);
+			free(msg);
+		} else {
+			LOGINFO("Long poll returned new transactions");
+			send_proc(ckp->stratifier, "longpoll");
+		}
+		gbt = NULL;
+	}
+	return NULL;
+}
+
+/* Take the template a long poll returned if the stratifier hasn't already */
+struct genwork *generator_getlongpoll(ckpool_t *ckp)
+{
+	gdata_t *gdata = ckp->gdata;
+	gbtbase_t *gbt;
+
+	mutex_lock(&gdata->lp_lock);
+	gbt = gdata->lpgbt;
+	gdata->lpgbt = NULL;
+	mutex_unlock(&gdata->lp_lock);
+	return gbt;
+}
+
+/* Whether bitcoind will tell us about changes so there's no need to poll. A
+ * long poll still held on a server we've since failed over from doesn't count
+ * since it only returns once that server sees a change. */
+bool generator_longpolling(ckpool_t *ckp)
+{
+	gdata_t *gdata = ckp->gdata;
+	bool ret;
+
+	if (!gdata)
+		return false;
+	mutex_lock(&gdata->lp_lock);
+	ret = gdata->longpolling && gdata->longpolling == gdata->current_si;
+	mutex_unlock(&gdata->lp_lock);
+	return ret;
+}
+
 struct genwork *generator_getbase(ckpool_t *ckp)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -892,7 +1316,15 @@ struct genwork *generator_getbase(ckpool_t *ckp)
 	}
 	cs = &si->cs;
 	gbt = ckzalloc(sizeof(gbtbase_t));
-	if (unlikely(!gen_gbtbase(cs, gbt))) {
+	/* Fall back to a full template if the light one fails */
+	if (si->gbtlight && gen_gbtlight(cs, gbt)) {
+		gbt->job_server = si->id;
+		store_longpollid(gdata, si, gbt);
+		goto out;
+	}
+	if (likely(gen_gbtbase(cs, gbt)))
+		store_longpollid(gdata, si, gbt);
+	else {
 		LOGWARNING("Failed to get block template from %s:%s", cs->url, cs->port);
 		si->alive = cs->alive = false;
 
@@ -921,7 +1353,7 @@ int generator_getbest(ckpool_t *ckp, char *hash)
 		LOGWARNING("No live current server in generator_getbest");
 		goto out;
 	}
-	if (si->notify) {
+	if (si->notify || generator_longpolling(ckp)) {
 		ret = GETBEST_NOTIFY;
 		goto out;
 	}
@@ -1046,6 +1478,7 @@ static bool parse_notify(ckpool_t *ckp, proxy_instance_t *proxi, json_t *val)
 	LOGDEBUG("Received new notify from proxy %d:%d", proxi->id, proxi->subid);
 	ni = ckzalloc(sizeof(notify_instance_t));
 	ni->jobid = job_id;
+	ni->jobidjson = json_dumps(job_id, JSON_ENCODE_ANY | JSON_ESCAPE_SLASH);
 	jobidbuf = json_string_value(job_id);
 	LOGDEBUG("JobID %s", jobidbuf);
 	ni->coinbase1 = coinbase1;
@@ -1649,10 +2082,34 @@ static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->stratifier, buf);
 }
 
+/* Drop shares older than 2 mins without response. The hashtable iterates in
+ * insertion order which is also submission time order so only the expired
+ * shares at the head are visited. Must hold share_lock */
+static void __age_shares(gdata_t *gdata, const time_t now)
+{
+	share_msg_t *share, *tmpshare;
+
+	HASH_ITER(hh, gdata->shares, share, tmpshare) {
+		if (share->submit_time >= now - 120)
+			break;
+		HASH_DEL(gdata->shares, share);
+		free(share);
+	}
+}
+
+static void age_shares(gdata_t *gdata)
+{
+	time_t now = time(NULL);
+
+	mutex_lock(&gdata->share_lock);
+	__age_shares(gdata, now);
+	mutex_unlock(&gdata->share_lock);
+}
+
 /* Add a share to the gdata share hashlist. Returns the share id */
 static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
 {
-	share_msg_t *share = ckzalloc(sizeof(share_msg_t)), *tmpshare;
+	share_msg_t *share = ckzalloc(sizeof(share_msg_t));
 	time_t now;
 	int ret;
 
@@ -1663,13 +2120,12 @@ static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
 	/* Add new share entry to the share hashtable. Age old shares */
 	mutex_lock(&gdata->share_lock);
 	ret = share->id64 = gdata->share_id++;
+	/* Keep submission order monotonic if the clock steps back */
+	if (share->submit_time < gdata->last_share_time)
+		share->submit_time = gdata->last_share_time;
+	gdata->last_share_time = share->submit_time;
 	HASH_ADD_I64(gdata->shares, id64, share);
-	HASH_ITER(hh, gdata->shares, share, tmpshare) {
-		if (share->submit_time < now - 120) {
-			HASH_DEL(gdata->shares, share);
-			free(share);
-		}
-	}
+	__age_shares(gdata, now);
 	mutex_unlock(&gdata->share_lock);
 
 	return ret;
@@ -1741,6 +2197,7 @@ static void clear_notify(notify_instance_t *ni)
 {
 	if (ni->jobid)
 		json_decref(ni->jobid);
+	free(ni->jobidjson);
 	free(ni->coinbase1);
 	free(ni->coinbase2);
 	free(ni);
@@ -1813,10 +2270,8 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 
 	mutex_lock(&gdata->share_lock);
 	HASH_FIND_I64(gdata->shares, &id, share);
-	if (share) {
+	if (share)
 		HASH_DEL(gdata->shares, share);
-		free(share);
-	}
 	mutex_unlock(&gdata->share_lock);
 
 	if (!share) {
@@ -1839,105 +2294,164 @@ out:
 	return ret;
 }
 
+static const char submit_suffix[] = "\"method\": \"mining.submit\"}\n";
+
+/* Output buffer of serialised submits for one subproxy, owned by proxy_send */
 struct cs_msg {
-	cs_msg_t *next;
-	cs_msg_t *prev;
-	proxy_instance_t *proxy;
+	UT_hash_handle hh;
+	proxy_instance_t *proxy; /* Hash key */
+	int fd; /* Connection the buffered data is for */
+	char *prefix; /* Start of every mining.submit to this subproxy */
+	int prefixlen;
 	char *buf;
 	int len;
 	int ofs;
+	int size;
 };
 
-/* Sends all messages in the queue ready to be dispatched, leaving those that
- * would block to be handled next pass */
-static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
+static void csmsg_reserve(cs_msg_t *csmsg, const int len)
+{
+	if (csmsg->ofs + csmsg->len + len < csmsg->size)
+		return;
+	if (csmsg->ofs) {
+		memmove(csmsg->buf, csmsg->buf + csmsg->ofs, csmsg->len);
+		csmsg->ofs = 0;
+		if (csmsg->len + len < csmsg->size)
+			return;
+	}
+	csmsg->size = MAX(csmsg->size * 2, csmsg->len + len + 4096);
+	csmsg->buf = realloc(csmsg->buf, csmsg->size);
+	if (unlikely(!csmsg->buf))
+		quit(1, "Failed to realloc csmsg buf size %d", csmsg->size);
+}
+
+static void csmsg_add(cs_msg_t *csmsg, const char *buf, const int len)
+{
+	csmsg_reserve(csmsg, len);
+	memcpy(csmsg->buf + csmsg->ofs + csmsg->len, buf, len);
+	csmsg->len += len;
+}
+
+/* Returns str as a heap allocated json string */
+static char *json_str_dumps(const char *str)
+{
+	json_t *val = json_string(str);
+	char *buf = NULL;
+
+	if (likely(val)) {
+		buf = json_dumps(val, JSON_ENCODE_ANY | JSON_ESCAPE_SLASH);
+		json_decref(val);
+	}
+	return buf ? buf : strdup("\"\"");
+}
+
+/* Add str as a json string, only going through jansson if it needs escaping */
+static void csmsg_addstr(cs_msg_t *csmsg, const char *str)
+{
+	const char *c;
+	char *buf;
+
+	for (c = str; *c; c++) {
+		if (*c == '"' || *c == '\\' || *c == '/' || (unsigned char)*c < 0x20)
+			break;
+	}
+	if (likely(!*c)) {
+		csmsg_add(csmsg, "\"", 1);
+		csmsg_add(csmsg, str, c - str);
+		csmsg_add(csmsg, "\"", 1);
+		return;
+	}
+	buf = json_str_dumps(str);
+	csmsg_add(csmsg, buf, strlen(buf));
+	free(buf);
+}
+
+/* Find the output buffer for a subproxy, discarding anything buffered for a
+ * previous connection of it */
+static cs_msg_t *subproxy_csmsg(cs_msg_t **csmsgs, proxy_instance_t *subproxy)
+{
+	cs_msg_t *csmsg;
+
+	HASH_FIND_PTR(*csmsgs, &subproxy, csmsg);
+	if (!csmsg) {
+		csmsg = ckzalloc(sizeof(cs_msg_t));
+		csmsg->proxy = subproxy;
+		csmsg->fd = -1;
+		HASH_ADD_PTR(*csmsgs, proxy, csmsg);
+	}
+	if (csmsg->fd != subproxy->cs.fd || !csmsg->prefix) {
+		char *auth = json_str_dumps(subproxy->auth ? subproxy->auth : "");
+
+		csmsg->fd = subproxy->cs.fd;
+		csmsg->len = csmsg->ofs = 0;
+		free(csmsg->prefix);
+		ASPRINTF(&csmsg->prefix, "{\"params\": [%s, ", auth);
+		csmsg->prefixlen = strlen(csmsg->prefix);
+		free(auth);
+	}
+	return csmsg;
+}
+
+static void free_csmsg(cs_msg_t **csmsgs, cs_msg_t *csmsg)
+{
+	HASH_DEL(*csmsgs, csmsg);
+	free(csmsg->prefix);
+	free(csmsg->buf);
+	free(csmsg);
+}
+
+/* Flush each subproxy's output buffer with a single send, leaving whatever
+ * would block to be sent next pass */
+static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgs)
 {
 	cs_msg_t *csmsg, *tmp;
 	int ret;
 
-	DL_FOREACH_SAFE(*csmsgq, csmsg, tmp) {
+	HASH_ITER(hh, *csmsgs, csmsg, tmp) {
 		proxy_instance_t *proxy = csmsg->proxy;
 
-		/* Only try to send one message at a time to each proxy
-		 * to avoid sending parts of different messages */
-		if (proxy->sending  && proxy->sending != csmsg)
-			continue;
-		while (csmsg->len > 0) {
-			int fd;
-
-			if (unlikely(!proxy->alive)) {
+		if (unlikely(!proxy->alive || proxy->cs.fd != csmsg->fd)) {
+			if (csmsg->len) {
 				LOGDEBUG("Dropping send message to dead proxy %d:%d in send_json_msgq",
 					 proxy->id, proxy->subid);
-				csmsg->len = 0;
-				break;
 			}
-			proxy->sending = csmsg;
-			fd = proxy->cs.fd;
-			ret = send(fd, csmsg->buf + csmsg->ofs, csmsg->len, MSG_DONTWAIT);
-			if (ret < 1) {
-				if (!ret)
-					break;
-				ret = 0;
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
-				csmsg->len = 0;
-				LOGNOTICE("Proxy %d:%d %s failed to send msg in send_json_msgq, dropping",
-					  proxy->id, proxy->subid, proxy->url);
-				disable_subproxy(gdata, proxy->parent, proxy);
-			}
-			csmsg->ofs += ret;
-			csmsg->len -= ret;
+			free_csmsg(csmsgs, csmsg);
+			continue;
 		}
-		if (csmsg->len < 1) {
-			proxy->sending = NULL;
-			DL_DELETE(*csmsgq, csmsg);
-			free(csmsg->buf);
-			free(csmsg);
+		if (!csmsg->len)
+			continue;
+		ret = send(csmsg->fd, csmsg->buf + csmsg->ofs, csmsg->len, MSG_DONTWAIT);
+		if (ret < 1) {
+			if (!ret || errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			LOGNOTICE("Proxy %d:%d %s failed to send msg in send_json_msgq, dropping",
+				  proxy->id, proxy->subid, proxy->url);
+			disable_subproxy(gdata, proxy->parent, proxy);
+			free_csmsg(csmsgs, csmsg);
+			continue;
 		}
+		csmsg->ofs += ret;
+		csmsg->len -= ret;
+		if (!csmsg->len)
+			csmsg->ofs = 0;
 	}
 }
 
-static void add_json_msgq(cs_msg_t **csmsgq, proxy_instance_t *proxy, json_t **val)
-{
-	cs_msg_t *csmsg = ckzalloc(sizeof(cs_msg_t));
-
-	csmsg->buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
-	json_decref(*val);
-	*val = NULL;
-	if (unlikely(!csmsg->buf)) {
-		LOGWARNING("Failed to create json dump in add_json_msgq");
-		return;
-	}
-	csmsg->len = strlen(csmsg->buf);
-	csmsg->proxy = proxy;
-	DL_APPEND(*csmsgq, csmsg);
-}
-
-/* For processing and sending shares. proxy refers to parent proxy here */
+/* For processing and sending shares. proxy refers to parent proxy here. All
+ * queued shares are serialised into their subproxy's output buffer with a
+ * preformatted mining.submit and each buffer is flushed once per wakeup. */
 static void *proxy_send(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	stratum_msg_t *msg = NULL;
-	cs_msg_t *csmsgq = NULL;
+	stratum_msg_t *msgs, *msg, *tmp;
+	cs_msg_t *csmsgs = NULL;
 
 	rename_proc("proxysend");
 
 	pthread_detach(pthread_self());
 
 	while (42) {
-		proxy_instance_t *proxy, *subproxy;
-		int proxyid = 0, subid = 0;
-		int64_t client_id = 0, id;
-		notify_instance_t *ni;
-		json_t *jobid = NULL;
-		json_t *val;
-
-		if (unlikely(msg)) {
-			json_decref(msg->json_msg);
-			free(msg);
-		}
-
 		mutex_lock(&gdata->psend_lock);
 		if (!gdata->psends) {
 			/* Poll every 10ms */
@@ -1948,66 +2462,86 @@ static void *proxy_send(void *arg)
 			timeraddspec(&timeout_ts, &polltime);
 			cond_timedwait(&gdata->psend_cond, &gdata->psend_lock, &timeout_ts);
 		}
-		msg = gdata->psends;
-		if (likely(msg))
-			DL_DELETE(gdata->psends, msg);
+		msgs = gdata->psends;
+		gdata->psends = NULL;
 		mutex_unlock(&gdata->psend_lock);
 
-		if (!msg) {
-			send_json_msgq(gdata, &csmsgq);
-			continue;
-		}
-
-		if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
-			LOGWARNING("Failed to find subproxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
-			LOGWARNING("Failed to find jobid in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
-			LOGWARNING("Failed to find proxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
-			LOGWARNING("Failed to find client_id in proxy_send msg");
-			continue;
-		}
-		proxy = proxy_by_id(gdata, proxyid);
-		if (unlikely(!proxy)) {
-			LOGWARNING("Proxysend for got message for non-existent proxy %d",
-				   proxyid);
-			continue;
-		}
-		subproxy = subproxy_by_id(proxy, subid);
-		if (unlikely(!subproxy)) {
-			LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
-				   proxyid, subid);
-			continue;
-		}
-
-		mutex_lock(&gdata->notify_lock);
-		HASH_FIND_INT(gdata->notify_instances, &id, ni);
-		if (ni)
-			jobid = json_copy(ni->jobid);
-		mutex_unlock(&gdata->notify_lock);
-
-		if (unlikely(!jobid)) {
-			stratifier_reconnect_client(ckp, client_id);
-			LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
-				  subproxy->id, subproxy->url);
-			continue;
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			const char *nonce2, *ntime, *nonce;
+			proxy_instance_t *proxy, *subproxy;
+			int proxyid = 0, subid = 0;
+			int64_t client_id = 0, id, shareid = 0;
+			notify_instance_t *ni;
+			cs_msg_t *csmsg;
+			char idbuf[64];
+
+			DL_DELETE(msgs, msg);
+			if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
+				LOGWARNING("Failed to find subproxy in proxy_send msg");
+				goto next;
+			}
+			if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
+				LOGWARNING("Failed to find jobid in proxy_send msg");
+				goto next;
+			}
+			if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
+				LOGWARNING("Failed to find proxy in proxy_send msg");
+				goto next;
+			}
+			if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
+				LOGWARNING("Failed to find client_id in proxy_send msg");
+				goto next;
+			}
+			nonce2 = json_string_value(json_object_get(msg->json_msg, "nonce2"));
+			ntime = json_string_value(json_object_get(msg->json_msg, "ntime"));
+			nonce = json_string_value(json_object_get(msg->json_msg, "nonce"));
+			if (unlikely(!nonce2 || !ntime || !nonce)) {
+				LOGWARNING("Failed to find nonce2/ntime/nonce in proxy_send msg");
+				goto next;
+			}
+			json_get_int64(&shareid, msg->json_msg, "id");
+			proxy = proxy_by_id(gdata, proxyid);
+			if (unlikely(!proxy)) {
+				LOGWARNING("Proxysend for got message for non-existent proxy %d",
+					   proxyid);
+				goto next;
+			}
+			subproxy = subproxy_by_id(proxy, subid);
+			if (unlikely(!subproxy)) {
+				LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
+					   proxyid, subid);
+				goto next;
+			}
+			csmsg = subproxy_csmsg(&csmsgs, subproxy);
+
+			mutex_lock(&gdata->notify_lock);
+			HASH_FIND_I64(gdata->notify_instances, &id, ni);
+			if (likely(ni && ni->jobidjson)) {
+				csmsg_add(csmsg, csmsg->prefix, csmsg->prefixlen);
+				csmsg_add(csmsg, ni->jobidjson, strlen(ni->jobidjson));
+			} else
+				ni = NULL;
+			mutex_unlock(&gdata->notify_lock);
+
+			if (unlikely(!ni)) {
+				stratifier_reconnect_client(ckp, client_id);
+				LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
+					  subproxy->id, subproxy->url);
+				goto next;
+			}
+			csmsg_add(csmsg, ", ", 2);
+			csmsg_addstr(csmsg, nonce2);
+			csmsg_add(csmsg, ", ", 2);
+			csmsg_addstr(csmsg, ntime);
+			csmsg_add(csmsg, ", ", 2);
+			csmsg_addstr(csmsg, nonce);
+			csmsg_add(csmsg, idbuf, snprintf(idbuf, 64, "], \"id\": %"PRId64", ", shareid));
+			csmsg_add(csmsg, submit_suffix, sizeof(submit_suffix) - 1);
+next:
+			json_decref(msg->json_msg);
+			free(msg);
 		}
-
-		JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
-				json_object_dup(msg->json_msg, "nonce2"),
-				json_object_dup(msg->json_msg, "ntime"),
-				json_object_dup(msg->json_msg, "nonce"),
-				"id", json_object_dup(msg->json_msg, "id"),
-				"method", "mining.submit");
-		add_json_msgq(&csmsgq, subproxy, &val);
-		send_json_msgq(gdata, &csmsgq);
+		send_json_msgq(gdata, &csmsgs);
 	}
 	return NULL;
 }
@@ -2016,18 +2550,25 @@ static void passthrough_send(ckpool_t *ckp, pass_msg_t *pm)
 {
 	proxy_instance_t *proxy = pm->proxy;
 	connsock_t *cs = pm->cs;
-	int len, sent;
+	int sent;
 
 	if (unlikely(!proxy->alive || cs->fd < 0)) {
-		LOGDEBUG("Dropping send to dead proxy of upstream json msg: %s", pm->msg);
+		LOGDEBUG("Dropping %d byte send to dead passthrough proxy", pm->len);
 		goto out;
 	}
-	LOGDEBUG("Sending upstream json msg: %s", pm->msg);
-	len = strlen(pm->msg);
-	sent = write_socket(cs->fd, pm->msg, len);
-	if (unlikely(sent != len)) {
-		LOGWARNING("Failed to passthrough %d bytes of message %s, attempting reconnect",
-			   len, pm->msg);
+	/* Queued before reconnecting to an upstream that negotiated
+	 * differently */
+	if (unlikely(pm->framed != proxy->framed)) {
+		LOGDEBUG("Dropping %d byte send queued for %s passthrough", pm->len,
+			 pm->framed ? "framed" : "json");
+		goto out;
+	}
+	if (!pm->framed)
+		LOGDEBUG("Sending upstream json msg: %s", pm->msg);
+	sent = write_socket(cs->fd, pm->msg, pm->len);
+	if (unlikely(sent != pm->len)) {
+		LOGWARNING("Failed to passthrough %d bytes of message, attempting reconnect",
+			   pm->len);
 		Close(cs->fd);
 		proxy->alive = false;
 		reconnect_generator(ckp);
@@ -2037,13 +2578,15 @@ out:
 	free(pm);
 }
 
-static void passthrough_add_send(proxy_instance_t *proxy, char *msg)
+static void passthrough_add_send(proxy_instance_t *proxy, char *msg, const int len, const bool framed)
 {
 	pass_msg_t *pm = ckzalloc(sizeof(pass_msg_t));
 
 	pm->proxy = proxy;
 	pm->cs = &proxy->cs;
 	pm->msg = msg;
+	pm->len = len;
+	pm->framed = framed;
 	ckmsgq_add(proxy->passsends, pm);
 }
 
@@ -2065,11 +2608,61 @@ void generator_add_send(ckpool_t *ckp, json_t *val)
 		LOGWARNING("Unable to decode json in generator_add_send");
 		goto out;
 	}
-	passthrough_add_send(gdata->current_proxy, buf);
+	passthrough_add_send(gdata->current_proxy, buf, strlen(buf), false);
 out:
 	json_decref(val);
 }
 
+/* Forward a client's line upstream in passthrough mode. Upstream pools that
+ * accept framed messages get the line as is behind a pass_frame_t header,
+ * otherwise it is decoded and tagged with the client's details in json.
+ * Returns false only if the line is not valid json for a json upstream. */
+bool generator_add_line(ckpool_t *ckp, const int64_t client_id, const int server,
+			const char *address, const char *buf, const int len)
+{
+	gdata_t *gdata = ckp->gdata;
+	proxy_instance_t *proxy = gdata->current_proxy;
+	pass_frame_t frame;
+	int addrlen, msglen;
+	json_t *val;
+	char *msg;
+
+	if (unlikely(!proxy)) {
+		LOGWARNING("No current proxy to send passthrough data to");
+		return true;
+	}
+	if (proxy->framed) {
+		addrlen = strlen(address);
+		msglen = sizeof(frame) + addrlen + len;
+		frame.len = htole32(addrlen + len);
+		frame.client_id = htole32(client_id);
+		frame.type = PASS_LINE;
+		frame.addrlen = addrlen;
+		frame.pad = 0;
+		msg = ckalloc(msglen);
+		memcpy(msg, &frame, sizeof(frame));
+		memcpy(msg + sizeof(frame), address, addrlen);
+		memcpy(msg + sizeof(frame) + addrlen, buf, len);
+		passthrough_add_send(proxy, msg, msglen, true);
+		return true;
+	}
+
+	val = json_loadb(buf, len, JSON_DISABLE_EOF_CHECK, NULL);
+	if (!val)
+		return false;
+	json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
+	json_object_set_new_nocheck(val, "address", json_string(address));
+	json_object_set_new_nocheck(val, "server", json_integer(server));
+	msg = json_dumps(val, JSON_COMPACT | JSON_EOL);
+	json_decref(val);
+	if (unlikely(!msg)) {
+		LOGWARNING("Unable to decode json in generator_add_line");
+		return true;
+	}
+	passthrough_add_send(proxy, msg, strlen(msg), false);
+	return true;
+}
+
 static void suggest_diff(ckpool_t *ckp, connsock_t *cs, proxy_instance_t *proxy)
 {
 	json_t *req;
@@ -2245,7 +2838,7 @@ retry:
 	return NULL;
 }
 
-static void recruit_subproxies(proxy_instance_t *proxi, const int recruits)
+static void recruit_subproxies(proxy_instance_t *proxi, const int64_t recruits)
 {
 	bool recruit = false;
 	pthread_t pth;
@@ -2333,16 +2926,23 @@ static void *passthrough_recv(void *arg)
 		}
 
 		cksem_wait(&cs->sem);
-		ret = read_socket_line(cs, &timeout);
+		if (proxi->framed)
+			ret = read_socket_frame(cs, &timeout);
+		else
+			ret = read_socket_line(cs, &timeout);
 		/* Simply forward the message on, as is, to the connector to
 		 * process. Possibly parse parameters sent by upstream pool
 		 * here */
 		if (likely(ret > 0)) {
-			LOGDEBUG("Passthrough recv received upstream msg: %s", cs->buf);
-			send_proc(ckp->connector, cs->buf);
+			if (proxi->framed)
+				connector_pass_frame(ckp, cs->buf, ret);
+			else {
+				LOGDEBUG("Passthrough recv received upstream msg: %s", cs->buf);
+				send_proc(ckp->connector, cs->buf);
+			}
 		} else if (ret < 0) {
 			/* Read failure */
-			LOGWARNING("Passthrough %d:%s failed to read_socket_line in passthrough_recv, attempting reconnect",
+			LOGWARNING("Passthrough %d:%s failed to read from upstream in passthrough_recv, attempting reconnect",
 				   proxi->id, proxi->url);
 			alive = proxi->alive = false;
 			Close(cs->fd);
@@ -2371,6 +2971,81 @@ static bool subproxies_alive(proxy_instance_t *proxy)
 	return ret;
 }
 
+/* Drop the subproxies of a proxy that is neither current nor on standby any
+ * more, and stop any recruiting for it. */
+static void release_standby(gdata_t *gdata, proxy_instance_t *proxi)
+{
+	proxy_instance_t *subproxy, *tmp;
+	int released = 0;
+
+	while (42) {
+		mutex_lock(&proxi->proxy_lock);
+		proxi->recruit = 0;
+		HASH_ITER(sh, proxi->subproxies, subproxy, tmp) {
+			if (subproxy != proxi)
+				break;
+		}
+		mutex_unlock(&proxi->proxy_lock);
+
+		if (!subproxy)
+			break;
+		disable_subproxy(gdata, proxi, subproxy);
+		released++;
+	}
+	if (released)
+		LOGNOTICE("Released %d spare subproxies of former standby proxy %d", released, proxi->id);
+}
+
+/* Keep proxystandby subproxies of the next priority global proxy after the
+ * current one connected, subscribed and authorised. Only called from the
+ * proxy_loop thread so standby_proxy needs no lock. Its parent connection is
+ * always kept up with its latest notify in the stratifier, so when the current
+ * proxy dies clients can be moved straight onto these spare slots instead of
+ * waiting for new subproxies to be recruited. The spares of a proxy that is no
+ * longer current or on standby are released. */
+static void standby_subproxies(ckpool_t *ckp, gdata_t *gdata)
+{
+	proxy_instance_t *current = gdata->current_proxy, *proxy, *tmp;
+	proxy_instance_t *standby = NULL, *old;
+	int spares = 0;
+
+	if (!ckp->proxystandby || !current)
+		return;
+
+	mutex_lock(&gdata->lock);
+	HASH_ITER(hh, gdata->proxies, proxy, tmp) {
+		if (proxy == current || proxy->disabled || !proxy->global || !proxy->alive)
+			continue;
+		if (!standby || proxy->id < standby->id)
+			standby = proxy;
+	}
+	mutex_unlock(&gdata->lock);
+
+	old = gdata->standby_proxy;
+	gdata->standby_proxy = standby;
+	if (old && old != standby && old != current)
+		release_standby(gdata, old);
+	if (!standby)
+		return;
+
+	mutex_lock(&standby->proxy_lock);
+	HASH_ITER(sh, standby->subproxies, proxy, tmp) {
+		if (proxy != standby && proxy->alive)
+			spares++;
+	}
+	/* Wait for any recruiting in progress to finish */
+	if (standby->recruit)
+		spares = ckp->proxystandby;
+	mutex_unlock(&standby->proxy_lock);
+
+	if (spares < ckp->proxystandby) {
+		LOGINFO("Recruiting %d standby subproxies of proxy %d", ckp->proxystandby - spares,
+			standby->id);
+		/* Recruiting is counted in clients */
+		recruit_subproxies(standby, (ckp->proxystandby - spares) * standby->clients_per_proxy);
+	}
+}
+
 /* For receiving messages from the upstream proxy, also responsible for setting
  * up the connection and testing it's alive. */
 static void *proxy_recv(void *arg)
@@ -2393,14 +3068,17 @@ static void *proxy_recv(void *arg)
 		return NULL;
 	}
 
-	if (proxy_alive(ckp, proxi, cs, false))
+	if (proxy_alive(ckp, proxi, cs, false)) {
 		LOGWARNING("Proxy %d:%s connection established", proxi->id, proxi->url);
+		/* Have the generator reexamine which proxy is on standby */
+		if (ckp->proxystandby)
+			reconnect_generator(ckp);
+	}
 
 	alive = proxi->alive;
 
 	while (42) {
 		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
 		notify_instance_t *ni, *tmp;
 		float timeout;
 		time_t now;
@@ -2441,14 +3119,7 @@ static void *proxy_recv(void *arg)
 		mutex_unlock(&gdata->notify_lock);
 
 		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
+		age_shares(gdata);
 
 		cs = NULL;
 		/* If we don't get an update within 10 minutes the upstream pool
@@ -2541,7 +3212,6 @@ static void *userproxy_recv(void *arg)
 	while (42) {
 		proxy_instance_t *proxy, *tmpproxy;
 		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
 		notify_instance_t *ni, *tmp;
 		connsock_t *cs;
 		float timeout;
@@ -2584,14 +3254,7 @@ static void *userproxy_recv(void *arg)
 		mutex_unlock(&gdata->notify_lock);
 
 		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
+		age_shares(gdata);
 
 		cs = &proxy->cs;
 
@@ -3215,6 +3878,7 @@ static void proxy_loop(proc_instance_t *pi)
 	ckpool_t *ckp = pi->ckp;
 	gdata_t *gdata = ckp->gdata;
 	unix_msg_t *umsg = NULL;
+	time_t standby_time = 0;
 	connsock_t *cs = NULL;
 	char *buf = NULL;
 
@@ -3243,6 +3907,10 @@ reconnect:
 		LOGWARNING("Successfully connected to pool %d %s as proxy%s",
 			   proxi->id, proxi->url, ckp->passthrough ? " in passthrough mode" : "");
 	}
+	if (!ckp->passthrough) {
+		standby_subproxies(ckp, gdata);
+		standby_time = time(NULL);
+	}
 
 	if (unlikely(!ckp->generator_ready)) {
 		ckp->generator_ready = true;
@@ -3251,6 +3919,12 @@ reconnect:
 retry:
 	clear_unix_msg(&umsg);
 	do {
+		/* Standby spares are only ever looked after from this thread,
+		 * like any other dropping of subproxies asked of the generator */
+		if (!ckp->passthrough && time(NULL) - standby_time >= 5) {
+			standby_subproxies(ckp, gdata);
+			standby_time = time(NULL);
+		}
 		umsg = get_unix_msg(pi);
 	} while (!umsg);
 
@@ -3283,7 +3957,7 @@ retry:
 		bool ret;
 
 		LOGNOTICE("Submitting likely block solve share from upstream pool");
-		ret = submit_block(cs, buf + 12 + 64 + 1);
+		ret = submit_block(&si->submitcs, buf + 12 + 64 + 1, NULL, NULL);
 		memset(buf + 12 + 64, 0, 1);
 		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
 		send_proc(ckp->stratifier, blockmsg);
@@ -3310,31 +3984,149 @@ out:
 	return;
 }
 
-/* Check which servers are alive, maintaining a connection with them and
- * reconnect if a higher priority one is available. */
+/* Seconds to wait for a health probe answer */
+#define PROBE_TIMEOUT 5
+
+/* Blocks a server can be behind the others before it is considered lagging
+ * since a new block takes a moment to reach them all */
+#define PROBE_LAG 1
+
+/* Cheap health check of a server on its own persistent connection without
+ * fetching a block template, run concurrently for all servers */
+static void probe_server(server_instance_t *si)
+{
+	connsock_t *cs = &si->probecs;
+	bool ret, syncing = false;
+	tv_t start_tv, end_tv;
+	int height = 0;
+
+	if (!cs->url) {
+		cksem_wait(&cs->sem);
+		ret = server_connsock(si, cs);
+		cksem_post(&cs->sem);
+		if (!ret) {
+			si->healthy = si->syncing = false;
+			return;
+		}
+	}
+	tv_time(&start_tv);
+	ret = get_chaininfo(cs, &height, &syncing);
+	tv_time(&end_tv);
+	if (!ret) {
+		if (si->healthy || si->syncing)
+			LOGWARNING("Server %s:%s failed health check", cs->url, cs->port);
+		si->healthy = si->syncing = false;
+		/* Resolve the url again for the next probe */
+		dealloc(cs->url);
+		dealloc(cs->port);
+		return;
+	}
+	if (syncing && !si->syncing) {
+		LOGNOTICE("Server %s:%s is syncing at height %d", cs->url, cs->port, height);
+	} else if (!syncing && !si->healthy) {
+		LOGNOTICE("Server %s:%s healthy at height %d in %.1fms", cs->url, cs->port,
+			  height, tvdiff(&end_tv, &start_tv) * 1000);
+	}
+	si->height = height;
+	si->syncing = syncing;
+	si->healthy = !syncing;
+
+	/* Solved blocks can be sent to healthy servers even before they are
+	 * promoted */
+	if (unlikely(!si->submitcs.url)) {
+		cksem_wait(&si->submitcs.sem);
+		if (!si->submitcs.url)
+			server_connsock(si, &si->submitcs);
+		cksem_post(&si->submitcs.sem);
+	}
+}
+
+/* Each server has a prober thread for the life of the watchdog, rather than
+ * one per probe, that probes whenever the watchdog starts a round */
+struct server_prober {
+	server_instance_t *si;
+	sem_t start;
+	sem_t *done;
+};
+
+static void *server_prober(void *arg)
+{
+	struct server_prober *prober = arg;
+
+	rename_proc("sprober");
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		cksem_wait(&prober->start);
+		probe_server(prober->si);
+		cksem_post(prober->done);
+	}
+	return NULL;
+}
+
+/* Probe all servers at once and promote a higher priority healthy one, or a
+ * healthy one if the current server is lagging behind. Only a server being
+ * promoted gets the full check with server_alive. */
 static void *server_watchdog(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
+	struct server_prober *probers;
+	sem_t done;
+	int i;
 
 	rename_proc("swatchdog");
 
 	pthread_detach(pthread_self());
 
+	cksem_init(&done);
+	probers = ckzalloc(sizeof(struct server_prober) * ckp->btcds);
+	for (i = 0; i < ckp->btcds; i++) {
+		pthread_t pth;
+
+		probers[i].si = ckp->servers[i];
+		probers[i].done = &done;
+		cksem_init(&probers[i].start);
+		create_pthread(&pth, server_prober, &probers[i]);
+	}
 	while (42) {
-		server_instance_t *best = NULL;
+		server_instance_t *best = NULL, *current = gdata->current_si;
+		int height = 0;
 		ts_t timer_t;
-		int i;
 
 		cksleep_prepare_r(&timer_t);
+		for (i = 0; i < ckp->btcds; i++)
+			cksem_post(&probers[i].start);
+		for (i = 0; i < ckp->btcds; i++)
+			cksem_wait(&done);
+		for (i = 0; i < ckp->btcds; i++) {
+			server_instance_t *si = ckp->servers[i];
+
+			if (si->healthy && si->height > height)
+				height = si->height;
+		}
 		for (i = 0; i < ckp->btcds; i++) {
-			server_instance_t *si  = ckp->servers[i];
+			server_instance_t *si = ckp->servers[i];
+
+			if (si->syncing)
+				si->lagging = true;
+			else if (si->healthy) {
+				bool lagging = si->height + PROBE_LAG < height;
 
-			/* Have we reached the current server? */
-			if (server_alive(ckp, si, true) && !best)
+				if (lagging && !si->lagging) {
+					LOGWARNING("Server %s:%s lagging at height %d behind %d",
+						   si->probecs.url, si->probecs.port, si->height, height);
+				}
+				si->lagging = lagging;
+			}
+			/* A missed probe alone doesn't fail over from current */
+			if (best || si->lagging)
+				continue;
+			if (si->healthy || si == current)
 				best = si;
 		}
-		if (best && best != gdata->current_si)
+		if (best && best != current && server_alive(ckp, best, true))
 			send_proc(ckp->generator, "reconnect");
 		cksleep_ms_r(&timer_t, 5000);
 	}
@@ -3343,9 +4135,12 @@ static void *server_watchdog(void *arg)
 
 static void setup_servers(ckpool_t *ckp)
 {
+	gdata_t *gdata = ckp->gdata;
 	pthread_t pth_watchdog;
 	int i;
 
+	if (ckp->gbtlight && !gbtlight_usable(ckp))
+		LOGWARNING("Not using getblocktemplatelight since remote nodes need transactions");
 	ckp->servers = ckalloc(sizeof(server_instance_t *) * ckp->btcds);
 	for (i = 0; i < ckp->btcds; i++) {
 		server_instance_t *si;
@@ -3360,11 +4155,32 @@ static void setup_servers(ckpool_t *ckp)
 		si->id = i;
 		cs = &si->cs;
 		cs->ckp = ckp;
+		cs->fd = -1;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		cs = &si->submitcs;
+		cs->ckp = ckp;
+		cs->fd = -1;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		cs = &si->lpcs;
+		cs->ckp = ckp;
+		cs->fd = -1;
+		cs->timeout = LONGPOLL_TIMEOUT;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		cs = &si->probecs;
+		cs->ckp = ckp;
+		cs->fd = -1;
+		cs->timeout = PROBE_TIMEOUT;
 		cksem_init(&cs->sem);
 		cksem_post(&cs->sem);
 	}
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
+	mutex_init(&gdata->lp_lock);
+	if (ckp->longpoll)
+		create_pthread(&gdata->pth_longpoll, longpoller, ckp);
 }
 
 static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
@@ -17,14 +17,20 @@
 #define GETBEST_SUCCESS 1
 
 void generator_add_send(ckpool_t *ckp, json_t *val);
+bool generator_add_line(ckpool_t *ckp, const int64_t client_id, const int server,
+			const char *address, const char *buf, const int len);
 struct genwork *generator_getbase(ckpool_t *ckp);
+struct genwork *generator_getlongpoll(ckpool_t *ckp);
+bool generator_longpolling(ckpool_t *ckp);
 int generator_getbest(ckpool_t *ckp, char *hash);
 bool generator_checkaddr(ckpool_t *ckp, const char *addr, bool *script, bool *segwit);
 bool generator_checktxn(const ckpool_t *ckp, const char *txn, json_t **val);
 char *generator_get_txn(ckpool_t *ckp, const char *hash);
-bool generator_submitblock(ckpool_t *ckp, const char *buf);
+bool generator_submitblock(ckpool_t *ckp, const char *buf, const char *txns, const char *job_id,
+			   const int job_server);
 void generator_preciousblock(ckpool_t *ckp, const char *hash);
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash);
+bool generator_get_nexthead(ckpool_t *ckp, const char *hash, struct genwork *wb);
 void *generator(void *arg);
 
 #endif /* GENERATOR_H */
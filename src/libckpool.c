@@ -116,14 +116,224 @@ bool ck_completion_timeout(void *fn, void *fnarg, int timeout)
 	return !ret;
 }
 
+/* Optional lock contention profiler. When enabled every lock site records
+ * how often it was taken, how often it had to wait, and the time spent
+ * waiting and (for exclusive locks) held, in a table private to each thread so
+ * recording needs no locking. The tables are summed when stats are asked for. */
+#define LOCKPROF_SITES 512
+
+enum lock_type {
+	LP_MUTEX,
+	LP_WRITE,
+	LP_READ
+};
+
+static const char *lock_types[] = {
+	"mutex",
+	"write",
+	"read"
+};
+
+struct lock_site {
+	const char *file;
+	const char *func;
+	int line;
+	int type;
+	int64_t locks;
+	int64_t contended;
+	int64_t wait; /* ns */
+	int64_t maxwait;
+	int64_t hold;
+};
+
+typedef struct lock_site lock_site_t;
+
+struct lock_profile {
+	struct lock_profile *next;
+	int generation; /* Of the stats in sites */
+	lock_site_t sites[LOCKPROF_SITES];
+};
+
+typedef struct lock_profile lock_profile_t;
+
+static bool lock_profiling;
+/* Bumped on each enable so every thread clears its own stale table */
+static int lock_generation;
+static __thread lock_profile_t *thread_profile;
+static lock_profile_t *lock_profiles;
+/* Plain pthread mutex since our own mutexes are the ones being profiled */
+static pthread_mutex_t lock_profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int64_t mono_ns(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static lock_site_t *lock_site(const char *file, const char *func, const int line, const int type)
+{
+	lock_profile_t *profile = thread_profile;
+	int i, slot, generation;
+
+	if (unlikely(!profile)) {
+		profile = thread_profile = calloc(1, sizeof(lock_profile_t));
+		if (unlikely(!profile))
+			return NULL;
+		pthread_mutex_lock(&lock_profiles_lock);
+		profile->next = lock_profiles;
+		lock_profiles = profile;
+		pthread_mutex_unlock(&lock_profiles_lock);
+	}
+	/* Only the owning thread writes its table so it is reset here rather
+	 * than by whoever enabled the profiler */
+	generation = __atomic_load_n(&lock_generation, __ATOMIC_ACQUIRE);
+	if (unlikely(profile->generation != generation)) {
+		memset(profile->sites, 0, sizeof(profile->sites));
+		__atomic_store_n(&profile->generation, generation, __ATOMIC_RELEASE);
+	}
+	slot = (((uintptr_t)func >> 3) ^ (line * 31) ^ type) & (LOCKPROF_SITES - 1);
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		lock_site_t *site = &profile->sites[slot];
+
+		if (site->func == func && site->line == line && site->type == type)
+			return site;
+		if (!site->func) {
+			site->file = file;
+			site->func = func;
+			site->line = line;
+			site->type = type;
+			return site;
+		}
+		slot = (slot + 1) & (LOCKPROF_SITES - 1);
+	}
+	/* Table full, drop this site */
+	return NULL;
+}
+
+static void profile_wait(const char *file, const char *func, const int line, const int type,
+			 const int64_t wait)
+{
+	lock_site_t *site = lock_site(file, func, line, type);
+
+	if (unlikely(!site))
+		return;
+	site->locks++;
+	if (wait) {
+		site->contended++;
+		site->wait += wait;
+		if (wait > site->maxwait)
+			site->maxwait = wait;
+	}
+}
+
+/* Attribute the hold time of an exclusive lock to the site that took it */
+static void profile_hold(const char *file, const char *func, const int line, const int type,
+			 int64_t *acquired)
+{
+	lock_site_t *site = lock_site(file, func, line, type);
+
+	if (likely(site))
+		site->hold += mono_ns() - *acquired;
+	*acquired = 0;
+}
+
+/* Enabling the profiler discards any previously collected stats. Each thread
+ * clears its own table the next time it takes a lock. */
+void lock_profile_enable(const bool enable)
+{
+	if (enable)
+		__atomic_add_fetch(&lock_generation, 1, __ATOMIC_RELEASE);
+	lock_profiling = enable;
+}
+
+static int site_wait_cmp(const void *a, const void *b)
+{
+	const lock_site_t *sa = a, *sb = b;
+
+	if (sa->wait == sb->wait)
+		return 0;
+	return sa->wait < sb->wait ? 1 : -1;
+}
+
+/* Return a heap allocated json string of the top lock sites sorted by total
+ * time spent waiting, combining the tables of all threads. */
+char *lock_profile_stats(int top)
+{
+	lock_site_t *sites = ckzalloc(sizeof(lock_site_t) * LOCKPROF_SITES);
+	json_t *val = json_object(), *arr = json_array();
+	int i, j, nsites = 0, generation;
+	lock_profile_t *profile;
+	char *buf;
+
+	generation = __atomic_load_n(&lock_generation, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&lock_profiles_lock);
+	for (profile = lock_profiles; profile; profile = profile->next) {
+		/* Skip tables of threads that haven't cleared them since the
+		 * profiler was last enabled */
+		if (__atomic_load_n(&profile->generation, __ATOMIC_ACQUIRE) != generation)
+			continue;
+		for (i = 0; i < LOCKPROF_SITES; i++) {
+			const lock_site_t *site = &profile->sites[i];
+
+			if (!site->func)
+				continue;
+			for (j = 0; j < nsites; j++) {
+				if (sites[j].func == site->func && sites[j].line == site->line &&
+				    sites[j].type == site->type)
+					break;
+			}
+			if (j == nsites) {
+				if (unlikely(nsites >= LOCKPROF_SITES))
+					continue;
+				memcpy(&sites[nsites++], site, sizeof(lock_site_t));
+				continue;
+			}
+			sites[j].locks += site->locks;
+			sites[j].contended += site->contended;
+			sites[j].wait += site->wait;
+			sites[j].hold += site->hold;
+			if (site->maxwait > sites[j].maxwait)
+				sites[j].maxwait = site->maxwait;
+		}
+	}
+	pthread_mutex_unlock(&lock_profiles_lock);
+
+	qsort(sites, nsites, sizeof(lock_site_t), site_wait_cmp);
+	if (top < 1 || top > nsites)
+		top = nsites;
+	for (i = 0; i < top; i++) {
+		lock_site_t *site = &sites[i];
+		json_t *subval;
+
+		JSON_CPACK(subval, "{ss,ss,si,ss,sI,sI,sI,sI,sI}",
+			   "file", site->file, "func", site->func, "line", site->line,
+			   "type", lock_types[site->type], "locks", site->locks,
+			   "contended", site->contended, "wait_us", site->wait / 1000,
+			   "maxwait_us", site->maxwait / 1000, "hold_us", site->hold / 1000);
+		json_array_append_new(arr, subval);
+	}
+	free(sites);
+	json_object_set_new_nocheck(val, "enabled", json_boolean(lock_profiling));
+	json_object_set_new_nocheck(val, "sites", arr);
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	return buf;
+}
+
 int _cond_wait(pthread_cond_t *cond, mutex_t *lock, const char *file, const char *func, const int line)
 {
 	int ret;
 
+	if (unlikely(lock->acquired))
+		profile_hold(lock->file, lock->func, lock->line, LP_MUTEX, &lock->acquired);
 	ret = pthread_cond_wait(cond, &lock->mutex);
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(lock_profiling))
+		lock->acquired = mono_ns();
 	return ret;
 }
 
@@ -131,10 +341,14 @@ int _cond_timedwait(pthread_cond_t *cond, mutex_t *lock, const struct timespec *
 {
 	int ret;
 
+	if (unlikely(lock->acquired))
+		profile_hold(lock->file, lock->func, lock->line, LP_MUTEX, &lock->acquired);
 	ret = pthread_cond_timedwait(cond, &lock->mutex, abstime);
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(lock_profiling))
+		lock->acquired = mono_ns();
 	return ret;
 }
 
@@ -164,7 +378,19 @@ int _mutex_timedlock(mutex_t *lock, int timeout, const char *file, const char *f
 void _mutex_lock(mutex_t *lock, const char *file, const char *func, const int line)
 {
 	int ret, retries = 0;
-
+	int64_t start = 0;
+
+	if (unlikely(lock_profiling)) {
+		if (!pthread_mutex_trylock(&lock->mutex)) {
+			lock->file = file;
+			lock->func = func;
+			lock->line = line;
+			profile_wait(file, func, line, LP_MUTEX, 0);
+			lock->acquired = mono_ns();
+			return;
+		}
+		start = mono_ns();
+	}
 retry:
 	ret = _mutex_timedlock(lock, 10, file, func, line);
 	if (unlikely(ret)) {
@@ -177,11 +403,17 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON LOCK!");
 	}
+	if (unlikely(start)) {
+		lock->acquired = mono_ns();
+		profile_wait(file, func, line, LP_MUTEX, lock->acquired - start);
+	}
 }
 
 /* Does not unset lock->file/func/line since they're only relevant when the lock is held */
 void _mutex_unlock(mutex_t *lock, const char *file, const char *func, const int line)
 {
+	if (unlikely(lock->acquired))
+		profile_hold(lock->file, lock->func, lock->line, LP_MUTEX, &lock->acquired);
 	if (unlikely(pthread_mutex_unlock(&lock->mutex)))
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON UNLOCK!");
 }
@@ -195,6 +427,10 @@ int _mutex_trylock(mutex_t *lock, __maybe_unused const char *file, __maybe_unuse
 		lock->file = file;
 		lock->func = func;
 		lock->line = line;
+		if (unlikely(lock_profiling)) {
+			profile_wait(file, func, line, LP_MUTEX, 0);
+			lock->acquired = mono_ns();
+		}
 	}
 	return ret;
 }
@@ -223,7 +459,19 @@ static int wr_timedlock(pthread_rwlock_t *lock, int timeout)
 void _wr_lock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
 	int ret, retries = 0;
-
+	int64_t start = 0;
+
+	if (unlikely(lock_profiling)) {
+		if (!pthread_rwlock_trywrlock(&lock->rwlock)) {
+			lock->file = file;
+			lock->func = func;
+			lock->line = line;
+			profile_wait(file, func, line, LP_WRITE, 0);
+			lock->acquired = mono_ns();
+			return;
+		}
+		start = mono_ns();
+	}
 retry:
 	ret = wr_timedlock(&lock->rwlock, 10);
 	if (unlikely(ret)) {
@@ -239,6 +487,10 @@ retry:
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(start)) {
+		lock->acquired = mono_ns();
+		profile_wait(file, func, line, LP_WRITE, lock->acquired - start);
+	}
 }
 
 int _wr_trylock(rwlock_t *lock, __maybe_unused const char *file, __maybe_unused const char *func, __maybe_unused const int line)
@@ -249,6 +501,10 @@ int _wr_trylock(rwlock_t *lock, __maybe_unused const char *file, __maybe_unused
 		lock->file = file;
 		lock->func = func;
 		lock->line = line;
+		if (unlikely(lock_profiling)) {
+			profile_wait(file, func, line, LP_WRITE, 0);
+			lock->acquired = mono_ns();
+		}
 	}
 	return ret;
 }
@@ -271,7 +527,15 @@ static int rd_timedlock(pthread_rwlock_t *lock, int timeout)
 void _rd_lock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
 	int ret, retries = 0;
+	int64_t start = 0;
 
+	if (unlikely(lock_profiling)) {
+		if (!pthread_rwlock_tryrdlock(&lock->rwlock)) {
+			profile_wait(file, func, line, LP_READ, 0);
+			goto out;
+		}
+		start = mono_ns();
+	}
 retry:
 	ret = rd_timedlock(&lock->rwlock, 10);
 	if (unlikely(ret)) {
@@ -284,6 +548,9 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF ERROR ON READ LOCK!");
 	}
+	if (unlikely(start))
+		profile_wait(file, func, line, LP_READ, mono_ns() - start);
+out:
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
@@ -291,6 +558,9 @@ retry:
 
 void _rw_unlock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	/* Only set by write lockers so readers never account hold time */
+	if (unlikely(lock->acquired))
+		profile_hold(lock->file, lock->func, lock->line, LP_WRITE, &lock->acquired);
 	if (unlikely(pthread_rwlock_unlock(&lock->rwlock)))
 		quitfrom(1, file, func, line, "WTF RWLOCK ERROR ON UNLOCK!");
 }
@@ -713,11 +983,71 @@ out:
 	return sockd;
 }
 
-int connect_socket(char *url, char *port)
+/* Attempt a non blocking connect to one resolved address, returning a blocking
+ * socket or -1 if it can't be connected to quickly. */
+static int connect_addrinfo(const struct addrinfo *p)
+{
+	int sockd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+
+	if (sockd == -1) {
+		LOGDEBUG("Failed socket");
+		return -1;
+	}
+	noblock_socket(sockd);
+	if (connect(sockd, p->ai_addr, p->ai_addrlen) == -1) {
+		int selret;
+
+		if (!sock_connecting()) {
+			Close(sockd);
+			LOGDEBUG("Failed sock connect");
+			return -1;
+		}
+		selret = wait_write_select(sockd, 5);
+		if  (selret > 0) {
+			socklen_t len;
+			int err, n;
+
+			len = sizeof(err);
+			n = getsockopt(sockd, SOL_SOCKET, SO_ERROR, (void *)&err, &len);
+			if (!n && !err) {
+				LOGDEBUG("Succeeded delayed connect");
+				block_socket(sockd);
+				return sockd;
+			}
+		}
+		Close(sockd);
+		LOGDEBUG("Select timeout/failed connect");
+		return -1;
+	}
+	LOGDEBUG("Succeeded immediate connect");
+	block_socket(sockd);
+	return sockd;
+}
+
+/* As connect_socket but tries the address cached from a previous successful
+ * connect first, only resolving the url again if that fails. The address that
+ * succeeds is stored in the cache if one is passed. */
+int connect_socket_cached(char *url, char *port, sockaddr_cache_t *cache)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
 	int sockd = -1;
 
+	if (cache && cache->addrlen) {
+		struct addrinfo cached;
+
+		memset(&cached, 0, sizeof(cached));
+		cached.ai_family = cache->family;
+		cached.ai_socktype = cache->socktype;
+		cached.ai_protocol = cache->protocol;
+		cached.ai_addr = (struct sockaddr *)&cache->addr;
+		cached.ai_addrlen = cache->addrlen;
+		sockd = connect_addrinfo(&cached);
+		if (sockd >= 0)
+			goto out;
+		LOGINFO("Failed to connect to cached address of %s:%s, resolving again", url, port);
+		cache->addrlen = 0;
+	}
+
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
@@ -729,57 +1059,34 @@ int connect_socket(char *url, char *port)
 		goto out;
 	}
 
+	/* Iterate non blocking over entries returned by getaddrinfo to cope
+	 * with round robin DNS entries, finding the first one we can connect
+	 * to quickly. */
 	for (p = servinfo; p != NULL; p = p->ai_next) {
-		sockd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sockd == -1) {
-			LOGDEBUG("Failed socket");
-			continue;
-		}
-
-		/* Iterate non blocking over entries returned by getaddrinfo
-		 * to cope with round robin DNS entries, finding the first one
-		 * we can connect to quickly. */
-		noblock_socket(sockd);
-		if (connect(sockd, p->ai_addr, p->ai_addrlen) == -1) {
-			int selret;
-
-			if (!sock_connecting()) {
-				Close(sockd);
-				LOGDEBUG("Failed sock connect");
-				continue;
-			}
-			selret = wait_write_select(sockd, 5);
-			if  (selret > 0) {
-				socklen_t len;
-				int err, n;
-
-				len = sizeof(err);
-				n = getsockopt(sockd, SOL_SOCKET, SO_ERROR, (void *)&err, &len);
-				if (!n && !err) {
-					LOGDEBUG("Succeeded delayed connect");
-					block_socket(sockd);
-					break;
-				}
-			}
-			Close(sockd);
-			LOGDEBUG("Select timeout/failed connect");
-			continue;
-		}
-		LOGDEBUG("Succeeded immediate connect");
+		sockd = connect_addrinfo(p);
 		if (sockd >= 0)
-			block_socket(sockd);
-
-		break;
+			break;
 	}
 	if (p == NULL) {
 		LOGINFO("Failed to connect to %s:%s", url, port);
 		sockd = -1;
+	} else if (cache && p->ai_addrlen <= sizeof(cache->addr)) {
+		cache->family = p->ai_family;
+		cache->socktype = p->ai_socktype;
+		cache->protocol = p->ai_protocol;
+		memcpy(&cache->addr, p->ai_addr, p->ai_addrlen);
+		cache->addrlen = p->ai_addrlen;
 	}
 	freeaddrinfo(servinfo);
 out:
 	return sockd;
 }
 
+int connect_socket(char *url, char *port)
+{
+	return connect_socket_cached(url, port, NULL);
+}
+
 /* Measure the minimum round trip time it should take to get to a url by attempting
  * to connect to what should be a closed socket on port 1042. This is a blocking
  * function so can take many seconds. Returns 0 on failure */
@@ -852,6 +1159,42 @@ out:
 	return ret;
 }
 
+/* Write all of an iovec array without copying it into one buffer, advancing
+ * iov past what has been written on partial writes. */
+int write_socketv(int fd, struct iovec *iov, int iovcnt)
+{
+	int ret, ofs = 0;
+
+	ret = wait_write_select(fd, 5);
+	if (ret < 1) {
+		if (!ret)
+			LOGNOTICE("Select timed out in write_socketv");
+		else
+			LOGNOTICE("Select failed in write_socketv");
+		return ret;
+	}
+	while (iovcnt) {
+		ret = writev(fd, iov, iovcnt);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGNOTICE("Failed to write in write_socketv");
+			return -1;
+		}
+		ofs += ret;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return ofs;
+}
+
 void empty_socket(int fd)
 {
 	char buf[PAGESIZE];
@@ -2033,27 +2376,40 @@ double tvdiff(tv_t *end, tv_t *start)
 	return end->tv_sec - start->tv_sec + (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
-/* Create an exponentially decaying average over interval */
-void decay_time(double *f, double fadd, double fsecs, double interval)
+/* Return the proportion used to decay an average over interval after fsecs,
+ * allowing the exp() to be shared by many averages decayed over the same
+ * period */
+double decay_fprop(double fsecs, double interval)
 {
-	double ftotal, fprop, dexp;
+	double dexp = fsecs / interval;
 
-	if (fsecs <= 0)
-		return;
-	dexp = fsecs / interval;
 	/* Put Sanity bound on how large the denominator can get */
 	if (unlikely(dexp > 36))
 		dexp = 36;
-	fprop = 1.0 - 1 / exp(dexp);
-	ftotal = 1.0 + fprop;
+	return 1.0 - 1 / exp(dexp);
+}
+
+/* As decay_time but with fprop already calculated by decay_fprop */
+void decay_time_fprop(double *f, double fadd, double fsecs, double fprop)
+{
+	if (fsecs <= 0)
+		return;
 	*f += (fadd / fsecs * fprop);
-	*f /= ftotal;
+	*f /= 1.0 + fprop;
 	/* Sanity check to prevent meaningless super small numbers that
 	 * eventually underflow libjansson's real number interpretation. */
 	if (unlikely(*f < 2E-16))
 		*f = 0;
 }
 
+/* Create an exponentially decaying average over interval */
+void decay_time(double *f, double fadd, double fsecs, double interval)
+{
+	if (fsecs <= 0)
+		return;
+	decay_time_fprop(f, fadd, fsecs, decay_fprop(fsecs, interval));
+}
+
 /* Sanity check to prevent clock adjustments backwards from screwing up stats */
 double sane_tdiff(tv_t *end, tv_t *start)
 {
@@ -2264,3 +2620,236 @@ void gen_hash(uchar *data, uchar *hash, int len)
 	sha256(data, len, hash1);
 	sha256(hash1, 32, hash);
 }
+
+static void put_ledouble(char *buf, const double val)
+{
+	uint64_t u64;
+
+	memcpy(&u64, &val, 8);
+	u64 = htole64(u64);
+	memcpy(buf, &u64, 8);
+}
+
+static double get_ledouble(const char *buf)
+{
+	uint64_t u64;
+	double val;
+
+	memcpy(&u64, buf, 8);
+	u64 = le64toh(u64);
+	memcpy(&val, &u64, 8);
+	return val;
+}
+
+/* Encode a remote share record into buf which must have room for
+ * REMOTE_SHARE_FIXED + namelen bytes, namelen being at most 255. Returns the
+ * length of the record. */
+int remote_share_encode(char *buf, const char *workername, const int namelen,
+			const double diff, const double sdiff)
+{
+	put_ledouble(buf, diff);
+	put_ledouble(buf + 8, sdiff);
+	buf[16] = namelen;
+	memcpy(buf + REMOTE_SHARE_FIXED, workername, namelen);
+	return REMOTE_SHARE_FIXED + namelen;
+}
+
+/* Decode a remote share record from len bytes of buf into a workername buffer
+ * of at least 256 bytes. Returns the length of the record or -1 if it is
+ * truncated. */
+int remote_share_decode(const char *buf, const int len, char *workername,
+			double *diff, double *sdiff)
+{
+	int namelen;
+
+	if (unlikely(len < REMOTE_SHARE_FIXED))
+		return -1;
+	namelen = (uint8_t)buf[16];
+	if (unlikely(len < REMOTE_SHARE_FIXED + namelen))
+		return -1;
+	*diff = get_ledouble(buf);
+	*sdiff = get_ledouble(buf + 8);
+	memcpy(workername, buf + REMOTE_SHARE_FIXED, namelen);
+	workername[namelen] = '\0';
+	return REMOTE_SHARE_FIXED + namelen;
+}
+
+/* Encode a remote share total record into buf which must have room for
+ * REMOTE_TOTAL_FIXED + namelen bytes. Returns the length of the record. */
+int remote_total_encode(char *buf, const char *workername, const int namelen,
+			const uint32_t shares, const double diff, const double sdiff)
+{
+	uint32_t le32 = htole32(shares);
+
+	memcpy(buf, &le32, 4);
+	return 4 + remote_share_encode(buf + 4, workername, namelen, diff, sdiff);
+}
+
+/* Decode a remote share total record the same way as remote_share_decode */
+int remote_total_decode(const char *buf, const int len, char *workername,
+			uint32_t *shares, double *diff, double *sdiff)
+{
+	uint32_t le32;
+	int ret;
+
+	if (unlikely(len < REMOTE_TOTAL_FIXED))
+		return -1;
+	ret = remote_share_decode(buf + 4, len - 4, workername, diff, sdiff);
+	if (unlikely(ret < 0))
+		return -1;
+	memcpy(&le32, buf, 4);
+	*shares = le32toh(le32);
+	return 4 + ret;
+}
+
+/* Decode a share total record if totals is set or a share record counting as
+ * one share otherwise */
+int remote_record_decode(const char *buf, const int len, const bool totals, char *workername,
+			 uint32_t *shares, double *diff, double *sdiff)
+{
+	if (totals)
+		return remote_total_decode(buf, len, workername, shares, diff, sdiff);
+	*shares = 1;
+	return remote_share_decode(buf, len, workername, diff, sdiff);
+}
+
+/* Check the header of a binary frame at the start of len bytes of buf from a
+ * remote that negotiated up to version, copying it into frame. Returns the
+ * length of the whole frame, zero if it is incomplete and -1 if it is
+ * invalid. */
+int remote_frame_check(const char *buf, const int len, const int version, remote_frame_t *frame)
+{
+	uint32_t flen;
+
+	if (len < (int)sizeof(remote_frame_t))
+		return 0;
+	memcpy(frame, buf, sizeof(remote_frame_t));
+	flen = le32toh(frame->len);
+	if (unlikely(!frame->version || frame->version > version || flen > MAX_REMOTE_FRAME))
+		return -1;
+	if (len < (int)(sizeof(remote_frame_t) + flen))
+		return 0;
+	return sizeof(remote_frame_t) + flen;
+}
+
+static void finish_frame(char *frame, const int type, const int version, const int len,
+			 const int count)
+{
+	remote_frame_t hdr;
+
+	hdr.version = version;
+	hdr.type = type;
+	hdr.pad = 0;
+	hdr.count = htole32(count);
+	hdr.len = htole32(len);
+	memcpy(frame, &hdr, sizeof(hdr));
+}
+
+/* Split a batch of records of one type into as few binary frames as fit,
+ * appending them to msg */
+static void add_frames(char *msg, int *msglen, const char *batch, const int len,
+		       const int type, const int version)
+{
+	int ofs = 0, framelen = 0, count = 0, fixed;
+	char *frame = NULL;
+
+	fixed = type == RF_TOTALS ? REMOTE_TOTAL_FIXED : REMOTE_SHARE_FIXED;
+	while (ofs < len) {
+		int reclen = fixed + (uint8_t)batch[ofs + fixed - 1];
+
+		if (!frame || framelen + reclen > MAX_REMOTE_FRAME) {
+			if (frame)
+				finish_frame(frame, type, version, framelen, count);
+			frame = msg + *msglen;
+			*msglen += sizeof(remote_frame_t);
+			framelen = count = 0;
+		}
+		memcpy(msg + *msglen, batch + ofs, reclen);
+		*msglen += reclen;
+		framelen += reclen;
+		count++;
+		ofs += reclen;
+	}
+	if (frame)
+		finish_frame(frame, type, version, framelen, count);
+}
+
+/* Frame a batch of share records and a batch of share total records for an
+ * upstream pool that negotiated version, returning the message and its length
+ * in msglen */
+char *remote_share_frames(const char *batch, const int len, const char *totals, const int tlen,
+			  const int version, int *msglen)
+{
+	int size;
+	char *msg;
+
+	size = len + tlen + sizeof(remote_frame_t) *
+		((len + tlen) / (MAX_REMOTE_FRAME - REMOTE_TOTAL_MAX) + 2);
+	msg = ckalloc(size);
+	*msglen = 0;
+	add_frames(msg, msglen, batch, len, RF_SHARES, version);
+	add_frames(msg, msglen, totals, tlen, RF_TOTALS, version);
+	return msg;
+}
+
+/* Append share totals to the batch as one share record each of their summed
+ * diff for an upstream pool that doesn't take totals */
+void remote_totals_as_shares(char **batch, int *len, const char *totals, const int tlen)
+{
+	char workername[256];
+	double diff, sdiff;
+	uint32_t shares;
+	int ofs = 0;
+
+	/* Share records are always shorter than the totals they came from */
+	*batch = realloc(*batch, *len + tlen);
+	while (ofs < tlen) {
+		int reclen = remote_total_decode(totals + ofs, tlen - ofs, workername, &shares,
+						 &diff, &sdiff);
+
+		if (unlikely(reclen < 0)) {
+			LOGWARNING("Invalid share total record, dropping the rest");
+			break;
+		}
+		ofs += reclen;
+		*len += remote_share_encode(*batch + *len, workername, strlen(workername),
+					    diff, sdiff);
+	}
+}
+
+/* Convert a batch of share records into json messages of method for an
+ * upstream pool that doesn't take binary frames */
+char *remote_shares_json(const char *batch, const int len, const char *method, int *msglen)
+{
+	int ofs = 0, size = PAGESIZE;
+	char workername[256], *msg;
+	double diff, sdiff;
+
+	msg = ckalloc(size);
+	*msglen = 0;
+	while (ofs < len) {
+		int buflen, reclen;
+		char *buf;
+		json_t *val;
+
+		reclen = remote_share_decode(batch + ofs, len - ofs, workername, &diff, &sdiff);
+		if (unlikely(reclen < 0)) {
+			LOGWARNING("Invalid share record, dropping the rest");
+			break;
+		}
+		ofs += reclen;
+		JSON_CPACK(val, "{ss,sf,sf,ss}", "workername", workername, "diff", diff,
+			   "sdiff", sdiff, "method", method);
+		buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT | JSON_EOL);
+		json_decref(val);
+		buflen = strlen(buf);
+		if (*msglen + buflen > size) {
+			size = round_up_page(size * 2 + buflen);
+			msg = realloc(msg, size);
+		}
+		memcpy(msg + *msglen, buf, buflen);
+		*msglen += buflen;
+		free(buf);
+	}
+	return msg;
+}
@@ -37,6 +37,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "utlist.h"
 
@@ -310,6 +311,7 @@ struct ckmutex {
 	const char *file;
 	const char *func;
 	int line;
+	int64_t acquired; /* Monotonic ns when locked with lock profiling on */
 };
 
 typedef struct ckrwlock rwlock_t;
@@ -319,6 +321,7 @@ struct ckrwlock {
 	const char *file;
 	const char *func;
 	int line;
+	int64_t acquired; /* As ckmutex but only for write locks */
 };
 
 /* ck locks, a write biased variant of rwlocks */
@@ -339,6 +342,17 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* A resolved address kept to avoid a name lookup on every reconnect */
+struct sockaddr_cache {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+typedef struct sockaddr_cache sockaddr_cache_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -439,6 +453,8 @@ bool ck_completion_timeout(void *fn, void *fnarg, int timeout);
 int _cond_wait(pthread_cond_t *cond, mutex_t *lock, const char *file, const char *func, const int line);
 int _cond_timedwait(pthread_cond_t *cond, mutex_t *lock, const struct timespec *abstime, const char *file, const char *func, const int line);
 int _mutex_timedlock(mutex_t *lock, int timeout, const char *file, const char *func, const int line);
+void lock_profile_enable(const bool enable);
+char *lock_profile_stats(int top);
 void _mutex_lock(mutex_t *lock, const char *file, const char *func, const int line);
 void _mutex_unlock_noyield(mutex_t *lock, const char *file, const char *func, const int line);
 void _mutex_unlock(mutex_t *lock, const char *file, const char *func, const int line);
@@ -513,9 +529,11 @@ void _close(int *fd, const char *file, const char *func, const int line);
 #define _Close(FD) _close(FD, __FILE__, __func__, __LINE__)
 #define Close(FD) _close(&FD, __FILE__, __func__, __LINE__)
 int bind_socket(char *url, char *port);
+int connect_socket_cached(char *url, char *port, sockaddr_cache_t *cache);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
+int write_socketv(int fd, struct iovec *iov, int iovcnt);
 void empty_socket(int fd);
 void _close_unix_socket(int *sockd, const char *server_path);
 #define close_unix_socket(sockd, server_path) _close_unix_socket(&sockd, server_path)
@@ -600,6 +618,8 @@ double us_tvdiff(tv_t *end, tv_t *start);
 int ms_tvdiff(tv_t *end, tv_t *start);
 double tvdiff(tv_t *end, tv_t *start);
 
+double decay_fprop(double fsecs, double interval);
+void decay_time_fprop(double *f, double fadd, double fsecs, double fprop);
 void decay_time(double *f, double fadd, double fsecs, double interval);
 double sane_tdiff(tv_t *end, tv_t *start);
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits);
@@ -613,4 +633,56 @@ void target_from_diff(uchar *target, double diff);
 
 void gen_hash(uchar *data, uchar *hash, int len);
 
+/* Binary frames a trusted remote interleaves with its json lines to the
+ * upstream pool once negotiated at mining.remote. A frame starts with its
+ * version, which can never start a json line. */
+#define REMOTE_BINARY_VERSION 2
+
+enum remote_frame_type {
+	RF_SHARES = 0,	/* count share records */
+	RF_TOTALS,	/* count share total records, version 2 */
+};
+
+struct remote_frame {
+	uint8_t version;
+	uint8_t type;
+	uint16_t pad;
+	uint32_t count; /* Records, little endian */
+	uint32_t len; /* Payload length, little endian */
+};
+
+typedef struct remote_frame remote_frame_t;
+
+/* Largest binary frame payload sent to and accepted from trusted remotes */
+#define MAX_REMOTE_FRAME 65536
+
+int remote_frame_check(const char *buf, const int len, const int version, remote_frame_t *frame);
+
+/* A share record is its diff and sdiff as little endian doubles then the
+ * workername preceded by its length in a byte */
+#define REMOTE_SHARE_FIXED 17
+#define REMOTE_SHARE_MAX (REMOTE_SHARE_FIXED + 255)
+
+int remote_share_encode(char *buf, const char *workername, const int namelen,
+			const double diff, const double sdiff);
+int remote_share_decode(const char *buf, const int len, char *workername,
+			double *diff, double *sdiff);
+
+/* A share total record is the little endian number of shares a worker has
+ * aggregated followed by a share record of their summed diff and best sdiff */
+#define REMOTE_TOTAL_FIXED (4 + REMOTE_SHARE_FIXED)
+#define REMOTE_TOTAL_MAX (REMOTE_TOTAL_FIXED + 255)
+
+int remote_total_encode(char *buf, const char *workername, const int namelen,
+			const uint32_t shares, const double diff, const double sdiff);
+int remote_total_decode(const char *buf, const int len, char *workername,
+			uint32_t *shares, double *diff, double *sdiff);
+int remote_record_decode(const char *buf, const int len, const bool totals, char *workername,
+			 uint32_t *shares, double *diff, double *sdiff);
+
+char *remote_share_frames(const char *batch, const int len, const char *totals, const int tlen,
+			  const int version, int *msglen);
+void remote_totals_as_shares(char **batch, int *len, const char *totals, const int tlen);
+char *remote_shares_json(const char *batch, const int len, const char *method, int *msglen);
+
 #endif /* LIBCKPOOL_H */
@@ -34,8 +34,11 @@
 
 #include "config.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "sha2.h"
 
@@ -173,6 +176,107 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
     sha256_final(&ctx, digest);
 }
 
+/* The padding block of a 64 byte message, only the length of 512 bits set */
+static const unsigned char sha256_pad64[SHA256_BLOCK_SIZE] = {
+	0x80, [62] = 0x02
+};
+
+/* Double sha256 of a 64 byte message, as every merkle tree node is, without
+ * the buffering of sha256_update and sha256_final. */
+void sha256d_64(const unsigned char *message, unsigned char *digest)
+{
+	unsigned char block[SHA256_BLOCK_SIZE];
+	sha256_ctx ctx;
+	int i;
+
+	sha256_init(&ctx);
+	sha256_transf(&ctx, message, 1);
+	sha256_transf(&ctx, sha256_pad64, 1);
+	for (i = 0; i < 8; i++)
+		UNPACK32(ctx.h[i], &block[i << 2]);
+	/* Second hash of 32 bytes fits in one block with its 256 bit length */
+	memset(block + 32, 0, 32);
+	block[32] = 0x80;
+	block[62] = 0x01;
+	sha256_init(&ctx);
+	sha256_transf(&ctx, block, 1);
+	for (i = 0; i < 8; i++)
+		UNPACK32(ctx.h[i], &digest[i << 2]);
+}
+
+/* Minimum pairs worth handing to another thread and most threads used */
+#define SHA256D_THREAD_PAIRS 4096
+#define SHA256D_MAX_THREADS 16
+
+struct sha256d_job {
+	const unsigned char *pairs;
+	unsigned char *hashes;
+	const unsigned char *done;
+	int start;
+	int end;
+};
+
+static void *sha256d_job(void *arg)
+{
+	struct sha256d_job *job = arg;
+	int i;
+
+	for (i = job->start; i < job->end; i++) {
+		if (job->done && job->done[i])
+			continue;
+		sha256d_64(job->pairs + i * 64, job->hashes + i * 32);
+	}
+	return NULL;
+}
+
+/* Double sha256 count 64 byte pairs into count 32 byte hashes, skipping any
+ * already flagged in done if it's not NULL. Large batches such as the lower
+ * levels of a merkle tree are split across threads so pairs and hashes must
+ * not overlap. */
+void sha256d_pairs(const unsigned char *pairs, unsigned char *hashes, int count,
+		   const unsigned char *done)
+{
+	struct sha256d_job jobs[SHA256D_MAX_THREADS];
+	pthread_t pth[SHA256D_MAX_THREADS];
+	bool started[SHA256D_MAX_THREADS];
+	static int cpus;
+	int i, threads;
+
+	if (!cpus) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus < 1)
+			cpus = 1;
+	}
+	threads = count / SHA256D_THREAD_PAIRS;
+	if (threads > cpus)
+		threads = cpus;
+	if (threads > SHA256D_MAX_THREADS)
+		threads = SHA256D_MAX_THREADS;
+	if (threads < 2) {
+		struct sha256d_job job = {pairs, hashes, done, 0, count};
+
+		sha256d_job(&job);
+		return;
+	}
+	for (i = 0; i < threads; i++) {
+		jobs[i].pairs = pairs;
+		jobs[i].hashes = hashes;
+		jobs[i].done = done;
+		jobs[i].start = (long)count * i / threads;
+		jobs[i].end = (long)count * (i + 1) / threads;
+	}
+	/* This thread does the first share and any that fail to start */
+	for (i = 1; i < threads; i++)
+		started[i] = !pthread_create(&pth[i], NULL, sha256d_job, &jobs[i]);
+	sha256d_job(&jobs[0]);
+	for (i = 1; i < threads; i++) {
+		if (started[i])
+			pthread_join(pth[i], NULL);
+		else
+			sha256d_job(&jobs[i]);
+	}
+}
+
 void sha256_init(sha256_ctx *ctx)
 {
     int i;
@@ -65,5 +65,8 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256d_64(const unsigned char *message, unsigned char *digest);
+void sha256d_pairs(const unsigned char *pairs, unsigned char *hashes, int count,
+		   const unsigned char *done);
 
 #endif /* !SHA2_H */
@@ -123,6 +123,22 @@ typedef struct user_instance user_instance_t;
 typedef struct worker_instance worker_instance_t;
 typedef struct stratum_instance stratum_instance_t;
 
+/* Number of per minute hashrate samples kept in memory, 24 hours worth */
+#define HISTORY_SAMPLES 1440
+
+/* Ring buffer of per minute hashrate samples, stored as separate arrays so
+ * range queries walk contiguous memory */
+struct hashrate_history {
+	int head; /* Next slot to be written */
+	int count; /* Number of valid samples */
+	time_t stamp[HISTORY_SAMPLES];
+	float dsps1[HISTORY_SAMPLES];
+	float dsps5[HISTORY_SAMPLES];
+	float dsps60[HISTORY_SAMPLES];
+};
+
+typedef struct hashrate_history history_t;
+
 struct user_instance {
 	UT_hash_handle hh;
 	char username[128];
@@ -149,7 +165,7 @@ struct user_instance {
 
 	int64_t shares;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	double uadiff; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1; /* Diff shares per second, 1 minute rolling average */
 	double dsps5; /* ... 5 minute ... */
@@ -157,7 +173,8 @@ struct user_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
+
+	history_t *history; /* Protected by history_lock */
 
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
@@ -179,7 +196,7 @@ struct worker_instance {
 
 	int64_t shares;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	double uadiff; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1;
 	double dsps5;
@@ -187,9 +204,10 @@ struct worker_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
 	time_t start_time;
 
+	history_t *history; /* Protected by history_lock */
+
 	double best_diff; /* Best share found by this worker */
 	int64_t best_ever; /* Best share ever found by this worker */
 	int mindiff; /* User chosen mindiff */
@@ -239,7 +257,7 @@ struct stratum_instance {
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	double uadiff; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1; /* Diff shares per second, 1 minute rolling average */
 	double dsps5; /* ... 5 minute ... */
@@ -250,13 +268,13 @@ struct stratum_instance {
 	int ssdc; /* Shares since diff change */
 	tv_t first_share;
 	tv_t last_share;
-	tv_t last_decay;
 	time_t first_invalid; /* Time of first invalid in run of non stale rejects */
 	time_t upstream_invalid; /* As first_invalid but for upstream responses */
 	time_t start_time;
 
 	char address[INET6_ADDRSTRLEN];
 	bool node; /* Is this a mining node */
+	bool compact; /* Remote that takes workinfos with short txids */
 	bool subscribed;
 	bool authorising; /* In progress, protected by instance_lock */
 	bool authorised;
@@ -339,8 +357,10 @@ struct proxy_base {
 	bool subscribed;
 	bool notified;
 
-	int64_t clients; /* Incrementing client count */
+	int64_t clients; /* Incrementing client count, or bound slots with a map */
 	int64_t max_clients; /* Maximum number of clients per subproxy */
+	uint64_t *enonce1map; /* Bitmap of bound enonce1var slots for small spaces */
+	int64_t map_clients; /* Number of slots in enonce1map */
 	int64_t bound_clients; /* Currently actively bound clients */
 	int64_t combined_clients; /* Total clients of all subproxies of a parent proxy */
 	int64_t headroom; /* Temporary variable when calculating how many more clients can bind */
@@ -353,6 +373,9 @@ struct proxy_base {
 	bool deleted;
 };
 
+/* Largest enonce1var space of a proxy tracked with a bitmap of bound slots */
+#define ENONCE1_MAP_MAX 65536
+
 typedef struct session session_t;
 
 struct session {
@@ -369,11 +392,62 @@ typedef struct txntable txntable_t;
 
 struct txntable {
 	UT_hash_handle hh;
-	int id;
-	char hash[68];
-	char *data;
+	/* In the ageing list when not in the local template */
+	txntable_t *next;
+	txntable_t *prev;
+	uchar hash[32]; /* Binary hash in block byte order as the key */
 	int refcount;
 	bool seen;
+	bool intemplate; /* In the current local template so it doesn't age */
+	int len;
+	uchar data[]; /* Raw transaction, only converted to hex when sent */
+};
+
+typedef struct txid_entry txid_entry_t;
+
+/* A transaction in the last local template by binary txid, keeping the hex
+ * forms so unchanged transactions in the next template need no conversion or
+ * txn table lookup */
+struct txid_entry {
+	UT_hash_handle hh;
+	uchar txid[32];
+	uchar wtxid[32]; /* Txn table key */
+	char txidhex[68];
+	int64_t generation; /* Template this was last seen in */
+};
+
+typedef struct pending_workinfo pending_workinfo_t;
+
+/* A compact workinfo from a trusted server held until the transactions we
+ * requested for its short txids arrive */
+struct pending_workinfo {
+	pending_workinfo_t *next;
+	pending_workinfo_t *prev;
+	json_t *val;
+	int64_t client_id;
+	time_t added;
+};
+
+/* Pending workinfos are stale well before this */
+#define PENDING_WORKINFO_AGE 60
+
+typedef struct merkle_memo merkle_memo_t;
+
+/* A hash in the last local template's merkle tree found by the pair of hashes
+ * it was made from, so pairs unchanged in the next template aren't hashed
+ * again. The key is the first of the pair. */
+struct merkle_memo {
+	UT_hash_handle hh;
+	const uchar *pair;
+	const uchar *hash;
+};
+
+typedef struct merkle_tree merkle_tree_t;
+
+struct merkle_tree {
+	uchar *nodes; /* Every level, coinbase placeholder first */
+	merkle_memo_t *memo_array;
+	merkle_memo_t *memos;
 };
 
 #define ID_AUTH 0
@@ -402,6 +476,8 @@ struct stratifier_data {
 	mutex_t stats_lock;
 	/* Protects changes to unaccounted pool stats */
 	mutex_t uastats_lock;
+	/* Protects the user and worker hashrate history rings */
+	mutex_t history_lock;
 
 	bool verbose;
 
@@ -418,7 +494,19 @@ struct stratifier_data {
 	workbase_t *current_workbase;
 	int workbases_generated;
 	txntable_t *txns;
+	txntable_t *ageing_txns;
 	int64_t txns_generated;
+	/* Salt for the short txids in workinfos sent to compact remotes */
+	uint64_t txn_salt;
+	/* Compact workinfos waiting on the transactions requested for them,
+	 * protected by txn_lock */
+	pending_workinfo_t *pending_workinfos;
+
+	/* Txids and merkle tree of the last local template to diff the next
+	 * one against, only used by the serialised block_update */
+	txid_entry_t *txid_cache;
+	int64_t txid_generation;
+	merkle_tree_t *merkle_tree;
 
 	/* Workbases from remote trusted servers */
 	workbase_t *remote_workbases;
@@ -437,12 +525,28 @@ struct stratifier_data {
 	char lasthash[68];
 	char lastswaphash[68];
 
+	/* The last best block hash notified by bitcoind, when it arrived and
+	 * whether we're still waiting on the full template for it, all under
+	 * workbase_lock */
+	char notifyhash[68];
+	tv_t blocknotify_time;
+	bool fullwork_pending;
+	/* Seconds miners spent on the old block after the last block change
+	 * until the empty and the full workbase were sent */
+	double emptyswitch_latency;
+	double fullswitch_latency;
+	/* Seconds from the last block solve to sending it and to bitcoind's
+	 * response */
+	double solvesend_latency;
+	double solvesubmit_latency;
+
 	ckmsgq_t *updateq;	// Generator base work updates
 	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
 	ckmsgq_t *sshareq;	// Stratum share sends
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	ckmsgq_t *srshareq;	// Batched remote shares
 
 	int user_instance_id;
 
@@ -485,6 +589,7 @@ struct json_entry {
 #define GEN_LAX 0
 #define GEN_NORMAL 1
 #define GEN_PRIORITY 2
+#define GEN_LONGPOLL 3 /* Priority update with a template from a long poll */
 
 /* For storing a set of messages within another lock, allowing us to dump them
  * to the log outside of lock */
@@ -799,6 +904,10 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb->flags);
 	free(wb->txn_data);
 	free(wb->txn_hashes);
+	free(wb->txidbin);
+	free(wb->wtxidbin);
+	free(wb->txn_ofs);
+	free(wb->job_id);
 	free(wb->logdir);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
@@ -906,14 +1015,101 @@ static void upstream_msgtype(ckpool_t *ckp, const json_t *val, const int msg_typ
 	json_decref(json_msg);
 }
 
-static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
+static void txn_hash_hex(char *hex, const uchar *hash)
 {
-	stratum_instance_t *client;
-	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
-	json_t *wb_val;
+	uchar swap[32];
+
+	bswap_256(swap, hash);
+	__bin2hex(hex, swap, 32);
+}
+
+static bool txn_hex_hash(uchar *hash, const char *hex)
+{
+	uchar swap[32];
+
+	if (unlikely(!hex || strlen(hex) != 64 || !hex2bin(swap, hex, 32)))
+		return false;
+	bswap_256(hash, swap);
+	return true;
+}
 
-	wb_val = json_object();
+/* Short txids are the leading bytes of the sha256 of a salt and the binary
+ * txn table key, short enough to make workinfos compact yet unlikely to
+ * collide within a transaction table */
+#define SHORTID_LEN 6
+
+static uint64_t txn_shortid(const uchar *hash, const uint64_t salt)
+{
+	uint64_t ret = 0, lesalt = htole64(salt);
+	uchar buf[40], digest[32];
+
+	memcpy(buf, &lesalt, 8);
+	memcpy(buf + 8, hash, 32);
+	sha256(buf, 40, digest);
+	memcpy(&ret, digest, SHORTID_LEN);
+	return ret;
+}
+
+/* Hex may be part of a longer string of short txids */
+static bool shortid_hex(uint64_t *shortid, const char *hex)
+{
+	char buf[SHORTID_LEN * 2 + 1];
+
+	memcpy(buf, hex, SHORTID_LEN * 2);
+	buf[SHORTID_LEN * 2] = '\0';
+	*shortid = 0;
+	return hex2bin(shortid, buf, SHORTID_LEN);
+}
+
+static int shortid_cmp(const void *a, const void *b)
+{
+	const uint64_t *sa = a, *sb = b;
+
+	if (*sa == *sb)
+		return 0;
+	return *sa < *sb ? -1 : 1;
+}
+
+/* Copy of a workinfo with its txids replaced by short txids for compact
+ * remotes, or NULL if it has no transactions to shorten. The short txids are
+ * of the txn table keys the remote matches them against, the wtxids of a local
+ * template or the hashes a remote workinfo was rebuilt from. */
+static json_t *compact_workinfo(const sdata_t *sdata, const json_t *wb_val, const workbase_t *wb)
+{
+	char hash[68] = {}, *shorts;
+	json_t *val;
+	int i;
+
+	if (!wb->txns || !wb->txn_hashes || (int)strlen(wb->txn_hashes) < wb->txns * 65)
+		return NULL;
+	shorts = ckalloc(wb->txns * SHORTID_LEN * 2 + 1);
+	for (i = 0; i < wb->txns; i++) {
+		uchar binhash[32];
+		uint64_t shortid;
+
+		if (wb->wtxidbin)
+			memcpy(binhash, wb->wtxidbin + 32 * i, 32);
+		else {
+			memcpy(hash, wb->txn_hashes + i * 65, 64);
+			if (unlikely(!txn_hex_hash(binhash, hash))) {
+				free(shorts);
+				return NULL;
+			}
+		}
+		shortid = txn_shortid(binhash, sdata->txn_salt);
+		__bin2hex(shorts + i * SHORTID_LEN * 2, &shortid, SHORTID_LEN);
+	}
+	val = json_deep_copy(wb_val);
+	json_object_del(val, "txn_hashes");
+	json_set_int64(val, "txn_salt", sdata->txn_salt);
+	json_set_string(val, "txn_short", shorts);
+	free(shorts);
+	return val;
+}
+
+static json_t *node_workinfo(const workbase_t *wb)
+{
+	json_t *wb_val = json_object();
 
 	json_set_int(wb_val, "jobid", wb->mapped_id);
 	json_set_string(wb_val, "target", wb->target);
@@ -937,13 +1133,25 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	json_set_int(wb_val, "coinb1len", wb->coinb1len);
 	json_set_int(wb_val, "coinb2len", wb->coinb2len);
 	json_set_string(wb_val, "coinb2", wb->coinb2);
+	return wb_val;
+}
+
+static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
+{
+	json_t *wb_val, *compact_val = NULL;
+	stratum_instance_t *client;
+	ckmsg_t *bulk_send = NULL;
+	int messages = 0;
+
+	wb_val = node_workinfo(wb);
 
 	ck_rlock(&sdata->instance_lock);
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
-		json_t *json_msg = json_deep_copy(wb_val);
+		json_t *json_msg;
 
+		json_msg = json_deep_copy(wb_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
@@ -956,8 +1164,16 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
-		json_t *json_msg = json_deep_copy(wb_val);
+		json_t *json_msg;
 
+		/* A local template's new transactions aren't in our table
+		 * for compact remotes to request until update_txns, so
+		 * block_update sends them theirs after */
+		if (client->compact && wb->wtxidbin)
+			continue;
+		if (client->compact && !compact_val)
+			compact_val = compact_workinfo(sdata, wb_val, wb);
+		json_msg = json_deep_copy(client->compact && compact_val ? compact_val : wb_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
@@ -973,6 +1189,8 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		upstream_msgtype(ckp, wb_val, SM_WORKINFO);
 
 	json_decref(wb_val);
+	if (compact_val)
+		json_decref(compact_val);
 
 	if (bulk_send) {
 		LOGINFO("Sending workinfo to mining nodes");
@@ -980,6 +1198,47 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	}
 }
 
+static void send_compact_workinfo(sdata_t *sdata, const workbase_t *wb)
+{
+	json_t *wb_val, *compact_val = NULL;
+	stratum_instance_t *client;
+	ckmsg_t *bulk_send = NULL;
+	int messages = 0;
+
+	wb_val = node_workinfo(wb);
+
+	ck_rlock(&sdata->instance_lock);
+	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
+		ckmsg_t *client_msg;
+		smsg_t *msg;
+		json_t *json_msg;
+
+		if (!client->compact)
+			continue;
+		if (!compact_val)
+			compact_val = compact_workinfo(sdata, wb_val, wb);
+		json_msg = json_deep_copy(compact_val ? compact_val : wb_val);
+		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
+		client_msg = ckalloc(sizeof(ckmsg_t));
+		msg = ckzalloc(sizeof(smsg_t));
+		msg->json_msg = json_msg;
+		msg->client_id = client->id;
+		client_msg->data = msg;
+		DL_APPEND(bulk_send, client_msg);
+		messages++;
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	json_decref(wb_val);
+	if (compact_val)
+		json_decref(compact_val);
+
+	if (bulk_send) {
+		LOGINFO("Sending compact workinfo to %d remote servers", messages);
+		ssend_bulk_append(sdata, bulk_send, messages);
+	}
+}
+
 static json_t *generate_workinfo(ckpool_t *ckp, const workbase_t *wb, const char *func)
 {
 	char cdfield[64];
@@ -1162,10 +1421,50 @@ static void submit_transaction(ckpool_t *ckp, const char *hash)
 	free(buf);
 }
 
+/* Transaction hashes are kept in binary in block byte order and only shown in
+ * hex in the reversed order bitcoind uses. */
+/* Create a txn table entry with the raw transaction from len hex chars, which
+ * need not be null terminated. */
+static txntable_t *new_txn(const uchar *hash, const char *data, const int len)
+{
+	txntable_t *txn = ckzalloc(sizeof(txntable_t) + len / 2);
+	int i, nibble1, nibble2;
+
+	if (unlikely(!len || len % 2))
+		goto invalid;
+	for (i = 0; i < len / 2; i++) {
+		nibble1 = hex2bin_tbl[(uchar)data[i * 2]];
+		nibble2 = hex2bin_tbl[(uchar)data[i * 2 + 1]];
+		if (unlikely(nibble1 < 0 || nibble2 < 0))
+			goto invalid;
+		txn->data[i] = (nibble1 << 4) | nibble2;
+	}
+	memcpy(txn->hash, hash, 32);
+	txn->len = len / 2;
+	return txn;
+invalid:
+	LOGWARNING("Invalid transaction data of length %d", len);
+	free(txn);
+	return NULL;
+}
+
+/* Hash and hex data of a transaction as sent to nodes and remotes */
+static json_t *txn_json(const txntable_t *txn)
+{
+	char hash[68], *data;
+	json_t *val;
+
+	txn_hash_hex(hash, txn->hash);
+	data = bin2hex(txn->data, txn->len);
+	JSON_CPACK(val, "{ss,ss}", "hash", hash, "data", data);
+	free(data);
+	return val;
+}
+
 /* Build a hashlist of all transactions, allowing us to compare with the list of
  * existing transactions to determine which need to be propagated */
-static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data, bool local)
+static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const uchar *hash,
+		    const char *data, const int len, bool local)
 {
 	bool found = false;
 	txntable_t *txn;
@@ -1173,7 +1472,7 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 	/* Look for transactions we already know about and increment their
 	 * refcount if we're still using them. */
 	ck_wlock(&sdata->txn_lock);
-	HASH_FIND_STR(sdata->txns, hash, txn);
+	HASH_FIND(hh, sdata->txns, hash, 32, txn);
 	if (txn) {
 		/* If we already have this in our transaction table but haven't
 		 * seen it in a while, it is reappearing in work and we should
@@ -1185,34 +1484,45 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 		else if (txn->refcount < REFCOUNT_LOCAL)
 			txn->refcount = REFCOUNT_LOCAL;
 		txn->seen = true;
+		if (local && !txn->intemplate) {
+			txn->intemplate = true;
+			DL_DELETE(sdata->ageing_txns, txn);
+		}
 	}
 	ck_wunlock(&sdata->txn_lock);
 
 	if (found)
 		return false;
 
-	txn = ckzalloc(sizeof(txntable_t));
-	memcpy(txn->hash, hash, 65);
 	if (local)
-		txn->data = strdup(data);
+		txn = new_txn(hash, data, len);
 	else {
+		char hexhash[68], *localdata;
+
 		/* Get the data from our local bitcoind as a way of confirming it
 		 * already knows about this transaction. */
-		txn->data = generator_get_txn(ckp, hash);
-		if (!txn->data) {
+		txn_hash_hex(hexhash, hash);
+		localdata = generator_get_txn(ckp, hexhash);
+		if (localdata) {
+			txn = new_txn(hash, localdata, strlen(localdata));
+			free(localdata);
+		} else {
 			/* If our local bitcoind hasn't seen this transaction,
 			 * submit it for mempools to be ~synchronised */
 			submit_transaction(ckp, data);
-			txn->data = strdup(data);
+			txn = new_txn(hash, data, len);
 		}
 	}
+	if (unlikely(!txn))
+		return false;
 
 	txn->seen = true;
+	txn->intemplate = local;
 	if (!local || ckp->node)
 		txn->refcount = REFCOUNT_REMOTE;
 	else
 		txn->refcount = REFCOUNT_LOCAL;
-	HASH_ADD_STR(*txns, hash, txn);
+	HASH_ADD(hh, *txns, hash, 32, txn);
 
 	return true;
 }
@@ -1239,6 +1549,10 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 		messages++;
 	}
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
+		/* Compact remotes have their own bitcoind and fetch only the
+		 * transactions they miss */
+		if (client->compact)
+			continue;
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_TRANSACTIONS]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
@@ -1270,24 +1584,50 @@ static void submit_transaction_array(ckpool_t *ckp, const json_t *arr)
 	}
 }
 
-static void clear_txn(txntable_t *txn)
+/* Whether any mining nodes or remotes need transactions propagated to them */
+static bool txn_recipients(ckpool_t *ckp, sdata_t *sdata)
 {
-	free(txn->data);
-	free(txn);
+	bool ret;
+
+	if (ckp->remote)
+		return true;
+	ck_rlock(&sdata->instance_lock);
+	ret = sdata->node_instances || sdata->remote_instances;
+	ck_runlock(&sdata->instance_lock);
+	return ret;
 }
 
-static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool local)
+/* Txns are the new transactions and removed are those that have dropped out
+ * of the local template since the last update, if any. Only transactions not
+ * in the local template are aged so this is proportional to the changes. */
+static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, txid_entry_t *removed,
+			bool local)
 {
-	json_t *val, *txn_array = json_array(), *purged_txns = json_array();
+	json_t *val, *txn_array = NULL, *purged_txns = NULL;
 	int added = 0, purged = 0;
+	txid_entry_t *entry, *tmpe;
 	txntable_t *tmp, *tmpa;
 
+	/* Hex is only generated for those that will use it */
+	if (txns && txn_recipients(ckp, sdata))
+		txn_array = json_array();
+	if (ckp->nodeservers)
+		purged_txns = json_array();
+
+	ck_wlock(&sdata->txn_lock);
+	/* Transactions no longer in the template start ageing */
+	HASH_ITER(hh, removed, entry, tmpe) {
+		HASH_DEL(removed, entry);
+		HASH_FIND(hh, sdata->txns, entry->wtxid, 32, tmp);
+		if (tmp && tmp->intemplate) {
+			tmp->intemplate = false;
+			DL_APPEND(sdata->ageing_txns, tmp);
+		}
+		free(entry);
+	}
 	/* Find which transactions have their refcount decremented to zero
 	 * and remove them. */
-	ck_wlock(&sdata->txn_lock);
-	HASH_ITER(hh, sdata->txns, tmp, tmpa) {
-		json_t *txn_val;
-
+	DL_FOREACH_SAFE(sdata->ageing_txns, tmp, tmpa) {
 		if (tmp->seen) {
 			tmp->seen = false;
 			continue;
@@ -1295,51 +1635,63 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 		if (tmp->refcount-- > 0)
 			continue;
 		HASH_DEL(sdata->txns, tmp);
-		txn_val = json_string(tmp->data);
-		json_array_append_new(purged_txns, txn_val);
-		clear_txn(tmp);
+		DL_DELETE(sdata->ageing_txns, tmp);
+		if (purged_txns) {
+			char *data = bin2hex(tmp->data, tmp->len);
+
+			json_array_append_new(purged_txns, json_string(data));
+			free(data);
+		}
+		free(tmp);
 		purged++;
 	}
 	/* Add the new transactions to the transaction table */
 	HASH_ITER(hh, txns, tmp, tmpa) {
 		txntable_t *found;
-		json_t *txn_val;
 
 		HASH_DEL(txns, tmp);
 		/* Propagate transaction here */
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
-		json_array_append_new(txn_array, txn_val);
+		if (txn_array)
+			json_array_append_new(txn_array, txn_json(tmp));
 
 		/* Check one last time this txn hasn't already been added in the
 		 * interim. This can happen in add_txn intentionally for a
 		 * transaction that has reappeared. */
-		HASH_FIND_STR(sdata->txns, tmp->hash, found);
+		HASH_FIND(hh, sdata->txns, tmp->hash, 32, found);
 		if (found) {
-			clear_txn(tmp);
+			if (tmp->intemplate && !found->intemplate) {
+				found->intemplate = true;
+				DL_DELETE(sdata->ageing_txns, found);
+			}
+			free(tmp);
 			continue;
 		}
 
 		/* Move to the sdata transaction table */
-		HASH_ADD_STR(sdata->txns, hash, tmp);
+		HASH_ADD(hh, sdata->txns, hash, 32, tmp);
+		if (!tmp->intemplate)
+			DL_APPEND(sdata->ageing_txns, tmp);
 		sdata->txns_generated++;
 		added++;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
-	if (added) {
+	if (added && txn_array) {
 		JSON_CPACK(val, "{so}", "transaction", txn_array);
 		send_node_transactions(ckp, sdata, val);
 		json_decref(val);
-	} else
+	} else if (txn_array)
 		json_decref(txn_array);
 
 	/* Submit transactions to bitcoind again when we're purging them in
 	 * case they've been removed from its mempool as well and we need them
 	 * again in the future for a remote workinfo that hasn't forgotten
 	 * about them. */
-	if (purged && ckp->nodeservers)
-		submit_transaction_array(ckp, purged_txns);
-	json_decref(purged_txns);
+	if (purged_txns) {
+		if (purged)
+			submit_transaction_array(ckp, purged_txns);
+		json_decref(purged_txns);
+	}
 
 	if (added || purged) {
 		LOGINFO("Stratifier added %d %stransactions and purged %d", added,
@@ -1347,22 +1699,222 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 	}
 }
 
+/* Generate the stratum merkle branches from hashbin, which holds a zeroed
+ * coinbase placeholder followed by the binary txids with room for one more. */
+static void wb_merkle_bins(workbase_t *wb, uchar *hashbin)
+{
+	int count = wb->txns + 1;
+	uchar *level, *next;
+
+	wb->merkles = 0;
+	wb->merkle_array = json_array();
+	if (count < 2)
+		return;
+	/* Each level is built into the other buffer from the one below */
+	level = hashbin;
+	next = ckalloc((count + 1) / 2 * 32 + 32);
+	while (count > 1) {
+		uchar *swap;
+
+		memcpy(&wb->merklebin[wb->merkles][0], level + 32, 32);
+		__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
+		LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
+		wb->merkles++;
+		if (count % 2) {
+			memcpy(level + count * 32, level + count * 32 - 32, 32);
+			count++;
+		}
+		/* The coinbase pair is never hashed so its parent is a placeholder */
+		sha256d_pairs(level + 64, next + 32, count / 2 - 1, NULL);
+		swap = level;
+		level = next;
+		next = swap;
+		count /= 2;
+	}
+	free(level == hashbin ? next : level);
+}
+
+static void clear_merkle_tree(merkle_tree_t *tree)
+{
+	if (!tree)
+		return;
+	HASH_CLEAR(hh, tree->memos);
+	free(tree->memo_array);
+	free(tree->nodes);
+	free(tree);
+}
+
+/* Generate the merkle branches of a local template keeping every level of the
+ * tree. Any pair of hashes also found in the previous template's tree reuses
+ * its parent instead of hashing it again. */
+static void wb_merkle_tree(sdata_t *sdata, workbase_t *wb, int *reused, int *hashed)
+{
+	merkle_tree_t *old = sdata->merkle_tree, *tree;
+	int i, count = wb->txns + 1, nodes, memos = 0;
+	uchar *level, *done;
+
+	/* Each level is padded to an even count so this is always enough */
+	nodes = count * 2 + 64;
+	tree = ckalloc(sizeof(merkle_tree_t));
+	tree->nodes = ckalloc(nodes * 32);
+	tree->memo_array = ckalloc(sizeof(merkle_memo_t) * (nodes / 2));
+	tree->memos = NULL;
+	done = ckalloc(count / 2 + 1);
+	level = tree->nodes;
+	memset(level, 0, 32);
+	if (wb->txns)
+		memcpy(level + 32, wb->txidbin, wb->txns * 32);
+
+	wb->merkles = 0;
+	wb->merkle_array = json_array();
+	while (count > 1) {
+		uchar *next;
+
+		memcpy(&wb->merklebin[wb->merkles][0], level + 32, 32);
+		__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
+		LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
+		wb->merkles++;
+		if (count % 2) {
+			memcpy(level + count * 32, level + count * 32 - 32, 32);
+			count++;
+		}
+		/* The coinbase pair is never hashed so its parent is a placeholder */
+		next = level + count * 32;
+		memset(next, 0, 32);
+		for (i = 1; i < count / 2; i++) {
+			uchar *pair = level + i * 64;
+			merkle_memo_t *memo = NULL;
+
+			if (old)
+				HASH_FIND(hh, old->memos, pair, 32, memo);
+			done[i] = memo && !memcmp(memo->pair + 32, pair + 32, 32);
+			if (done[i]) {
+				memcpy(next + i * 32, memo->hash, 32);
+				(*reused)++;
+			} else
+				(*hashed)++;
+		}
+		/* Only the pairs not found in the old tree are hashed */
+		sha256d_pairs(level + 64, next + 32, count / 2 - 1, done + 1);
+		for (i = 1; i < count / 2; i++) {
+			uchar *pair = level + i * 64, *parent = next + i * 32;
+			merkle_memo_t *memo = &tree->memo_array[memos++];
+
+			memo->pair = pair;
+			memo->hash = parent;
+			HASH_ADD_KEYPTR(hh, tree->memos, memo->pair, 32, memo);
+		}
+		level = next;
+		count /= 2;
+	}
+	free(done);
+	clear_merkle_tree(old);
+	sdata->merkle_tree = tree;
+}
+
+/* Add the transactions parsed from a local block template to a hashlist and
+ * generate the merkle branches straight from their binary txids. Transactions
+ * already in the previous template are found by txid and reused as is, while
+ * those that have since dropped out are returned in removed. */
+static txntable_t *wb_local_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
+				 txid_entry_t **removed)
+{
+	int i, cached = 0, reused = 0, hashed = 0;
+	txid_entry_t *entry, *tmp;
+	int64_t generation;
+	txntable_t *txns = NULL;
+	tv_t start, end;
+
+	tv_time(&start);
+	generation = ++sdata->txid_generation;
+	wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
+	for (i = 0; i < wb->txns; i++) {
+		const uchar *txid = wb->txidbin + 32 * i, *wtxid = wb->wtxidbin + 32 * i;
+
+		HASH_FIND(hh, sdata->txid_cache, txid, 32, entry);
+		if (entry && unlikely(memcmp(entry->wtxid, wtxid, 32))) {
+			/* Same transaction with a different witness */
+			HASH_DEL(sdata->txid_cache, entry);
+			HASH_ADD(hh, *removed, txid, 32, entry);
+			entry = NULL;
+		}
+		if (entry)
+			cached++;
+		else {
+			entry = ckalloc(sizeof(txid_entry_t));
+			memcpy(entry->txid, txid, 32);
+			memcpy(entry->wtxid, wtxid, 32);
+			txn_hash_hex(entry->txidhex, txid);
+			HASH_ADD(hh, sdata->txid_cache, txid, 32, entry);
+			add_txn(ckp, sdata, &txns, wtxid, wb->txn_data + wb->txn_ofs[i],
+				wb->txn_ofs[i + 1] - wb->txn_ofs[i], true);
+		}
+		entry->generation = generation;
+		memcpy(wb->txn_hashes + i * 65, entry->txidhex, 64);
+		wb->txn_hashes[i * 65 + 64] = ' ';
+	}
+	HASH_ITER(hh, sdata->txid_cache, entry, tmp) {
+		if (entry->generation == generation)
+			continue;
+		HASH_DEL(sdata->txid_cache, entry);
+		HASH_ADD(hh, *removed, txid, 32, entry);
+	}
+	wb_merkle_tree(sdata, wb, &reused, &hashed);
+	tv_time(&end);
+	LOGNOTICE("Stored local workbase with %d transactions", wb->txns);
+	LOGINFO("Reused %d/%d transactions and %d/%d merkle hashes in %.1fms", cached,
+		wb->txns, reused, reused + hashed, tvdiff(&end, &start) * 1000);
+	return txns;
+}
+
+/* A getblocktemplatelight workbase comes with its merkle branches already
+ * calculated, as hex in the byte order stratum uses, and no transactions. */
+static bool wb_light_merkles(workbase_t *wb)
+{
+	json_t *merkle_array = json_object_get(wb->json, "merkle");
+	int i, merkles = json_array_size(merkle_array);
+
+	if (unlikely(merkles > 16)) {
+		LOGWARNING("Too many merkle branches %d in light template", merkles);
+		return false;
+	}
+	wb->merkles = 0;
+	wb->txns = 0;
+	wb->txn_hashes = ckzalloc(1);
+	wb->merkle_array = json_array();
+	for (i = 0; i < merkles; i++) {
+		const char *merkle = json_string_value(json_array_get(merkle_array, i));
+
+		if (unlikely(!merkle || strlen(merkle) != 64 ||
+			     !hex2bin(&wb->merklebin[i][0], merkle, 32))) {
+			LOGWARNING("Invalid merkle branch %d in light template", i);
+			return false;
+		}
+		memcpy(&wb->merklehash[i][0], merkle, 65);
+		json_array_append_new(wb->merkle_array, json_string(merkle));
+		wb->merkles++;
+	}
+	LOGNOTICE("Stored light workbase job %s with %d merkle branches", wb->job_id,
+		  wb->merkles);
+	return true;
+}
+
 /* Distill down a set of transactions into an efficient tree arrangement for
  * stratum messages and fast work assembly. */
 static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
 				      json_t *txn_array, bool local)
 {
-	int i, j, binleft, binlen;
 	txntable_t *txns = NULL;
 	json_t *arr_val;
 	uchar *hashbin;
+	int i;
 
 	wb->txns = json_array_size(txn_array);
 	wb->merkles = 0;
-	binlen = wb->txns * 32 + 32;
-	hashbin = alloca(binlen + 32);
+	hashbin = ckalloc(wb->txns * 32 + 64);
 	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
 	if (wb->txns) {
 		int len = 1, ofs = 0;
 		const char *txn;
@@ -1383,7 +1935,7 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 
 		for (i = 0; i < wb->txns; i++) {
 			const char *txid, *hash;
-			char binswap[32];
+			uchar binhash[32];
 
 			arr_val = json_array_get(txn_array, i);
 
@@ -1396,44 +1948,25 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 				LOGERR("Missing txid for transaction in wb_merkle_bins");
 				goto out;
 			}
+			if (!txn_hex_hash(hashbin + 32 + 32 * i, txid) ||
+			    !txn_hex_hash(binhash, hash ? hash : txid)) {
+				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
+				goto out;
+			}
 			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn, local);
 			len = strlen(txn);
+			add_txn(ckp, sdata, &txns, binhash, txn, len, local);
 			memcpy(wb->txn_data + ofs, txn, len);
 			ofs += len;
-			if (!hex2bin(binswap, txid, 32)) {
-				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				goto out;
-			}
 			memcpy(wb->txn_hashes + i * 65, txid, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
 		}
 	} else
 		wb->txn_hashes = ckzalloc(1);
-	wb->merkle_array = json_array();
-	if (binleft > 1) {
-		while (42) {
-			if (binleft == 1)
-				break;
-			memcpy(&wb->merklebin[wb->merkles][0], hashbin + 32, 32);
-			__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
-			json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
-			LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
-			wb->merkles++;
-			if (binleft % 2) {
-				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
-			binleft /= 2;
-			binlen = binleft * 32;
-		}
-	}
+	wb_merkle_bins(wb, hashbin);
 	LOGNOTICE("Stored %s workbase with %d transactions", local ? "local" : "remote",
 		  wb->txns);
 out:
+	free(hashbin);
 	return txns;
 }
 
@@ -1442,44 +1975,30 @@ static const int witness_nonce_size = sizeof(witness_nonce);
 static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
 static const int witness_header_size = sizeof(witness_header);
 
-static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
+static void gbt_witness_data(workbase_t *wb)
 {
-	int i, binlen, txncount = json_array_size(txn_array);
-	const char* hash;
-	json_t *arr_val;
-	uchar *hashbin;
+	int txncount = wb->txns;
+	uchar *hashbin, *next;
 
-	binlen = txncount * 32 + 32;
-	hashbin = alloca(binlen + 32);
+	hashbin = ckalloc(txncount * 32 + 64);
+	next = ckalloc((txncount + 2) / 2 * 32 + 32);
 	memset(hashbin, 0, 32);
-
-	for (i = 0; i < txncount; i++) {
-		char binswap[32];
-
-		arr_val = json_array_get(txn_array, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			LOGERR("Hash missing for transaction");
-			return;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			LOGERR("Failed to hex2bin hash in gbt_witness_data");
-			return;
-		}
-		bswap_256(hashbin + 32 + 32 * i, binswap);
-	}
+	if (txncount)
+		memcpy(hashbin + 32, wb->wtxidbin, txncount * 32);
 
 	// Build merkle root (copied from libblkmaker)
 	for (txncount++ ; txncount > 1 ; txncount /= 2) {
+		uchar *swap;
+
 		if (txncount % 2) {
 			// Odd number, duplicate the last
 			memcpy(hashbin + 32 * txncount, hashbin + 32 * (txncount - 1), 32);
 			txncount++;
 		}
-		for (i = 0; i < txncount; i += 2) {
-			// We overlap input and output here, on the first pair
-			gen_hash(hashbin + 32 * i, hashbin + 32 * (i / 2), 64);
-		}
+		sha256d_pairs(hashbin, next, txncount / 2, NULL);
+		swap = hashbin;
+		hashbin = next;
+		next = swap;
 	}
 
 	memcpy(hashbin + 32, &witness_nonce, witness_nonce_size);
@@ -1487,6 +2006,87 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 	memcpy(hashbin, witness_header, witness_header_size);
 	__bin2hex(wb->witnessdata, hashbin, 32 + witness_header_size);
 	wb->insert_witness = true;
+	free(hashbin);
+	free(next);
+}
+
+#define HALVING_INTERVAL 210000
+
+/* The block subsidy without fees at height, capped by the coinbasevalue of a
+ * template for it since that may include fees */
+static int64_t block_subsidy(const int height, const uint64_t coinbasevalue)
+{
+	int64_t subsidy;
+	int halvings;
+
+	halvings = height / HALVING_INTERVAL;
+	if (halvings >= 64)
+		return 0;
+	subsidy = 5000000000ll >> halvings;
+	return MIN(subsidy, (int64_t)coinbasevalue);
+}
+
+/* Switch miners straight to a coinbase only workbase on top of a newly
+ * notified block instead of leaving them on the old block until the full
+ * template has been fetched and processed. The bits and height of the new
+ * block are taken from a light template on top of it since they can't be
+ * derived from the current workbase across retargets or reorgs, and there is
+ * no empty switch if they can't be had. The full template follows as a non
+ * clean update. */
+static void empty_update(ckpool_t *ckp, sdata_t *sdata)
+{
+	char hash[68], bin[32], swap[32];
+	bool new_block = false;
+	workbase_t *wb, *cur;
+	tv_t now;
+
+	ck_rlock(&sdata->workbase_lock);
+	cur = sdata->current_workbase;
+	strcpy(hash, sdata->notifyhash);
+	if (!cur || !hash[0] || !strcmp(hash, sdata->lastswaphash) || cur->proxy) {
+		ck_runlock(&sdata->workbase_lock);
+		return;
+	}
+	ck_runlock(&sdata->workbase_lock);
+
+	wb = ckzalloc(sizeof(workbase_t));
+	if (!generator_get_nexthead(ckp, hash, wb)) {
+		dealloc(wb);
+		return;
+	}
+	wb->coinbasevalue = block_subsidy(wb->height, wb->coinbasevalue);
+	wb->curtime = MAX((uint32_t)time(NULL), wb->curtime);
+
+	/* Block_update is serialised so cur can't be aged away under us */
+	ck_rlock(&sdata->workbase_lock);
+	wb->flags = strdup(cur->flags);
+	wb->insert_witness = cur->insert_witness;
+	ck_runlock(&sdata->workbase_lock);
+
+	wb->ckp = ckp;
+	hex2bin(bin, hash, 32);
+	swap_256(swap, bin);
+	__bin2hex(wb->prevhash, swap, 32);
+	snprintf(wb->ntime, 9, "%08x", wb->curtime);
+	wb->ntime32 = wb->curtime;
+	wb->txn_hashes = ckzalloc(1);
+	wb->merkle_array = json_array();
+	if (wb->insert_witness)
+		gbt_witness_data(wb);
+	generate_coinbase(ckp, wb);
+
+	add_base(ckp, sdata, wb, &new_block);
+	if (ckp->btcsolo)
+		stratum_broadcast_updates(sdata, true);
+	else
+		stratum_broadcast_update(sdata, wb, true);
+
+	tv_time(&now);
+	ck_wlock(&sdata->workbase_lock);
+	sdata->emptyswitch_latency = tvdiff(&now, &sdata->blocknotify_time);
+	ck_wunlock(&sdata->workbase_lock);
+	LOGNOTICE("Block hash changed to %s, sent empty workbase height %d in %.3fs",
+		  sdata->lastswaphash, wb->height, sdata->emptyswitch_latency);
 }
 
 /* This function assumes it will only receive a valid json gbt base template
@@ -1496,17 +2096,24 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 static void block_update(ckpool_t *ckp, int *prio)
 {
 	bool new_block = false, ret = false;
+	txid_entry_t *removed = NULL;
 	const char *witnessdata_check;
 	sdata_t *sdata = ckp->sdata;
-	json_t *txn_array;
-	txntable_t *txns;
+	txntable_t *txns = NULL;
+	workbase_t *wb = NULL;
 	int retries = 0;
-	workbase_t *wb;
+	tv_t now;
 
+	/* A long poll has already fetched the full template */
+	if (*prio == GEN_LONGPOLL)
+		wb = generator_getlongpoll(ckp);
+	else
+		empty_update(ckp, sdata);
 retry:
-	wb = generator_getbase(ckp);
+	if (!wb)
+		wb = generator_getbase(ckp);
 	if (unlikely(!wb)) {
-		if (retries++ < 5 || *prio == GEN_PRIORITY) {
+		if (retries++ < 5 || *prio >= GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
 			/* Brief delay to allow failover to complete */
 			cksleep_ms(100);
@@ -1520,19 +2127,31 @@ retry:
 
 	wb->ckp = ckp;
 
-	txn_array = json_object_get(wb->json, "transactions");
-	txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, true);
+	if (wb->job_id) {
+		if (unlikely(!wb_light_merkles(wb))) {
+			clear_workbase(ckp, wb);
+			goto out;
+		}
+		/* Nothing from earlier templates is in a light one */
+		removed = sdata->txid_cache;
+		sdata->txid_cache = NULL;
+	} else
+		txns = wb_local_txns(ckp, sdata, wb, &removed);
 
 	wb->insert_witness = false;
 
 	witnessdata_check = json_string_value(json_object_get(wb->json, "default_witness_commitment"));
 	if (likely(witnessdata_check)) {
 		LOGDEBUG("Default witness commitment present, adding witness data");
-		gbt_witness_data(wb, txn_array);
+		gbt_witness_data(wb);
 		// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
 		if (wb->insert_witness && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
 			LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
 	}
+	/* The binary hashes are only needed to build the workbase, and the
+	 * wtxids to key the short txids sent to compact remotes */
+	dealloc(wb->txidbin);
+	dealloc(wb->txn_ofs);
 
 	generate_coinbase(ckp, wb);
 
@@ -1546,10 +2165,23 @@ retry:
 		stratum_broadcast_update(sdata, wb, new_block);
 	ret = true;
 	LOGINFO("Broadcast updated stratum base");
+	ck_wlock(&sdata->workbase_lock);
+	if (sdata->fullwork_pending && !strcmp(sdata->notifyhash, sdata->lastswaphash)) {
+		tv_time(&now);
+		sdata->fullswitch_latency = tvdiff(&now, &sdata->blocknotify_time);
+		sdata->fullwork_pending = false;
+		LOGNOTICE("Sent full workbase with %d transactions %.3fs after block change",
+			  wb->txns, sdata->fullswitch_latency);
+	}
+	ck_wunlock(&sdata->workbase_lock);
 	/* Update transactions after stratum broadcast to not delay
 	 * propagation. */
-	if (likely(txns))
-		update_txns(ckp, sdata, txns, true);
+	if (likely(txns || removed))
+		update_txns(ckp, sdata, txns, removed, true);
+	if (wb->wtxidbin) {
+		send_compact_workinfo(sdata, wb);
+		dealloc(wb->wtxidbin);
+	}
 	/* Reset the update time to avoid stacked low priority notifies. Bring
 	 * forward the next notify in case of a new block. */
 	sdata->update_time = time(NULL);
@@ -1614,12 +2246,13 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 }
 
 /* Find any transactions that are missing from our transaction table during
- * rebuild_txns by requesting their data from another server. */
-static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
+ * rebuild_txns by requesting their data from another server, by txid "hash"
+ * or by "short" txid. */
+static void request_txns(ckpool_t *ckp, sdata_t *sdata, const char *key, json_t *txns)
 {
 	json_t *val;
 
-	JSON_CPACK(val, "{so}", "hash", txns);
+	JSON_CPACK(val, "{so}", key, txns);
 	if (ckp->remote)
 		upstream_msgtype(ckp, val, SM_REQTXNS);
 	else if (ckp->node) {
@@ -1632,6 +2265,96 @@ static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
 	}
 }
 
+typedef struct shortid_slot shortid_slot_t;
+
+/* Sorted by shortid first for shortid_cmp */
+struct shortid_slot {
+	uint64_t shortid;
+	int index;
+};
+
+/* Rebuild the txids of a compact workinfo by matching its short txids against
+ * our own transaction table, requesting any we don't have. Returns the txids
+ * in txn_hashes form or NULL, setting missing if any are missing or ambiguous
+ * rather than invalid. */
+static char *expand_short_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val, const int txns,
+			       bool *missing_txids)
+{
+	const char *shorts = json_string_value(json_object_get(val, "txn_short"));
+	shortid_slot_t *slots = NULL;
+	char *ret = NULL, *matched;
+	int i, missing = 0;
+	txntable_t *txn, *tmp;
+	json_t *missing_txns;
+	uchar *found;
+	int64_t salt;
+
+	if (unlikely(!shorts || !json_get_int64(&salt, val, "txn_salt") ||
+		     (int)strlen(shorts) != txns * SHORTID_LEN * 2)) {
+		LOGWARNING("Invalid short txids in compact workinfo");
+		return NULL;
+	}
+	slots = ckalloc(sizeof(shortid_slot_t) * txns);
+	for (i = 0; i < txns; i++) {
+		if (unlikely(!shortid_hex(&slots[i].shortid, shorts + i * SHORTID_LEN * 2))) {
+			LOGWARNING("Invalid short txid in compact workinfo");
+			free(slots);
+			return NULL;
+		}
+		slots[i].index = i;
+	}
+	qsort(slots, txns, sizeof(shortid_slot_t), shortid_cmp);
+	found = ckalloc(txns * 32);
+	matched = ckzalloc(txns);
+
+	ck_rlock(&sdata->txn_lock);
+	HASH_ITER(hh, sdata->txns, txn, tmp) {
+		uint64_t shortid = txn_shortid(txn->hash, salt);
+		shortid_slot_t *slot;
+
+		slot = bsearch(&shortid, slots, txns, sizeof(shortid_slot_t), shortid_cmp);
+		if (likely(!slot))
+			continue;
+		while (slot > slots && slot[-1].shortid == shortid)
+			slot--;
+		/* Short txids matching more than one transaction are treated
+		 * as missing */
+		for (; slot < slots + txns && slot->shortid == shortid; slot++) {
+			matched[slot->index]++;
+			memcpy(found + slot->index * 32, txn->hash, 32);
+		}
+	}
+	ck_runlock(&sdata->txn_lock);
+
+	free(slots);
+	ret = ckalloc(txns * 65 + 1);
+	missing_txns = json_array();
+	for (i = 0; i < txns; i++) {
+		if (likely(matched[i] == 1)) {
+			txn_hash_hex(ret + i * 65, found + i * 32);
+			ret[i * 65 + 64] = ' ';
+			continue;
+		}
+		json_array_append_new(missing_txns, json_stringn(shorts + i * SHORTID_LEN * 2,
+								 SHORTID_LEN * 2));
+		missing++;
+	}
+	ret[txns * 65] = '\0';
+	free(found);
+	free(matched);
+
+	if (likely(!missing)) {
+		LOGDEBUG("Expanded %d short txids in compact workinfo", txns);
+		json_decref(missing_txns);
+		return ret;
+	}
+	LOGINFO("Missing %d of %d short txids in compact workinfo", missing, txns);
+	request_txns(ckp, sdata, "short", missing_txns);
+	*missing_txids = true;
+	free(ret);
+	return NULL;
+}
+
 /* Rebuilds transactions from txnhashes to be able to construct wb_merkle_bins
  * on remote workbases */
 static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
@@ -1663,18 +2386,23 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 
 	for (i = 0; i < wb->txns; i++) {
 		json_t *txn_val = NULL;
+		uchar binhash[32];
 		txntable_t *txn;
 		char *data;
 
 		memcpy(hash, hashes + i * 65, 64);
+		if (unlikely(!txn_hex_hash(binhash, hash))) {
+			LOGERR("Invalid transaction hash in rebuild_txns");
+			ret = false;
+			break;
+		}
 
 		ck_wlock(&sdata->txn_lock);
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		HASH_FIND(hh, sdata->txns, binhash, 32, txn);
 		if (likely(txn)) {
 			txn->refcount = REFCOUNT_REMOTE;
 			txn->seen = true;
-			JSON_CPACK(txn_val, "{ss,ss}",
-				   "hash", hash, "data", txn->data);
+			txn_val = txn_json(txn);
 			json_array_append_new(txn_array, txn_val);
 		}
 		ck_wunlock(&sdata->txn_lock);
@@ -1693,21 +2421,22 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* We've found it, let's add it to the table */
 		ck_wlock(&sdata->txn_lock);
 		/* One last check in case it got added while we dropped the lock */
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		HASH_FIND(hh, sdata->txns, binhash, 32, txn);
 		if (likely(!txn)) {
-			txn = ckzalloc(sizeof(txntable_t));
-			memcpy(txn->hash, hash, 65);
-			txn->data = data;
-			HASH_ADD_STR(sdata->txns, hash, txn);
-			sdata->txns_generated++;
-		} else {
-			free(data);
+			txn = new_txn(binhash, data, strlen(data));
+			if (likely(txn)) {
+				HASH_ADD(hh, sdata->txns, hash, 32, txn);
+				DL_APPEND(sdata->ageing_txns, txn);
+				sdata->txns_generated++;
+			}
 		}
-		txn->refcount = REFCOUNT_REMOTE;
-		txn->seen = true;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		free(data);
+		if (likely(txn)) {
+			txn->refcount = REFCOUNT_REMOTE;
+			txn->seen = true;
+			json_array_append_new(txn_array, txn_json(txn));
+		} else
+			ret = false;
 		ck_wunlock(&sdata->txn_lock);
 	}
 
@@ -1719,7 +2448,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		dealloc(wb->txn_hashes);
 		txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, false);
 		if (likely(txns))
-			update_txns(ckp, sdata, txns, false);
+			update_txns(ckp, sdata, txns, NULL, false);
 	} else {
 		if (!sdata->wbincomplete) {
 			sdata->wbincomplete = true;
@@ -1727,7 +2456,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 				LOGWARNING("Unable to rebuild transactions to create workinfo, ignore displayed hashrate");
 		}
 		LOGINFO("Failed to find all txns in rebuild_txns");
-		request_txns(ckp, sdata, missing_txns);
+		request_txns(ckp, sdata, "hash", missing_txns);
 	}
 
 	json_decref(txn_array);
@@ -1746,12 +2475,12 @@ static void __add_to_remote_workbases(sdata_t *sdata, workbase_t *wb)
 
 static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
+	json_t *val, *compact_val = NULL;
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
 	workbase_t *tmp, *tmpa;
 	int messages = 0;
 	int64_t skip;
-	json_t *val;
 
 	ts_realtime(&wb->gentime);
 
@@ -1803,7 +2532,9 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* Don't send remote workinfo back to the source remote */
 		if (client->id == wb->client_id)
 			continue;
-		json_msg = json_deep_copy(val);
+		if (client->compact && !compact_val)
+			compact_val = compact_workinfo(sdata, val, wb);
+		json_msg = json_deep_copy(client->compact && compact_val ? compact_val : val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
@@ -1834,6 +2565,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 	ck_runlock(&sdata->instance_lock);
 
 	json_decref(val);
+	if (compact_val)
+		json_decref(compact_val);
 
 	if (bulk_send) {
 		LOGINFO("Sending remote workinfo to %d other remote servers", messages);
@@ -1841,7 +2574,33 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 	}
 }
 
-static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t client_id)
+/* Hold a compact workinfo from a trusted server until more transactions
+ * arrive, keeping the time it was first held so it goes stale */
+static void hold_pending_workinfo(sdata_t *sdata, json_t *val, const int64_t client_id,
+				  const time_t added)
+{
+	pending_workinfo_t *pending = ckzalloc(sizeof(pending_workinfo_t)), *tmp, *tmpa;
+	time_t now = time(NULL);
+
+	pending->val = json_incref(val);
+	pending->client_id = client_id;
+	pending->added = added ? added : now;
+
+	ck_wlock(&sdata->txn_lock);
+	DL_FOREACH_SAFE(sdata->pending_workinfos, tmp, tmpa) {
+		if (tmp->added > now - PENDING_WORKINFO_AGE)
+			continue;
+		DL_DELETE(sdata->pending_workinfos, tmp);
+		json_decref(tmp->val);
+		free(tmp);
+	}
+	DL_APPEND(sdata->pending_workinfos, pending);
+	ck_wunlock(&sdata->txn_lock);
+}
+
+/* Added is when a retried workinfo was first held, zero for a new one */
+static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t client_id,
+			  const time_t added)
 {
 	workbase_t *wb = ckzalloc(sizeof(workbase_t));
 	sdata_t *sdata = ckp->sdata;
@@ -1870,7 +2629,22 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_strdup(&wb->flags, val, "flags");
 
 	json_intcpy(&wb->txns, val, "txns");
-	json_strdup(&wb->txn_hashes, val, "txn_hashes");
+	if (wb->txns && json_object_get(val, "txn_short")) {
+		bool missing = false;
+
+		/* Compact workinfos can't be used until we have all their
+		 * transactions so they're held until the ones requested
+		 * arrive. Only remotes take them, and their workbases are
+		 * looked up by id so it doesn't matter if they're late. */
+		wb->txn_hashes = expand_short_txns(ckp, sdata, val, wb->txns, &missing);
+		if (!wb->txn_hashes) {
+			if (missing && trusted)
+				hold_pending_workinfo(sdata, val, client_id, added);
+			clear_workbase(ckp, wb);
+			return;
+		}
+	} else
+		json_strdup(&wb->txn_hashes, val, "txn_hashes");
 	if (!ckp->proxy) {
 		/* This is a workbase from a trusted remote */
 		wb->merkle_array = json_object_dup(val, "merklehash");
@@ -1916,6 +2690,28 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
+/* Retry the held compact workinfos now that more transactions have arrived */
+static void retry_pending_workinfos(ckpool_t *ckp, sdata_t *sdata)
+{
+	pending_workinfo_t *pending, *tmp, *retries;
+	time_t now = time(NULL);
+
+	ck_wlock(&sdata->txn_lock);
+	retries = sdata->pending_workinfos;
+	sdata->pending_workinfos = NULL;
+	ck_wunlock(&sdata->txn_lock);
+
+	DL_FOREACH_SAFE(retries, pending, tmp) {
+		DL_DELETE(retries, pending);
+		if (pending->added > now - PENDING_WORKINFO_AGE)
+			add_node_base(ckp, pending->val, true, pending->client_id, pending->added);
+		else
+			LOGINFO("Dropping stale compact workinfo still missing transactions");
+		json_decref(pending->val);
+		free(pending);
+	}
+}
+
 /* Calculate share diff and fill in hash and swap. Need to hold workbase read count */
 static double
 share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
@@ -2057,21 +2853,21 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 	}
 }
 
-/* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
+/* Process a block into the header, transaction count and coinbase for the
+ * generator to submit, with the rest of the block already serialised in
+ * wb->txn_data. Must hold workbase readcount */
 static char *
 process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
 {
 	char *gbt_block, varint[12];
 	int txns = wb->txns + 1;
-	char hexcoinbase[1024];
 
 	flip_32(flip32, hash);
 	__bin2hex(blockhash, flip32, 32);
 
 	/* Message format: "data" */
-	gbt_block = ckzalloc(1024);
+	gbt_block = ckzalloc(160 + 10 + cblen * 2 + 1);
 	__bin2hex(gbt_block, data, 80);
 	if (txns < 0xfd) {
 		uint8_t val8 = txns;
@@ -2089,20 +2885,32 @@ process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 		__bin2hex(varint, (const unsigned char *)&val32, 4);
 	}
 	strcat(gbt_block, varint);
-	__bin2hex(hexcoinbase, coinbase, cblen);
-	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
+	__bin2hex(gbt_block + strlen(gbt_block), coinbase, cblen);
 	return gbt_block;
 }
 
-/* Submit block data locally, absorbing and freeing gbt_block */
-static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip32, int height)
+/* Submit block data locally, absorbing and freeing gbt_block. The rest of the
+ * block is sent straight from the workbase transactions, so this must hold a
+ * workbase readcount. Latency is measured from solve_tv when the share was
+ * found to be a block solve. */
+static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const workbase_t *wb,
+			       const uchar *flip32, tv_t *solve_tv)
 {
-	bool ret = generator_submitblock(ckp, gbt_block);
+	const char *txns = wb->txns && !wb->job_id ? wb->txn_data : NULL;
 	char heighthash[68] = {}, rhash[68] = {};
+	sdata_t *sdata = ckp->sdata;
+	int height = wb->height;
+	tv_t send_tv, submit_tv;
 	uchar swap256[32];
+	bool ret;
 
+	tv_time(&send_tv);
+	ret = generator_submitblock(ckp, gbt_block, txns, wb->job_id, wb->job_server);
+	tv_time(&submit_tv);
+	sdata->solvesend_latency = tvdiff(&send_tv, solve_tv);
+	sdata->solvesubmit_latency = tvdiff(&submit_tv, solve_tv);
+	LOGWARNING("Block solve sent %.3fms after solving, submitted %.3fms after solving",
+		   sdata->solvesend_latency * 1000, sdata->solvesubmit_latency * 1000);
 	free(gbt_block);
 	swap_256(swap256, flip32);
 	__bin2hex(rhash, swap256, 32);
@@ -2184,6 +2992,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 {
 	char *coinbase = NULL, *enonce1 = NULL, *nonce = NULL, *nonce2 = NULL, *gbt_block,
 		*coinbasehex, *swaphex;
+	tv_t solve_tv;
 	uchar *enonce1bin = NULL, hash[32], swap[80], flip32[32];
 	uint32_t ntime32, version_mask = 0;
 	char blockhash[68], cdfield[64];
@@ -2260,8 +3069,9 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 	}
 
 	/* Now we have enough to assemble a block */
+	tv_time(&solve_tv);
 	gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, gbt_block, wb, flip32, &solve_tv);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,si,ss,sI,sf,ss,ss,ss,ss}",
 			 "height", wb->height,
@@ -2314,11 +3124,59 @@ static void update_base(sdata_t *sdata, const int prio)
 	ckmsgq_add(sdata->updateq, uprio);
 }
 
+/* Record the best block hash from bitcoind for block_update to switch to
+ * before queueing the update */
+static void notify_blockhash(sdata_t *sdata, const char *hash, const int prio)
+{
+	ck_wlock(&sdata->workbase_lock);
+	if (strcmp(hash, sdata->notifyhash)) {
+		strcpy(sdata->notifyhash, hash);
+		tv_time(&sdata->blocknotify_time);
+		sdata->fullwork_pending = true;
+	}
+	ck_wunlock(&sdata->workbase_lock);
+	update_base(sdata, prio);
+}
+
+/* Find and take the lowest free enonce1var slot of a proxy's map, returning
+ * -1 if they are all bound. Enter holding instance_lock. */
+static int64_t __take_enonce1slot(proxy_t *proxy)
+{
+	int64_t words = (proxy->map_clients + 63) / 64, i, slot;
+
+	for (i = 0; i < words; i++) {
+		uint64_t unbound = ~proxy->enonce1map[i];
+
+		if (!unbound)
+			continue;
+		slot = i * 64 + __builtin_ctzll(unbound);
+		if (slot >= proxy->map_clients)
+			break;
+		proxy->enonce1map[i] |= 1ull << (slot % 64);
+		return slot;
+	}
+	return -1;
+}
+
+/* Enter holding instance_lock */
+static void __release_enonce1slot(proxy_t *proxy, const uint64_t slot)
+{
+	uint64_t bit = 1ull << (slot % 64);
+
+	if (!proxy->enonce1map || slot >= (uint64_t)proxy->map_clients)
+		return;
+	if (proxy->enonce1map[slot / 64] & bit) {
+		proxy->enonce1map[slot / 64] &= ~bit;
+		proxy->clients--;
+	}
+}
+
 /* Instead of removing the client instance, we add it to a list of recycled
  * clients allowing us to reuse it instead of callocing a new one */
 static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 {
 	if (client->proxy) {
+		__release_enonce1slot(client->proxy, le64toh(client->enonce1_64));
 		client->proxy->bound_clients--;
 		client->proxy->parent->combined_clients--;
 	}
@@ -2927,9 +3785,24 @@ static void update_subscribe(ckpool_t *ckp, const char *cmd)
 		proxy->enonce1varlen = 0;
 	proxy->enonce2varlen = proxy->nonce2len - proxy->enonce1varlen;
 	proxy->max_clients = 1ll << (proxy->enonce1varlen * 8);
-	proxy->clients = 0;
 	ck_wunlock(&dsdata->workbase_lock);
 
+	/* Track which enonce1var values are bound when there are few enough to
+	 * run out, so those of dropped clients can be reused. Keep the map of
+	 * clients still bound if the space hasn't changed. */
+	ck_wlock(&sdata->instance_lock);
+	if (proxy->max_clients > ENONCE1_MAP_MAX || proxy->map_clients != proxy->max_clients) {
+		free(proxy->enonce1map);
+		proxy->enonce1map = NULL;
+		proxy->map_clients = 0;
+		proxy->clients = 0;
+		if (proxy->max_clients <= ENONCE1_MAP_MAX) {
+			proxy->enonce1map = ckzalloc((proxy->max_clients + 63) / 64 * sizeof(uint64_t));
+			proxy->map_clients = proxy->max_clients;
+		}
+	}
+	ck_wunlock(&sdata->instance_lock);
+
 	if (subid) {
 		LOGINFO("Upstream pool %s %d:%d extranonce2 length %d, max proxy clients %"PRId64,
 			proxy->url, id, subid, proxy->nonce2len, proxy->max_clients);
@@ -3218,6 +4091,7 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 		ck_wunlock(&dsdata->workbase_lock);
 	}
 
+	free(proxy->enonce1map);
 	free(proxy->sdata);
 	free(proxy);
 }
@@ -3974,6 +4848,41 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	return buf;
 }
 
+/* Append pool share counters in prometheus text format to buf */
+void stratifier_metrics(ckpool_t *ckp, char **buf)
+{
+	sdata_t *sdata = ckp->sdata;
+	pool_stats_t *stats = &sdata->stats;
+	int64_t shares, diff_shares, rejects;
+	char *line;
+
+	mutex_lock(&sdata->stats_lock);
+	shares = stats->accounted_shares;
+	diff_shares = stats->accounted_diff_shares;
+	rejects = stats->accounted_rejects;
+	mutex_unlock(&sdata->stats_lock);
+
+	ASPRINTF(&line, "# TYPE ckpool_shares_accepted_total counter\n"
+		 "ckpool_shares_accepted_total %"PRId64"\n"
+		 "# TYPE ckpool_diff_accepted_total counter\n"
+		 "ckpool_diff_accepted_total %"PRId64"\n"
+		 "# TYPE ckpool_diff_rejected_total counter\n"
+		 "ckpool_diff_rejected_total %"PRId64"\n"
+		 "# TYPE ckpool_users gauge\nckpool_users %d\n"
+		 "# TYPE ckpool_workers gauge\nckpool_workers %d\n"
+		 "# TYPE ckpool_block_switch_seconds gauge\n"
+		 "ckpool_block_switch_seconds{work=\"empty\"} %.6f\n"
+		 "ckpool_block_switch_seconds{work=\"full\"} %.6f\n"
+		 "# TYPE ckpool_block_solve_seconds gauge\n"
+		 "ckpool_block_solve_seconds{stage=\"send\"} %.6f\n"
+		 "ckpool_block_solve_seconds{stage=\"submit\"} %.6f\n",
+		 shares, diff_shares, rejects, stats->users + stats->remote_users,
+		 stats->workers + stats->remote_workers, sdata->emptyswitch_latency,
+		 sdata->fullswitch_latency, sdata->solvesend_latency, sdata->solvesubmit_latency);
+	realloc_strcat(buf, line);
+	free(line);
+}
+
 /* Send a single client a reconnect request, setting the time we sent the
  * request so we can drop the client lazily if it hasn't reconnected on its
  * own more than one minute later if we call reconnect again */
@@ -4148,6 +5057,141 @@ out:
 	send_api_response(res, *sockd);
 }
 
+/* Store one per minute hashrate sample in a user or worker history ring,
+ * creating the ring on first use. */
+static void add_history(sdata_t *sdata, history_t **history, const time_t stamp,
+			const double dsps1, const double dsps5, const double dsps60)
+{
+	history_t *hist;
+
+	mutex_lock(&sdata->history_lock);
+	hist = *history;
+	if (unlikely(!hist))
+		hist = *history = ckzalloc(sizeof(history_t));
+	hist->stamp[hist->head] = stamp;
+	hist->dsps1[hist->head] = dsps1;
+	hist->dsps5[hist->head] = dsps5;
+	hist->dsps60[hist->head] = dsps60;
+	if (++hist->head >= HISTORY_SAMPLES)
+		hist->head = 0;
+	if (hist->count < HISTORY_SAMPLES)
+		hist->count++;
+	mutex_unlock(&sdata->history_lock);
+}
+
+/* Return an array of [time, dsps1, dsps5, dsps60] samples, oldest first, with
+ * a timestamp between from and to inclusive. */
+static json_t *history_range(sdata_t *sdata, history_t **history, const time_t from,
+			     const time_t to)
+{
+	json_t *arr = json_array();
+	history_t *hist;
+	int i, slot;
+
+	mutex_lock(&sdata->history_lock);
+	hist = *history;
+	if (!hist)
+		goto out;
+	slot = hist->head - hist->count;
+	if (slot < 0)
+		slot += HISTORY_SAMPLES;
+	for (i = 0; i < hist->count; i++) {
+		if (hist->stamp[slot] >= from && hist->stamp[slot] <= to) {
+			json_t *sample;
+
+			JSON_CPACK(sample, "[I,f,f,f]", (json_int_t)hist->stamp[slot],
+				   hist->dsps1[slot], hist->dsps5[slot], hist->dsps60[slot]);
+			json_array_append_new(arr, sample);
+		}
+		if (++slot >= HISTORY_SAMPLES)
+			slot = 0;
+	}
+out:
+	mutex_unlock(&sdata->history_lock);
+	return arr;
+}
+
+/* Optional from and to keys limit the range of samples returned */
+static void history_bounds(const json_t *val, time_t *from, time_t *to)
+{
+	int64_t tmp;
+
+	*from = 0;
+	*to = time(NULL);
+	if (json_get_int64(&tmp, val, "from"))
+		*from = tmp;
+	if (json_get_int64(&tmp, val, "to"))
+		*to = tmp;
+}
+
+static void userhistory(sdata_t *sdata, const char *buf, int *sockd)
+{
+	json_t *val = NULL, *res = NULL;
+	char *username = NULL;
+	user_instance_t *user;
+	json_error_t err_val;
+	time_t from, to;
+
+	val = json_loads(buf, 0, &err_val);
+	if (unlikely(!val)) {
+		res = json_encode_errormsg(&err_val);
+		goto out;
+	}
+	if (!json_get_string(&username, val, "user")) {
+		res = json_errormsg("Failed to find user key");
+		goto out;
+	}
+	if (!strlen(username)) {
+		res = json_errormsg("Zero length user key");
+		goto out;
+	}
+	history_bounds(val, &from, &to);
+	user = get_user(sdata, username);
+	JSON_CPACK(res, "{ss,si,so}", "user", username, "interval", 60,
+		   "history", history_range(sdata, &user->history, from, to));
+out:
+	if (val)
+		json_decref(val);
+	free(username);
+	send_api_response(res, *sockd);
+}
+
+static void workerhistory(sdata_t *sdata, const char *buf, int *sockd)
+{
+	char *tmp, *username, *workername = NULL;
+	json_t *val = NULL, *res = NULL;
+	worker_instance_t *worker;
+	user_instance_t *user;
+	json_error_t err_val;
+	time_t from, to;
+
+	val = json_loads(buf, 0, &err_val);
+	if (unlikely(!val)) {
+		res = json_encode_errormsg(&err_val);
+		goto out;
+	}
+	if (!json_get_string(&workername, val, "worker")) {
+		res = json_errormsg("Failed to find worker key");
+		goto out;
+	}
+	if (!strlen(workername)) {
+		res = json_errormsg("Zero length worker key");
+		goto out;
+	}
+	history_bounds(val, &from, &to);
+	tmp = strdupa(workername);
+	username = strsep(&tmp, "._");
+	user = get_user(sdata, username);
+	worker = get_worker(sdata, user, workername);
+	JSON_CPACK(res, "{ss,si,so}", "worker", workername, "interval", 60,
+		   "history", history_range(sdata, &worker->history, from, to));
+out:
+	if (val)
+		json_decref(val);
+	free(workername);
+	send_api_response(res, *sockd);
+}
+
 static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *worker)
 {
 	json_t *val;
@@ -4561,9 +5605,12 @@ retry:
 		if (end_t - sdata->update_time >= ckp->update_interval) {
 			sdata->update_time = end_t;
 			if (!ckp->proxy) {
-				LOGDEBUG("%ds elapsed in strat_loop, updating gbt base",
-					 ckp->update_interval);
-				update_base(sdata, GEN_NORMAL);
+				/* Long polling tells us when the template changes */
+				if (!generator_longpolling(ckp)) {
+					LOGDEBUG("%ds elapsed in strat_loop, updating gbt base",
+						 ckp->update_interval);
+					update_base(sdata, GEN_NORMAL);
+				}
 			} else if (!ckp->passthrough) {
 				LOGDEBUG("%ds elapsed in strat_loop, pinging miners",
 					 ckp->update_interval);
@@ -4629,6 +5676,14 @@ retry:
 		workerclients(sdata, buf + 14, &umsg->sockd);
 		goto retry;
 	}
+	if (cmdmatch(buf, "userhistory")) {
+		userhistory(sdata, buf + 12, &umsg->sockd);
+		goto retry;
+	}
+	if (cmdmatch(buf, "workerhistory")) {
+		workerhistory(sdata, buf + 14, &umsg->sockd);
+		goto retry;
+	}
 	if (cmdmatch(buf, "getproxy")) {
 		getproxy(sdata, buf + 9, &umsg->sockd);
 		goto retry;
@@ -4661,6 +5716,10 @@ retry:
 	LOGDEBUG("Stratifier received request: %s", buf);
 	if (cmdmatch(buf, "update")) {
 		update_base(sdata, GEN_PRIORITY);
+	} else if (cmdmatch(buf, "longpoll=")) {
+		notify_blockhash(sdata, buf + 9, GEN_LONGPOLL);
+	} else if (cmdmatch(buf, "longpoll")) {
+		update_base(sdata, GEN_LONGPOLL);
 	} else if (cmdmatch(buf, "subscribe")) {
 		/* Proxifier has a new subscription */
 		update_subscribe(ckp, buf);
@@ -4721,7 +5780,7 @@ static void *blockupdate(void *arg)
 				break;
 			case GETBEST_SUCCESS:
 				if (strcmp(hash, sdata->lastswaphash)) {
-					update_base(sdata, GEN_PRIORITY);
+					notify_blockhash(sdata, hash, GEN_PRIORITY);
 					break;
 				}
 				[[fallthrough]];
@@ -4747,9 +5806,9 @@ static void __fill_enonce1data(const workbase_t *wb, stratum_instance_t *client)
 
 /* Create a new enonce1 from the 64 bit enonce1_64 value, using only the number
  * of bytes we have to work with when we are proxying with a split nonce2.
- * When the proxy space is less than 32 bits to work with, we look for an
- * unused enonce1 value and reject clients instead if there is no space left.
- * Needs to be entered with client holding a ref count. */
+ * When the proxy space is small enough to have a map of bound slots, we take
+ * the lowest unused enonce1 value and reject clients instead if there is no
+ * space left. Needs to be entered with client holding a ref count. */
 static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, stratum_instance_t *client)
 {
 	proxy_t *proxy = NULL;
@@ -4780,9 +5839,21 @@ static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, strat
 	 * left depending on nonce2 length, we'll always get a changing value
 	 * for every next client.*/
 	ck_wlock(&ckp_sdata->instance_lock);
-	enonce1 = le64toh(ckp_sdata->enonce1_64);
-	enonce1++;
-	client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
+	if (proxy && proxy->enonce1map) {
+		int64_t slot = __take_enonce1slot(proxy);
+
+		if (unlikely(slot < 0)) {
+			ck_wunlock(&ckp_sdata->instance_lock);
+			LOGWARNING("Proxy %d:%d has no free enonce1 slots of %"PRId64, proxy->id,
+				   proxy->subid, proxy->map_clients);
+			return false;
+		}
+		client->enonce1_64 = htole64(slot);
+	} else {
+		enonce1 = le64toh(ckp_sdata->enonce1_64);
+		enonce1++;
+		client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
+	}
 	if (proxy) {
 		client->proxy = proxy;
 		proxy->clients++;
@@ -5130,62 +6201,101 @@ static double dsps_from_key(json_t *val, const char *key)
 	return ret;
 }
 
-static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
+/* Diff shares are only accumulated in uadiff by the share path, and are
+ * accounted for in the hashmeter when statsupdate decays every client, worker
+ * and user in one batch. */
+static inline void add_uadiff(double *uadiff, const double diff)
 {
-	double tdiff = sane_tdiff(now_t, &client->last_decay);
+	double old, new;
 
-	/* If we're calling the hashmeter too frequently we'll just end up
-	 * racing and having inappropriate values, so store up diff and update
-	 * at most 20 times per second. Use an integer for uadiff to make the
-	 * update atomic */
-	if (tdiff < 0.05) {
-		client->uadiff += diff;
-		return;
-	}
-	copy_tv(&client->last_decay, now_t);
-	diff += client->uadiff;
-	client->uadiff = 0;
-	decay_time(&client->dsps1, diff, tdiff, MIN1);
-	decay_time(&client->dsps5, diff, tdiff, MIN5);
-	decay_time(&client->dsps60, diff, tdiff, HOUR);
-	decay_time(&client->dsps1440, diff, tdiff, DAY);
-	decay_time(&client->dsps10080, diff, tdiff, WEEK);
+	__atomic_load(uadiff, &old, __ATOMIC_RELAXED);
+	do {
+		new = old + diff;
+	} while (!__atomic_compare_exchange(uadiff, &old, &new, false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+}
+
+/* Decay proportions shared by every entity decayed over the same period so
+ * that exp() is only called once per rolling average per batch. */
+struct decay_factors {
+	double fsecs;
+	double fprop1;
+	double fprop5;
+	double fprop60;
+	double fprop1440;
+	double fprop10080;
+};
+
+typedef struct decay_factors decay_factors_t;
+
+static void set_decay_factors(decay_factors_t *df, const double fsecs)
+{
+	df->fsecs = fsecs;
+	df->fprop1 = decay_fprop(fsecs, MIN1);
+	df->fprop5 = decay_fprop(fsecs, MIN5);
+	df->fprop60 = decay_fprop(fsecs, HOUR);
+	df->fprop1440 = decay_fprop(fsecs, DAY);
+	df->fprop10080 = decay_fprop(fsecs, WEEK);
 }
 
-static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
+static void decay_dsps(const decay_factors_t *df, double *uadiff, double *dsps1,
+		       double *dsps5, double *dsps60, double *dsps1440, double *dsps10080)
 {
-	double tdiff = sane_tdiff(now_t, &worker->last_decay);
+	double diff, zero = 0;
 
-	if (tdiff < 0.05) {
-		worker->uadiff += diff;
-		return;
-	}
-	copy_tv(&worker->last_decay, now_t);
-	diff += worker->uadiff;
-	worker->uadiff = 0;
-	decay_time(&worker->dsps1, diff, tdiff, MIN1);
-	decay_time(&worker->dsps5, diff, tdiff, MIN5);
-	decay_time(&worker->dsps60, diff, tdiff, HOUR);
-	decay_time(&worker->dsps1440, diff, tdiff, DAY);
-	decay_time(&worker->dsps10080, diff, tdiff, WEEK);
+	__atomic_exchange(uadiff, &zero, &diff, __ATOMIC_RELAXED);
+
+	decay_time_fprop(dsps1, diff, df->fsecs, df->fprop1);
+	decay_time_fprop(dsps5, diff, df->fsecs, df->fprop5);
+	decay_time_fprop(dsps60, diff, df->fsecs, df->fprop60);
+	decay_time_fprop(dsps1440, diff, df->fsecs, df->fprop1440);
+	decay_time_fprop(dsps10080, diff, df->fsecs, df->fprop10080);
 }
 
-static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
+static void decay_client(const decay_factors_t *df, stratum_instance_t *client)
 {
-	double tdiff = sane_tdiff(now_t, &user->last_decay);
+	decay_dsps(df, &client->uadiff, &client->dsps1, &client->dsps5, &client->dsps60,
+		   &client->dsps1440, &client->dsps10080);
+}
+
+static void decay_worker(const decay_factors_t *df, worker_instance_t *worker)
+{
+	decay_dsps(df, &worker->uadiff, &worker->dsps1, &worker->dsps5, &worker->dsps60,
+		   &worker->dsps1440, &worker->dsps10080);
+}
+
+static void decay_user(const decay_factors_t *df, user_instance_t *user)
+{
+	decay_dsps(df, &user->uadiff, &user->dsps1, &user->dsps5, &user->dsps60,
+		   &user->dsps1440, &user->dsps10080);
+}
+
+/* Decay the hashrate of every client, worker and user over fsecs, accounting
+ * for the diff accumulated by the share path since the last batch. Clients
+ * are only freed under the instance write lock and users and workers are
+ * never freed so a read lock is enough. */
+static void decay_instances(sdata_t *sdata, const double fsecs)
+{
+	stratum_instance_t *client, *tmp;
+	worker_instance_t *worker;
+	user_instance_t *user;
+	decay_factors_t df;
 
-	if (tdiff < 0.05) {
-		user->uadiff += diff;
+	if (unlikely(fsecs <= 0))
 		return;
+	set_decay_factors(&df, fsecs);
+
+	ck_rlock(&sdata->instance_lock);
+	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+		decay_client(&df, client);
+	}
+	for (user = sdata->user_instances; user; user = user->hh.next) {
+		decay_user(&df, user);
+		DL_FOREACH(user->worker_instances, worker) {
+			decay_worker(&df, worker);
+		}
 	}
-	copy_tv(&user->last_decay, now_t);
-	diff += user->uadiff;
-	user->uadiff = 0;
-	decay_time(&user->dsps1, diff, tdiff, MIN1);
-	decay_time(&user->dsps5, diff, tdiff, MIN5);
-	decay_time(&user->dsps60, diff, tdiff, HOUR);
-	decay_time(&user->dsps1440, diff, tdiff, DAY);
-	decay_time(&user->dsps10080, diff, tdiff, WEEK);
+	ck_runlock(&sdata->instance_lock);
 }
 
 static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bool *new_user);
@@ -5198,6 +6308,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 	char dnam[256], s[4096], *username, *buf;
 	int ret, users = 0, workers = 0;
 	user_instance_t *user;
+	decay_factors_t df;
 	struct dirent *dir;
 	struct stat fdbuf;
 	bool new_user;
@@ -5215,6 +6326,8 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 	}
 
 	tv_time(&now);
+	/* Decay stats loaded from disk by the time the pool was down */
+	set_decay_factors(&df, tvsec_diff);
 
 	while ((dir = readdir(d)) != NULL) {
 		json_t *worker_array, *arr_val;
@@ -5266,7 +6379,6 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		dealloc(buf);
 
 		copy_tv(&user->last_share, &now);
-		copy_tv(&user->last_decay, &now);
 		user->dsps1 = dsps_from_key(val, "hashrate1m");
 		user->dsps5 = dsps_from_key(val, "hashrate5m");
 		user->dsps60 = dsps_from_key(val, "hashrate1hr");
@@ -5285,7 +6397,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
 			user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
 		if (tvsec_diff > 60)
-			decay_user(user, 0, &now);
+			decay_user(&df, user);
 
 		worker_array = json_object_get(val, "worker");
 		json_array_foreach(worker_array, index, arr_val) {
@@ -5304,7 +6416,6 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 				continue;
 			}
 			workers++;
-			copy_tv(&worker->last_decay, &now);
 			worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
 			worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
 			worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
@@ -5320,7 +6431,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
 				worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
 			if (tvsec_diff > 60)
-				decay_worker(worker, 0, &now);
+				decay_worker(&df, worker);
 		}
 		json_decref(val);
 	}
@@ -5735,10 +6846,10 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 {
 	sdata_t *ckp_sdata = ckp->sdata, *sdata = client->sdata;
 	worker_instance_t *worker = client->worker_instance;
-	double tdiff, bdiff, dsps, drr, network_diff, bias;
+	double tdiff, bdiff, dsps, drr, network_diff, bias, uadiff;
 	user_instance_t *user = client->user_instance;
 	int64_t next_blockid, optimal, mindiff;
-	tv_t now_t;
+	tv_t now_t, last_decay;
 
 	mutex_lock(&ckp_sdata->uastats_lock);
 	if (valid) {
@@ -5770,14 +6881,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		copy_tv(&client->ldc, &now_t);
 	}
 
-	decay_client(client, diff, &now_t);
+	add_uadiff(&client->uadiff, diff);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_uadiff(&worker->uadiff, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_uadiff(&user->uadiff, diff);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -5801,8 +6912,13 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 	}
 
-	/* Diff rate ratio */
-	dsps = client->dsps5 / bias;
+	/* Diff rate ratio, including the diff statsupdate hasn't decayed into
+	 * dsps5 yet so fast clients aren't judged on a stale or empty rate */
+	dsps = client->dsps5;
+	__atomic_load(&client->uadiff, &uadiff, __ATOMIC_RELAXED);
+	ts_to_tv(&last_decay, &ckp_sdata->stats.last_update);
+	decay_time(&dsps, uadiff, sane_tdiff(&now_t, &last_decay), MIN5);
+	dsps /= bias;
 	drr = dsps / (double)client->diff;
 
 	/* Optimal rate product is 0.3, allow some hysteresis. */
@@ -5860,6 +6976,7 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	client->diff_change_job_id = next_blockid;
 	client->old_diff = client->diff;
 	client->diff = optimal;
+	flightrec(FR_DIFF, LOG_INFO, client->id, client->old_diff, optimal);
 	stratum_send_diff(sdata, client);
 }
 
@@ -5890,6 +7007,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	double network_diff;
 	json_t *val = NULL;
 	uchar flip32[32];
+	tv_t solve_tv;
 	ts_t ts_now;
 	bool ret;
 
@@ -5897,6 +7015,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	network_diff = sdata->current_workbase->network_diff * 0.999;
 	if (likely(diff < network_diff))
 		return;
+	tv_time(&solve_tv);
 
 	LOGWARNING("Possible %sblock solve diff %lf !", stale ? "stale share " : "", diff);
 	/* Can't submit a block in proxy mode without the transactions */
@@ -5942,7 +7061,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 	/* Submit block locally after sending it to remote locations avoiding
 	 * the delay of local verification */
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, gbt_block, wb, flip32, &solve_tv);
 	if (ret)
 		block_solve(ckp, val);
 	else
@@ -6138,6 +7257,7 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
 	const char *workername, *job_id, *ntime, *version_mask;
+	bool block = false;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	user_instance_t *user = client->user_instance;
@@ -6308,7 +7428,7 @@ out_submit:
 	if (unlikely(sdiff >= sdata->current_workbase->network_diff)) {
 		/* Make sure we always submit any possible block solve */
 		LOGWARNING("Submitting possible block solve share diff %lf !", sdiff);
-		submit = true;
+		submit = block = true;
 	}
 out_put:
 	put_workbase(sdata, wb);
@@ -6403,7 +7523,9 @@ out_nowb:
 		} else
 			LOGERR("Failed to fopen %s", fname);
 	}
-	if (ckp->remote)
+	/* Batch the share upstream in binary frames when the upstream pool
+	 * takes them, sending it at once if it could be a block */
+	if (ckp->remote && !connector_upstream_share(ckp, client->workername, diff, sdiff, block))
 		upstream_json_msgtype(ckp, val, SM_SHARE);
 	json_decref(val);
 out:
@@ -6489,6 +7611,7 @@ static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, const
 	json_msg = __stratum_notify(wb, clean);
 	ck_runlock(&sdata->workbase_lock);
 
+	flightrec(FR_NOTIFY, LOG_NOTICE, wb->id, clean, 0);
 	stratum_broadcast(sdata, json_msg, SM_UPDATE);
 }
 
@@ -6634,6 +7757,7 @@ static void suggest_diff(ckpool_t *ckp, stratum_instance_t *client, const char *
 	client->diff_change_job_id = client->sdata->workbase_id + 1;
 	client->old_diff = client->diff;
 	client->diff = sdiff;
+	flightrec(FR_DIFF, LOG_INFO, client->id, client->old_diff, sdiff);
 	stratum_send_diff(ckp->sdata, client);
 }
 
@@ -6651,17 +7775,15 @@ static void init_client(const stratum_instance_t *client, const int64_t client_i
  * current ones to it. */
 static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 {
-	json_t *txn_array, *val, *txn_val;
+	json_t *txn_array, *val;
 	txntable_t *txn, *tmp;
 	smsg_t *msg;
 
 	txn_array = json_array();
 
 	ck_rlock(&sdata->txn_lock);
-	HASH_ITER(hh, sdata->txns, txn, tmp) {
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", txn->hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
-	}
+	HASH_ITER(hh, sdata->txns, txn, tmp)
+		json_array_append_new(txn_array, txn_json(txn));
 	ck_runlock(&sdata->txn_lock);
 
 	if (client->trusted) {
@@ -6720,7 +7842,12 @@ static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 	__inc_instance_ref(client);
 	ck_wunlock(&sdata->instance_lock);
 
-	send_node_all_txns(sdata, client);
+	/* Compact remotes fetch only the transactions missing from their own
+	 * table as they need them */
+	if (client->compact)
+		LOGNOTICE("Remote client %s takes compact workinfos", client->identity);
+	else
+		send_node_all_txns(sdata, client);
 	dec_instance_ref(sdata, client);
 }
 
@@ -6782,8 +7909,15 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 				  client->identity, client->address, client->server);
 			connector_drop_client(ckp, client_id);
 		} else {
-			snprintf(buf, 255, "remote=%"PRId64, client_id);
+			/* Newer remotes offer the binary frame version they
+			 * support */
+			int binary = json_integer_value(json_array_get(params_val, 1));
+
+			snprintf(buf, 255, "remote=%"PRId64",%d", client_id,
+				 MIN(MAX(binary, 0), REMOTE_BINARY_VERSION));
 			send_proc(ckp->connector, buf);
+			client->compact = !safecmp(json_string_value(json_array_get(params_val, 2)),
+						   "compact");
 			add_remote_server(sdata, client);
 		}
 		sprintf(client->identity, "remote:%"PRId64, client_id);
@@ -6803,6 +7937,8 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		} else {
 			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
 			send_proc(ckp->connector, buf);
+			/* Nodes can't request the transactions for short txids
+			 * they miss so always get full workinfos */
 			add_mining_node(ckp, sdata, client);
 			sprintf(client->identity, "node:%"PRId64, client_id);
 		}
@@ -6818,12 +7954,17 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			connector_drop_client(ckp, client_id);
 			drop_client(ckp, sdata, client_id);
 		} else {
+			/* Passthroughs supporting it ask for framed messages */
+			const char *mode = json_string_value(json_array_get(params_val, 1));
+			bool framed = !safecmp(mode, "framed");
+
 			/*Flag this as a passthrough and manage its messages
 			 * accordingly. No data from this client id should ever
 			 * come directly back to this stratifier. */
-			LOGNOTICE("Adding passthrough client %s %s", client->identity, client->address);
+			LOGNOTICE("Adding %spassthrough client %s %s", framed ? "framed " : "",
+				  client->identity, client->address);
 			client->passthrough = true;
-			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
+			snprintf(buf, 255, "passthrough=%"PRId64"%s", client_id, framed ? ",framed" : "");
 			send_proc(ckp->connector, buf);
 			sprintf(client->identity, "passthrough:%"PRId64, client_id);
 		}
@@ -7026,32 +8167,20 @@ static user_instance_t *generate_remote_user(ckpool_t *ckp, const char *workerna
 	return user;
 }
 
-static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+static void add_remote_share(ckpool_t *ckp, sdata_t *sdata, const char *workername,
+			     const uint32_t shares, const double diff, const double sdiff)
 {
-	json_t *workername_val = json_object_get(val, "workername");
 	worker_instance_t *worker;
-	const char *workername;
-	double diff, sdiff = 0;
 	user_instance_t *user;
 	tv_t now_t;
 
-	workername = json_string_value(workername_val);
-	if (unlikely(!workername_val || !workername)) {
-		LOGWARNING("Failed to get workername from remote message %s", buf);
-		return;
-	}
-	if (unlikely(!json_get_double(&diff, val, "diff") || diff < 1)) {
-		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
-		return;
-	}
-	json_get_double(&sdiff, val, "sdiff");
 	user = generate_remote_user(ckp, workername);
 	user->authorised = true;
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(sdata, user, worker, sdiff, NULL);
 
 	mutex_lock(&sdata->uastats_lock);
-	sdata->stats.unaccounted_shares++;
+	sdata->stats.unaccounted_shares += shares;
 	sdata->stats.unaccounted_diff_shares += diff;
 	mutex_unlock(&sdata->uastats_lock);
 
@@ -7059,16 +8188,92 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	user->shares += diff;
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_uadiff(&worker->uadiff, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_uadiff(&user->uadiff, diff);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %.0lf remote shares to worker %s", diff, workername);
 }
 
+static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *workername_val = json_object_get(val, "workername");
+	const char *workername;
+	double diff, sdiff = 0;
+
+	workername = json_string_value(workername_val);
+	if (unlikely(!workername_val || !workername)) {
+		LOGWARNING("Failed to get workername from remote message %s", buf);
+		return;
+	}
+	if (unlikely(!json_get_double(&diff, val, "diff") || diff < 1)) {
+		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
+		return;
+	}
+	json_get_double(&sdiff, val, "sdiff");
+	add_remote_share(ckp, sdata, workername, 1, diff, sdiff);
+}
+
+typedef struct remote_shares remote_shares_t;
+
+struct remote_shares {
+	char *buf;
+	int len;
+	int count;
+	bool totals; /* Records are per worker share totals */
+};
+
+/* Queue a binary frame of share or share total records from a trusted remote,
+ * copying the payload out of the connector's client buffer */
+void stratifier_add_remote_shares(ckpool_t *ckp, const char *buf, const int len, const int count,
+				  const bool totals)
+{
+	sdata_t *sdata = ckp->sdata;
+	remote_shares_t *rs;
+
+	rs = ckalloc(sizeof(remote_shares_t));
+	rs->buf = ckalloc(len);
+	memcpy(rs->buf, buf, len);
+	rs->len = len;
+	rs->count = count;
+	rs->totals = totals;
+	ckmsgq_add(sdata->srshareq, rs);
+}
+
+static void srshare_process(ckpool_t *ckp, remote_shares_t *rs)
+{
+	sdata_t *sdata = ckp->sdata;
+	char workername[256];
+	int ofs = 0, records;
+	double diff, sdiff;
+	uint32_t shares;
+
+	for (records = 0; records < rs->count && ofs < rs->len; records++) {
+		int reclen;
+
+		reclen = remote_record_decode(rs->buf + ofs, rs->len - ofs, rs->totals, workername,
+					      &shares, &diff, &sdiff);
+		if (unlikely(reclen < 0)) {
+			LOGWARNING("Truncated remote share frame at record %d of %d", records,
+				   rs->count);
+			break;
+		}
+		ofs += reclen;
+		if (unlikely(!workername[0] || !shares || diff < shares)) {
+			LOGWARNING("Invalid remote share for worker %s diff %lf", workername, diff);
+			continue;
+		}
+		add_remote_share(ckp, sdata, workername, shares, diff, sdiff);
+	}
+	LOGDEBUG("Processed %d of %d remote share%s records in %d byte frame", records,
+		 rs->count, rs->totals ? " total" : "", rs->len);
+	free(rs->buf);
+	free(rs);
+}
+
 static void parse_remote_shareerr(ckpool_t *ckp, json_t *val, const char *buf)
 {
 	const char *workername;
@@ -7176,10 +8381,10 @@ out:
 
 void parse_upstream_workinfo(ckpool_t *ckp, json_t *val)
 {
-	add_node_base(ckp, val, true, 0);
+	add_node_base(ckp, val, true, 0, 0);
 }
 
-#define parse_remote_workinfo(ckp, val, client_id) add_node_base(ckp, val, true, client_id)
+#define parse_remote_workinfo(ckp, val, client_id) add_node_base(ckp, val, true, client_id, 0)
 
 static void parse_remote_auth(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratum_instance_t *remote,
 			      const int64_t remote_id)
@@ -7277,7 +8482,9 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		uchar swap[80], hash[32], hash1[32], flip32[32];
 		char *coinbase = alloca(cblen), *gbt_block;
 		char blockhash[68];
+		tv_t solve_tv;
 
+		tv_time(&solve_tv);
 		LOGWARNING("Possible remote block solve diff %lf !", diff);
 		hex2bin(coinbase, coinbasehex, cblen);
 		hex2bin(swap, swaphex, 80);
@@ -7290,7 +8497,7 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		/* We rely on the remote server to give us the ID_BLOCK
 		 * responses, so only use this response to determine if we
 		 * should reset the best shares. */
-		if (local_block_submit(ckp, gbt_block, flip32, wb->height)) {
+		if (local_block_submit(ckp, gbt_block, wb, flip32, &solve_tv)) {
 			block_share_summary(sdata);
 			reset_bestshares(sdata);
 		}
@@ -7348,23 +8555,26 @@ static void add_node_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val)
 
 	for (i = 0; i < arr_size; i++) {
 		const char *hash, *data;
+		uchar binhash[32];
 
 		txn_val = json_array_get(txn_array, i);
 		data_val = json_object_get(txn_val, "data");
 		hash_val = json_object_get(txn_val, "hash");
 		data = json_string_value(data_val);
 		hash = json_string_value(hash_val);
-		if (unlikely(!data || !hash)) {
+		if (unlikely(!data || !txn_hex_hash(binhash, hash))) {
 			LOGERR("Failed to get hash/data in add_node_txns");
 			continue;
 		}
 
-		if (add_txn(ckp, sdata, &txns, hash, data, false))
+		if (add_txn(ckp, sdata, &txns, binhash, data, strlen(data), false))
 			added++;
 	}
 
-	if (added)
-		update_txns(ckp, sdata, txns, false);
+	if (added) {
+		update_txns(ckp, sdata, txns, NULL, false);
+		retry_pending_workinfos(ckp, sdata);
+	}
 }
 
 void parse_remote_txns(ckpool_t *ckp, const json_t *val)
@@ -7381,15 +8591,15 @@ static json_t *get_hash_transactions(sdata_t *sdata, const json_t *hashes)
 	ck_rlock(&sdata->txn_lock);
 	json_array_foreach(hashes, index, arr_val) {
 		const char *hash = json_string_value(arr_val);
-		json_t *txn_val;
+		uchar binhash[32];
 		txntable_t *txn;
 
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		if (!txn_hex_hash(binhash, hash))
+			continue;
+		HASH_FIND(hh, sdata->txns, binhash, 32, txn);
 		if (!txn)
 			continue;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		json_array_append_new(txn_array, txn_json(txn));
 		found++;
 	}
 	ck_runlock(&sdata->txn_lock);
@@ -7397,12 +8607,53 @@ static json_t *get_hash_transactions(sdata_t *sdata, const json_t *hashes)
 	return txn_array;
 }
 
+/* Find transactions by the short txids we sent in compact workinfos */
+static json_t *get_short_transactions(sdata_t *sdata, const json_t *shorts)
+{
+	json_t *txn_array = json_array(), *arr_val;
+	int requested = 0;
+	uint64_t *wanted;
+	txntable_t *txn, *tmp;
+	size_t index;
+
+	wanted = ckalloc(sizeof(uint64_t) * json_array_size(shorts));
+	json_array_foreach(shorts, index, arr_val) {
+		const char *hex = json_string_value(arr_val);
+
+		if (hex && strlen(hex) == SHORTID_LEN * 2 && shortid_hex(&wanted[requested], hex))
+			requested++;
+	}
+	if (unlikely(!requested))
+		goto out;
+	qsort(wanted, requested, sizeof(uint64_t), shortid_cmp);
+
+	ck_rlock(&sdata->txn_lock);
+	HASH_ITER(hh, sdata->txns, txn, tmp) {
+		uint64_t shortid = txn_shortid(txn->hash, sdata->txn_salt);
+
+		if (bsearch(&shortid, wanted, requested, sizeof(uint64_t), shortid_cmp))
+			json_array_append_new(txn_array, txn_json(txn));
+	}
+	ck_runlock(&sdata->txn_lock);
+out:
+	free(wanted);
+	return txn_array;
+}
+
 static json_t *get_reqtxns(sdata_t *sdata, const json_t *val, bool downstream)
 {
 	json_t *hashes = json_object_get(val, "hash");
+	json_t *shorts = json_object_get(val, "short");
 	json_t *txns, *ret = NULL;
 	int requested, found;
 
+	if (shorts && json_is_array(shorts)) {
+		requested = json_array_size(shorts);
+		if (unlikely(!requested))
+			goto out;
+		txns = get_short_transactions(sdata, shorts);
+		goto found;
+	}
 	if (unlikely(!hashes) || !json_is_array(hashes))
 		goto out;
 	requested = json_array_size(hashes);
@@ -7410,6 +8661,7 @@ static json_t *get_reqtxns(sdata_t *sdata, const json_t *val, bool downstream)
 		goto out;
 
 	txns = get_hash_transactions(sdata, hashes);
+found:
 	found = json_array_size(txns);
 	if (found) {
 		JSON_CPACK(ret, "{ssso}", "method", stratum_msgs[SM_TRANSACTIONS], "transaction", txns);
@@ -7550,7 +8802,7 @@ static void parse_node_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 			add_node_txns(ckp, sdata, val);
 			break;
 		case SM_WORKINFO:
-			add_node_base(ckp, val, false, 0);
+			add_node_base(ckp, val, false, 0, 0);
 			break;
 		case SM_BLOCK:
 			submit_node_block(ckp, sdata, val);
@@ -7761,7 +9013,16 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 		goto out_decref;
 	}
 	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
+	if (LOG_INFO <= flightrec_level) {
+		tv_t start_tv, end_tv;
+
+		tv_time(&start_tv);
+		result_val = parse_submit(client, json_msg, jp->params, &err_val);
+		tv_time(&end_tv);
+		flightrec(json_is_true(result_val) ? FR_SHARE_ACCEPT : FR_SHARE_REJECT, LOG_INFO,
+			  client_id, us_tvdiff(&end_tv, &start_tv), client->diff);
+	} else
+		result_val = parse_submit(client, json_msg, jp->params, &err_val);
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
 	steal_json_id(json_msg, jp);
@@ -7805,9 +9066,9 @@ static void upstream_auth(ckpool_t *ckp, stratum_instance_t *client, json_params
 	ts_realtime(&now);
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	json_set_object(val, "params", jp->params);
-	json_set_object(val, "id", jp->id_val);
-	json_set_object(val, "method", jp->method);
+	/* The json params are discarded by the authoriser after this */
+	json_object_set(val, "params", jp->params);
+	json_object_set(val, "id", jp->id_val);
 	json_set_string(val, "method", stratum_msgs[SM_AUTH]);
 
 	json_set_string(val, "useragent", client->useragent ? : "");
@@ -8108,10 +9369,9 @@ static void *statsupdate(void *arg)
 				}
 			} else {
 				per_tdiff = tvdiff(&now, &client->last_share);
-				/* Decay times per connected instance */
+				/* Look for idle connected instances */
 				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
+					/* No shares for over a minute */
 					idle_workers++;
 					if (per_tdiff > 600)
 						client->idle = true;
@@ -8143,16 +9403,11 @@ static void *statsupdate(void *arg)
 
 			tv_time(&now);
 
-			/* Decay times per user */
-			per_tdiff = tvdiff(&now, &user->last_share);
 			/* Drop storage of users with no shares */
 			if (!user->last_share.tv_sec) {
 				LOGDEBUG("Skipping inactive user %s", user->username);
 				continue;
 			}
-			if (per_tdiff > 60)
-				decay_user(user, 0, &now);
-
 			ghs = user->dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
 
@@ -8168,6 +9423,9 @@ static void *statsupdate(void *arg)
 			ghs = user->dsps10080 * nonces;
 			suffix_string(ghs, suffix10080, 16, 0);
 
+			add_history(sdata, &user->history, now.tv_sec, user->dsps1,
+				    user->dsps5, user->dsps60);
+
 			JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sI,sf,sI, sI}",
 					"hashrate1m", suffix1,
 					"hashrate5m", suffix5,
@@ -8199,13 +9457,12 @@ static void *statsupdate(void *arg)
 			user_array = json_array();
 			worker = NULL;
 
-			/* Decay times per worker */
+			/* Stats per worker */
 			while ((worker = next_worker(sdata, user, worker)) != NULL) {
 				json_t *wval;
 
 				per_tdiff = tvdiff(&now, &worker->last_share);
 				if (per_tdiff > 60) {
-					decay_worker(worker, 0, &now);
 					worker->idle = true;
 					/* Drop storage of workers idle for 1 week */
 					if (per_tdiff > 600000) {
@@ -8229,6 +9486,9 @@ static void *statsupdate(void *arg)
 				ghs = worker->dsps10080 * nonces;
 				suffix_string(ghs, suffix10080, 16, 0);
 
+				add_history(sdata, &worker->history, now.tv_sec, worker->dsps1,
+					    worker->dsps5, worker->dsps60);
+
 				LOGDEBUG("Storing worker %s", worker->workername);
 
 				JSON_CPACK(wval, "{ss,ss,ss,ss,ss,ss,si,sI,sf,sI}",
@@ -8444,6 +9704,9 @@ static void *statsupdate(void *arg)
 			decay_time(&stats->dsps1440, unaccounted_diff_shares, per_tdiff, DAY);
 			decay_time(&stats->dsps10080, unaccounted_diff_shares, per_tdiff, WEEK);
 			mutex_unlock(&sdata->stats_lock);
+
+			decay_instances(sdata, per_tdiff);
+			flightrec_ckmsgqs(ckp);
 		}
 
 		/* Reset remote workers every minute since we measure it once
@@ -8690,8 +9953,8 @@ static void *zmqnotify(void *arg)
 							LOGDEBUG("ZMQ sequence number from endpoint %d", i);
 							break;
 						case 32:
-							update_base(sdata, GEN_PRIORITY);
 							__bin2hex(hexhash, zmq_msg_data(&message), 32);
+							notify_blockhash(sdata, hexhash, GEN_PRIORITY);
 							LOGNOTICE("ZMQ block hash %s from endpoint %d", hexhash, i);
 							break;
 						default:
@@ -8729,6 +9992,7 @@ void *stratifier(void *arg)
 	ckpool_t *ckp = pi->ckp;
 	int64_t randomiser;
 	sdata_t *sdata;
+	ts_t now;
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s stratifier starting", ckp->name);
@@ -8771,6 +10035,8 @@ void *stratifier(void *arg)
 	randomiser = time(NULL);
 	sdata->enonce1_64 = htole64(randomiser);
 	sdata->session_id = randomiser;
+	ts_realtime(&now);
+	sdata->txn_salt = (uint64_t)now.tv_nsec << 32 ^ randomiser;
 	/* Set the initial id to time as high bits so as to not send the same
 	 * id on restarts */
 	randomiser <<= 32;
@@ -8789,6 +10055,7 @@ void *stratifier(void *arg)
 	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
+	sdata->srshareq = create_ckmsgq(ckp, "srshares", &srshare_process);
 	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
 	create_pthread(&pth_throbber, throbber, ckp);
 	read_poolstats(ckp, &tvsec_diff);
@@ -8807,6 +10074,7 @@ void *stratifier(void *arg)
 
 	mutex_init(&sdata->stats_lock);
 	mutex_init(&sdata->uastats_lock);
+	mutex_init(&sdata->history_lock);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
@@ -48,8 +48,19 @@ struct genwork {
 	int height;
 	char *flags;
 	int txns;
+	int64_t fees; /* Sum of the transaction fees, -1 if unknown */
 	char *txn_data;
 	char *txn_hashes;
+	/* Binary txids and wtxids in merkle byte order and the offset of each
+	 * transaction in txn_data, as parsed from a local block template */
+	uchar *txidbin;
+	uchar *wtxidbin;
+	int *txn_ofs;
+	/* The getblocktemplatelight job this workbase was built from, NULL if
+	 * it was built from a full template */
+	char *job_id;
+	/* The id of the server the light job came from, only it knows job_id */
+	int job_server;
 	char witnessdata[80]; //null-terminated ascii
 	bool insert_witness;
 	int merkles;
@@ -94,7 +105,10 @@ void parse_upstream_auth(ckpool_t *ckp, json_t *val);
 void parse_upstream_workinfo(ckpool_t *ckp, json_t *val);
 void parse_upstream_block(ckpool_t *ckp, json_t *val);
 void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
+void stratifier_add_remote_shares(ckpool_t *ckp, const char *buf, const int len, const int count,
+				  const bool totals);
 char *stratifier_stats(ckpool_t *ckp, void *data);
+void stratifier_metrics(ckpool_t *ckp, char **buf);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
 void *stratifier(void *arg);
@@ -0,0 +1,306 @@
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <jansson.h>
+#include "libckpool.h"
+
+/* Send shares from a remote to an upstream pool over a loopback socket using
+ * the same framing and parsing as the connector and stratifier: full json
+ * messages, batched json, batched binary frames, per worker totals, and totals
+ * downgraded to share records for a version 1 upstream */
+
+#define TEST_SHARES 200000
+#define TEST_WORKERS 64
+/* Shares batched or totalled before each flush */
+#define TEST_FLUSH 1000
+
+enum test_mode {
+	TM_JSON,
+	TM_JSON_BATCH,
+	TM_BINARY,
+	TM_TOTALS,
+	TM_TOTALS_V1,
+	TM_MODES
+};
+
+static const char *test_modes[] = {"Json", "Json batch", "Binary", "Totals", "Totals v1"};
+
+/* Required by libckpool */
+void logmsg(int loglevel, const char *fmt, ...)
+{
+}
+
+struct reader {
+	int sockd;
+	int version; /* Binary version negotiated, 0 for json */
+	bool invalid;
+	int64_t shares;
+	int64_t bytes;
+	double diff;
+};
+
+static double elapsed_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (1000000.0 * (now.tv_sec - start->tv_sec) + now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void write_all(int fd, const char *buf, int len)
+{
+	while (len > 0) {
+		int ret = write(fd, buf, len);
+
+		if (ret < 1) {
+			printf("Failed to write to loopback socket\n");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Consume whatever whole messages are in buf, returning how many bytes */
+static int parse_json(struct reader *r, char *buf, int len)
+{
+	char *eol, *msg = buf;
+
+	while ((eol = memchr(msg, '\n', len - (msg - buf)))) {
+		json_t *val;
+
+		*eol = '\0';
+		val = json_loads(msg, 0, NULL);
+		if (val && json_string_value(json_object_get(val, "workername"))) {
+			r->diff += json_real_value(json_object_get(val, "diff"));
+			r->shares++;
+		}
+		json_decref(val);
+		msg = eol + 1;
+	}
+	return msg - buf;
+}
+
+/* Consume whole frames as the connector and stratifier would, returning how
+ * many bytes or -1 if a frame is invalid */
+static int parse_binary(struct reader *r, char *buf, int len)
+{
+	char workername[256];
+	remote_frame_t frame;
+	double diff, sdiff;
+	int ofs = 0, flen;
+
+	while ((flen = remote_frame_check(buf + ofs, len - ofs, r->version, &frame)) > 0) {
+		const char *payload = buf + ofs + sizeof(frame);
+		int count, rofs = 0, plen = flen - sizeof(frame);
+
+		for (count = le32toh(frame.count); count--; ) {
+			uint32_t shares;
+			int reclen;
+
+			reclen = remote_record_decode(payload + rofs, plen - rofs,
+						      frame.type == RF_TOTALS, workername,
+						      &shares, &diff, &sdiff);
+			if (reclen < 0)
+				return -1;
+			rofs += reclen;
+			r->diff += diff;
+			r->shares += shares;
+		}
+		if (rofs != plen)
+			return -1;
+		ofs += flen;
+	}
+	return flen < 0 ? -1 : ofs;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	int size = 1048576, len = 0, fd;
+	char *buf = malloc(size + 1);
+
+	fd = accept(r->sockd, NULL, NULL);
+	while (42) {
+		int ret = read(fd, buf + len, size - len);
+
+		if (ret < 1)
+			break;
+		r->bytes += ret;
+		len += ret;
+		buf[len] = '\0';
+		ret = r->version ? parse_binary(r, buf, len) : parse_json(r, buf, len);
+		if (ret < 0) {
+			r->invalid = true;
+			break;
+		}
+		memmove(buf, buf + ret, len - ret);
+		len -= ret;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static char *json_share(const char *workername, double diff, int n)
+{
+	char nonce2[17], nonce[9], hash[65];
+	json_t *val;
+	char *s;
+
+	sprintf(nonce2, "%016x", n);
+	sprintf(nonce, "%08x", n);
+	sprintf(hash, "%064x", n);
+	val = json_pack("{sI,sI,ss,ss,ss,ss,sf,sf,ss,sb,sn,sn,si,ss,ss,ss,ss,ss,ss,ss,ss,ss}",
+			"workinfoid", (json_int_t)7698197148243853313LL, "clientid", (json_int_t)n,
+			"enonce1", "867dd56a", "nonce2", nonce2, "nonce", nonce, "ntime", "6ad57d85",
+			"diff", diff, "sdiff", diff * 1.5, "hash", hash, "result", 1,
+			"reject-reason", "error", "errn", 0, "createdate", "1792376197,123456789",
+			"createby", "code", "createcode", "parse_submit", "createinet", "127.0.0.1:3333",
+			"workername", workername, "username", workername, "address", "127.0.0.1",
+			"agent", "cgminer/4.12.0", "method", "share");
+	s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT | JSON_EOL);
+	json_decref(val);
+	return s;
+}
+
+/* Send the batched share records or the totals of every worker as the
+ * connector's share batch sender would and reset them */
+static void flush_shares(int fd, const int mode, char **batch, int *len, char workernames[][64],
+			 uint32_t *shares, double *diffs, double *sdiffs)
+{
+	char tbatch[TEST_WORKERS * REMOTE_TOTAL_MAX];
+	int i, msglen, tlen = 0;
+	char *msg;
+
+	for (i = 0; i < TEST_WORKERS; i++) {
+		if (!shares[i])
+			continue;
+		tlen += remote_total_encode(tbatch + tlen, workernames[i], strlen(workernames[i]),
+					    shares[i], diffs[i], sdiffs[i]);
+		shares[i] = 0;
+		diffs[i] = sdiffs[i] = 0;
+	}
+	if (mode == TM_TOTALS_V1) {
+		remote_totals_as_shares(batch, len, tbatch, tlen);
+		tlen = 0;
+	}
+	if (mode == TM_JSON_BATCH)
+		msg = remote_shares_json(*batch, *len, "share", &msglen);
+	else {
+		msg = remote_share_frames(*batch, *len, tbatch, tlen,
+					  mode == TM_TOTALS_V1 ? 1 : REMOTE_BINARY_VERSION, &msglen);
+	}
+	write_all(fd, msg, msglen);
+	free(msg);
+	*len = 0;
+}
+
+/* Send all shares as a remote would and return the reader's totals */
+static void run(const int mode, char workernames[][64], struct reader *r)
+{
+	uint32_t shares[TEST_WORKERS] = {};
+	double diffs[TEST_WORKERS] = {}, sdiffs[TEST_WORKERS] = {};
+	char *batch = malloc(TEST_FLUSH * REMOTE_SHARE_MAX);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct timeval start_time;
+	int i, fd, blen = 0;
+	double elapsed;
+	pthread_t pth;
+
+	memset(r, 0, sizeof(*r));
+	if (mode == TM_TOTALS_V1)
+		r->version = 1;
+	else if (mode != TM_JSON && mode != TM_JSON_BATCH)
+		r->version = REMOTE_BINARY_VERSION;
+	r->sockd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(r->sockd, (struct sockaddr *)&addr, addrlen) || listen(r->sockd, 1) ||
+	    getsockname(r->sockd, (struct sockaddr *)&addr, &addrlen)) {
+		printf("Failed to listen on loopback\n");
+		exit(1);
+	}
+	pthread_create(&pth, NULL, reader_thread, r);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *)&addr, addrlen)) {
+		printf("Failed to connect on loopback\n");
+		exit(1);
+	}
+
+	gettimeofday(&start_time, NULL);
+	for (i = 0; i < TEST_SHARES; i++) {
+		const char *workername = workernames[i % TEST_WORKERS];
+		double diff = 1000 + i % 1000;
+
+		if (mode == TM_JSON) {
+			char *s = json_share(workername, diff, i);
+
+			write_all(fd, s, strlen(s));
+			free(s);
+			continue;
+		}
+		if (mode == TM_TOTALS || mode == TM_TOTALS_V1) {
+			shares[i % TEST_WORKERS]++;
+			diffs[i % TEST_WORKERS] += diff;
+			if (diff * 1.5 > sdiffs[i % TEST_WORKERS])
+				sdiffs[i % TEST_WORKERS] = diff * 1.5;
+		} else {
+			blen += remote_share_encode(batch + blen, workername, strlen(workername),
+						    diff, diff * 1.5);
+		}
+		if (!((i + 1) % TEST_FLUSH))
+			flush_shares(fd, mode, &batch, &blen, workernames, shares, diffs, sdiffs);
+	}
+	if (mode != TM_JSON)
+		flush_shares(fd, mode, &batch, &blen, workernames, shares, diffs, sdiffs);
+	close(fd);
+	pthread_join(pth, NULL);
+	elapsed = elapsed_ms(&start_time);
+	close(r->sockd);
+	free(batch);
+
+	printf("%s shares: %.1f bytes/share, %.0f shares/s\n", test_modes[mode],
+	       (double)r->bytes / r->shares, r->shares / elapsed * 1000);
+}
+
+int main(int argc, char **argv)
+{
+	char workernames[TEST_WORKERS][64];
+	struct reader readers[TM_MODES];
+	double diff = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < TEST_WORKERS; i++)
+		sprintf(workernames[i], "bcrt1qlk935ze2fsu86zjp395uvtegztrkaezawxx0wf.rig%d", i);
+	for (i = 0; i < TEST_SHARES; i++)
+		diff += 1000 + i % 1000;
+
+	for (i = 0; i < TM_MODES; i++) {
+		struct reader *r = &readers[i];
+		/* Downgraded totals arrive as one share of their summed diff */
+		int shares = i == TM_TOTALS_V1 ? TEST_SHARES / TEST_FLUSH * TEST_WORKERS : TEST_SHARES;
+
+		run(i, workernames, r);
+		if (r->invalid || r->shares != shares || r->diff != diff) {
+			printf("%s shares failed to arrive intact%s: %"PRId64" %.0f of %d %.0f\n",
+			       test_modes[i], r->invalid ? " with an invalid frame" : "",
+			       r->shares, r->diff, shares, diff);
+			ret = 1;
+		}
+	}
+	if (!ret)
+		printf("All remote share tests passed.\n");
+	return ret;
+}
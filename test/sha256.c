@@ -14,6 +14,40 @@ void print_buffer_hex(const unsigned char *buffer, size_t size) {
     printf("\n");
 }
 
+static double elapsed_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (1000000.0 * (now.tv_sec - start->tv_sec) + now.tv_usec - start->tv_usec) / 1000;
+}
+
+/* Hash a merkle tree of count leaves in hashes, which has room for one more,
+ * into its root either a pair at a time with sha256() or with sha256d_pairs */
+static void merkle_root(unsigned char *hashes, int count, int pairs, unsigned char *root)
+{
+	unsigned char *level = hashes, *next = malloc((count + 1) / 2 * 32 + 32), *swap;
+	unsigned char hash1[32];
+	int i;
+
+	while (count > 1) {
+		if (count % 2)
+			memcpy(level + count * 32, level + count * 32 - 32, 32);
+		count = (count + 1) / 2;
+		if (pairs)
+			sha256d_pairs(level, next, count, NULL);
+		else for (i = 0; i < count; i++) {
+			sha256(level + i * 64, 64, hash1);
+			sha256(hash1, 32, next + i * 32);
+		}
+		swap = level;
+		level = next;
+		next = swap;
+	}
+	memcpy(root, level, 32);
+	free(level == hashes ? next : level);
+}
+
 void test(const unsigned char *input,unsigned int len,const unsigned char *expected_output)
 {
 	unsigned char output_hash[32];
@@ -109,6 +143,53 @@ int main(int argc, char **argv)
 		printf("Elapsed time=%.1fms, Managed to do %.1f SHA256 iterations/s\n",elapsed_time/1000,TEST_ITERATIONS/elapsed_time*1000000);
         }
 
+	// Check double sha256 of merkle pairs against sha256() and compare
+	// building whole merkle trees of large to very large templates
+	{
+		static const int sizes[] = {10000, 100000, 250000};
+		unsigned char *leaves, *hashes, root[32], expected_root[32];
+		unsigned char data[64], hash1[32], expected_output[32], output[32];
+		struct timeval start_time;
+		double serial, pairs;
+		int i, j;
+
+		for (i = 0; i < 64; i++)
+			data[i] = rand();
+		sha256(data, 64, hash1);
+		sha256(hash1, 32, expected_output);
+		sha256d_64(data, output);
+		if (memcmp(expected_output, output, 32)) {
+			printf("sha256d_64 hash failed to calculate correctly.\n");
+			exit(-1);
+		}
+
+		for (i = 0; i < 3; i++) {
+			leaves = malloc(sizes[i] * 32 + 32);
+			hashes = malloc(sizes[i] * 32 + 32);
+			for (j = 0; j < sizes[i] * 32; j++)
+				leaves[j] = rand();
+
+			memcpy(hashes, leaves, sizes[i] * 32);
+			gettimeofday(&start_time, NULL);
+			merkle_root(hashes, sizes[i], 0, expected_root);
+			serial = elapsed_ms(&start_time);
+
+			memcpy(hashes, leaves, sizes[i] * 32);
+			gettimeofday(&start_time, NULL);
+			merkle_root(hashes, sizes[i], 1, root);
+			pairs = elapsed_ms(&start_time);
+			if (memcmp(expected_root, root, 32)) {
+				printf("sha256d_pairs merkle root of %d failed to calculate correctly.\n",
+				       sizes[i]);
+				exit(-1);
+			}
+			printf("Merkle root of %d transactions serial=%.1fms, sha256d_pairs=%.1fms\n",
+			       sizes[i], serial, pairs);
+			free(leaves);
+			free(hashes);
+		}
+	}
+
 	printf("All sha256() tests passed.\n");
 	return(0);
 }